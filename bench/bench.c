@@ -0,0 +1,172 @@
+#define _GNU_SOURCE
+#include "bench.h"
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_BENCHES 256
+#define OUTPUT_FILE "bench_output.txt"
+
+static bench_entry_t benches[MAX_BENCHES];
+static int bench_count = 0;
+static FILE *output = NULL;
+
+void register_bench(const char *file, const char *name, bench_func func) {
+    if (bench_count < MAX_BENCHES) {
+        benches[bench_count].file = file;
+        benches[bench_count].name = name;
+        benches[bench_count].func = func;
+        bench_count++;
+    } else {
+        fprintf(stderr, "register_bench: Too many benchmarks registered!\n");
+    }
+}
+
+static int matches_filter(const bench_entry_t *b, int argc, char **argv) {
+    if (argc <= 1)
+        return 1;
+    for (int i = 1; i < argc; i++) {
+        if (strstr(b->file, argv[i]) || strstr(b->name, argv[i]))
+            return 1;
+    }
+
+    return 0;
+}
+
+void run_benchmarks(int argc, char **argv) {
+    output = fopen(OUTPUT_FILE, "w");
+    if (!output)
+        perror("run_benchmarks: " OUTPUT_FILE);
+
+    time_t now = time(NULL);
+    char date[64];
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    bench_report("# benchmarks run at %s on %ld cpus", date, sysconf(_SC_NPROCESSORS_ONLN));
+
+    int run = 0;
+    for (int i = 0; i < bench_count; i++) {
+        if (!matches_filter(&benches[i], argc, argv))
+            continue;
+
+        printf("[RUNNING] %s - %s\n", benches[i].file, benches[i].name);
+        fflush(stdout);
+        if (output)
+            fprintf(output, "\n");
+        benches[i].func();
+        run++;
+    }
+
+    printf("\n[==========] Done. Ran %d/%d benchmarks, results in %s\n", run, bench_count,
+           OUTPUT_FILE);
+    if (output)
+        fclose(output);
+}
+
+void bench_report(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    printf("\n");
+    fflush(stdout);
+
+    if (output) {
+        va_start(args, fmt);
+        vfprintf(output, fmt, args);
+        va_end(args);
+        fprintf(output, "\n");
+        fflush(output);
+    }
+}
+
+uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+int bench_latency_init(bench_latency_t *latency, size_t capacity) {
+    memset(latency, 0, sizeof(*latency));
+    void *samples = mmap(NULL, capacity * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (samples == MAP_FAILED)
+        return -1;
+
+    latency->samples = samples;
+    latency->capacity = capacity;
+    latency->rng = 0x9E3779B97F4A7C15ULL ^ (uintptr_t) latency;
+    return 0;
+}
+
+void bench_latency_destroy(bench_latency_t *latency) {
+    if (latency->samples)
+        munmap(latency->samples, latency->capacity * sizeof(uint64_t));
+    latency->samples = NULL;
+}
+
+/* reservoir sampling: every latency seen so far is kept with the same probability */
+void bench_latency_add(bench_latency_t *latency, uint64_t ns) {
+    latency->seen++;
+    if (latency->count < latency->capacity) {
+        latency->samples[latency->count++] = ns;
+        return;
+    }
+
+    latency->rng ^= latency->rng << 13;
+    latency->rng ^= latency->rng >> 7;
+    latency->rng ^= latency->rng << 17;
+    uint64_t slot = latency->rng % latency->seen;
+    if (slot < latency->capacity)
+        latency->samples[slot] = ns;
+}
+
+void bench_latency_merge(bench_latency_t *dst, const bench_latency_t *src) {
+    for (size_t i = 0; i < src->count; i++)
+        bench_latency_add(dst, src->samples[i]);
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+uint64_t bench_latency_percentile(bench_latency_t *latency, double p) {
+    if (latency->count == 0)
+        return 0;
+
+    qsort(latency->samples, latency->count, sizeof(uint64_t), compare_u64);
+    size_t idx = (size_t) (p / 100.0 * (double) (latency->count - 1) + 0.5);
+    return latency->samples[idx];
+}
+
+/* writing 5 to clear_refs resets the peak that VmHWM reports */
+void bench_rss_reset(void) {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd >= 0) {
+        ssize_t n = write(fd, "5", 1);
+        (void) n;
+        close(fd);
+    }
+}
+
+/* read without stdio, which would allocate */
+size_t bench_rss_peak_kib(void) {
+    char buf[4096];
+    int fd = open("/proc/self/status", O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+
+    char *line = strstr(buf, "VmHWM:");
+    return line ? strtoul(line + strlen("VmHWM:"), NULL, 10) : 0;
+}
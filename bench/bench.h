@@ -0,0 +1,54 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef void (*bench_func)(void);
+
+typedef struct {
+    const char *file;
+    const char *name;
+    bench_func func;
+} bench_entry_t;
+
+/* runs every registered benchmark whose file or name contains one of the arguments, or all of
+ * them without arguments; results go to stdout and to bench_output.txt */
+void run_benchmarks(int argc, char **argv);
+void register_bench(const char *file, const char *name, bench_func func);
+
+#define BENCH(name)                                                                                \
+    static void name(void);                                                                        \
+    __attribute__((constructor)) static void register_##name(void) {                               \
+        register_bench(__FILE__, #name, name);                                                     \
+    }                                                                                              \
+    static void name(void)
+
+/* writes one line of results */
+void bench_report(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+uint64_t bench_now_ns(void);
+
+/* keeps a uniform sample of at most capacity latencies out of however many are added; its memory
+ * is mapped directly so that it does not disturb the allocator being measured */
+typedef struct {
+    uint64_t *samples;
+    size_t capacity;
+    size_t count;
+    uint64_t seen;
+    uint64_t rng;
+} bench_latency_t;
+
+int bench_latency_init(bench_latency_t *latency, size_t capacity);
+void bench_latency_destroy(bench_latency_t *latency);
+void bench_latency_add(bench_latency_t *latency, uint64_t ns);
+void bench_latency_merge(bench_latency_t *dst, const bench_latency_t *src);
+
+/* p is between 0 and 100; sorts the samples */
+uint64_t bench_latency_percentile(bench_latency_t *latency, double p);
+
+/* peak resident set size since the last reset, in KiB */
+void bench_rss_reset(void);
+size_t bench_rss_peak_kib(void);
+
+#endif
@@ -0,0 +1,6 @@
+#include "bench.h"
+
+int main(int argc, char **argv) {
+    run_benchmarks(argc, argv);
+    return 0;
+}
@@ -0,0 +1,152 @@
+#include "bench.h"
+#include "concurrent_hash_table.h"
+#include "hash_table.h"
+#include "utils.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define KEY_SIZE 16
+#define TABLE_KEYS 100000
+#define OPS_PER_THREAD 1000000
+#define MAX_THREADS 8
+#define WRITE_PERCENT 10
+
+static const int thread_counts[] = {1, 2, 4, 8};
+
+/* the same workload runs against the concurrent table and against an ht_t behind one mutex */
+typedef struct {
+    cht_t *cht;
+    ht_t *ht;
+    pthread_mutex_t lock;
+    char *keys;
+} shared_table_t;
+
+typedef struct {
+    shared_table_t *table;
+    uint64_t rng;
+    size_t found;
+} worker_t;
+
+static int key_equals(const void *a, size_t alen, const void *b, size_t blen) {
+    return alen == blen && memcmp(a, b, alen) == 0;
+}
+
+static uint64_t next_random(uint64_t *rng) {
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 7;
+    *rng ^= *rng << 17;
+    return *rng;
+}
+
+static char *make_keys(size_t count) {
+    char *keys = malloc(count * KEY_SIZE);
+    if (!keys) return NULL;
+
+    for (size_t i = 0; i < count; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "key:%011zu", i);
+        memcpy(keys + i * KEY_SIZE, key, KEY_SIZE);
+    }
+    return keys;
+}
+
+/* 90% lookups that copy the value out, 10% updates of an existing key */
+static void *cht_worker(void *arg) {
+    worker_t *w = arg;
+    char val[KEY_SIZE];
+    for (size_t i = 0; i < OPS_PER_THREAD; i++) {
+        uint64_t r = next_random(&w->rng);
+        char *key = w->table->keys + (r % TABLE_KEYS) * KEY_SIZE;
+        if ((r >> 32) % 100 < WRITE_PERCENT)
+            cht_set(w->table->cht, key, KEY_SIZE - 1, key, KEY_SIZE);
+        else
+            w->found += cht_get(w->table->cht, key, KEY_SIZE - 1, val, sizeof(val), NULL) == HT_OK;
+    }
+    return NULL;
+}
+
+static void *locked_worker(void *arg) {
+    worker_t *w = arg;
+    char val[KEY_SIZE];
+    for (size_t i = 0; i < OPS_PER_THREAD; i++) {
+        uint64_t r = next_random(&w->rng);
+        char *key = w->table->keys + (r % TABLE_KEYS) * KEY_SIZE;
+        pthread_mutex_lock(&w->table->lock);
+        if ((r >> 32) % 100 < WRITE_PERCENT) {
+            ht_set(w->table->ht, key, KEY_SIZE - 1, key, KEY_SIZE);
+        } else {
+            void *found;
+            if (ht_get(w->table->ht, key, KEY_SIZE - 1, &found) == HT_OK) {
+                memcpy(val, found, sizeof(val));
+                w->found++;
+            }
+        }
+        pthread_mutex_unlock(&w->table->lock);
+    }
+    return NULL;
+}
+
+static void run_threads(const char *name, shared_table_t *table, void *(*worker)(void *)) {
+    for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+        int threads = thread_counts[t];
+        pthread_t ids[MAX_THREADS];
+        worker_t workers[MAX_THREADS];
+
+        int started = 0;
+        uint64_t start = bench_now_ns();
+        for (; started < threads; started++) {
+            workers[started] = (worker_t) {table, 0x2545F4914F6CDD1DULL + started, 0};
+            if (pthread_create(&ids[started], NULL, worker, &workers[started]) != 0) break;
+        }
+
+        size_t found = 0;
+        for (int i = 0; i < started; i++) {
+            pthread_join(ids[i], NULL);
+            found += workers[i].found;
+        }
+        uint64_t elapsed_ns = bench_now_ns() - start;
+
+        if (started != threads || found == 0) {
+            bench_report("%-12s %8d failed", name, threads);
+            continue;
+        }
+
+        double ops = (double) OPS_PER_THREAD * threads;
+        bench_report("%-12s %8d %14.0f %8.1f", name, threads, ops * 1e9 / (double) elapsed_ns,
+                     (double) elapsed_ns / ops);
+    }
+}
+
+/* total throughput of a read-mostly mix as threads are added */
+BENCH(cht_read_mostly) {
+    bench_report("%-12s %8s %14s %8s", "table", "threads", "ops/sec", "ns/op");
+
+    shared_table_t table = {.keys = make_keys(TABLE_KEYS)};
+    ht_config_t config = {
+        .hash = fnv1a64,
+        .equals = key_equals,
+        .seed = 0x9E3779B97F4A7C15ULL,
+    };
+    table.cht = cht_create(&config);
+    table.ht = ht_create(&config);
+    pthread_mutex_init(&table.lock, NULL);
+
+    if (!table.keys || !table.cht || !table.ht) {
+        bench_report("read mostly: out of memory");
+    } else {
+        for (size_t i = 0; i < TABLE_KEYS; i++) {
+            char *key = table.keys + i * KEY_SIZE;
+            cht_set(table.cht, key, KEY_SIZE - 1, key, KEY_SIZE);
+            ht_set(table.ht, key, KEY_SIZE - 1, key, KEY_SIZE);
+        }
+        run_threads("cht", &table, cht_worker);
+        run_threads("ht + mutex", &table, locked_worker);
+    }
+
+    pthread_mutex_destroy(&table.lock);
+    if (table.ht) ht_destroy(table.ht);
+    if (table.cht) cht_destroy(table.cht);
+    free(table.keys);
+}
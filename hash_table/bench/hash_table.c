@@ -0,0 +1,725 @@
+#include "allocator.h"
+#include "bench.h"
+#include "hash_table.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define KEY_SIZE 16
+#define LOOKUP_OPS 4000000
+#define CHURN_OPS 2000000
+#define LATENCY_KEYS 4000000
+#define SMALL_KEYS 1000000
+#define BATCH_SIZE 32
+#define PURGE_KEYS 1000000
+#define PURGE_KEEP 1000
+#define COUNTER_OPS 4000000
+#define HASHED_KEYS 100000
+#define EXPIRY_KEYS 1000000
+#define EXPIRY_TTL_KEYS 100000
+#define EXPIRY_TICKS 100
+#define CACHE_KEYS 1000000
+#define CACHE_ENTRIES 100000
+#define CACHE_OPS 4000000
+#define CACHE_SCAN_PERCENT 10
+
+typedef struct {
+    const char *name;
+    ht_backend_t backend;
+} bench_backend_t;
+
+static const bench_backend_t backends[] = {
+    {"chained", HT_BACKEND_CHAINED},
+    {"swiss", HT_BACKEND_SWISS},
+};
+
+static const size_t table_sizes[] = {1000, 16000, 256000, 1000000};
+
+/* a workload gets an empty table and 2 * count keys, leaves keys 0 to count - 1 in the table
+ * and returns the number of operations it timed */
+typedef uint64_t (*table_workload_func)(ht_t *ht, char *keys, size_t count, uint64_t *elapsed_ns);
+
+static int key_equals(const void *a, size_t alen, const void *b, size_t blen) {
+    return alen == blen && memcmp(a, b, alen) == 0;
+}
+
+/* keys are fixed-size strings that the table points into rather than copies */
+static char *make_keys(size_t count) {
+    char *keys = malloc(count * KEY_SIZE);
+    if (!keys) return NULL;
+
+    for (size_t i = 0; i < count; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "key:%011zu", i);
+        memcpy(keys + i * KEY_SIZE, key, KEY_SIZE);
+    }
+    return keys;
+}
+
+static ht_t *table_create_shrinking(ht_backend_t backend, int incremental_resize, int shrink) {
+    ht_config_t config = {
+        .hash = fnv1a64,
+        .equals = key_equals,
+        .seed = 0x9E3779B97F4A7C15ULL,
+        .backend = backend,
+        .incremental_resize = incremental_resize,
+        .min_load_factor = shrink ? 0 : -1,
+    };
+    return ht_create(&config);
+}
+
+static ht_t *table_create(ht_backend_t backend, int incremental_resize) {
+    return table_create_shrinking(backend, incremental_resize, 1);
+}
+
+static void table_fill(ht_t *ht, char *keys, size_t count) {
+    for (size_t i = 0; i < count; i++)
+        ht_set(ht, keys + i * KEY_SIZE, KEY_SIZE - 1, keys + i * KEY_SIZE, KEY_SIZE);
+}
+
+static uint64_t next_random(uint64_t *rng) {
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 7;
+    *rng ^= *rng << 17;
+    return *rng;
+}
+
+static uint64_t insert(ht_t *ht, char *keys, size_t count, uint64_t *elapsed_ns) {
+    uint64_t start = bench_now_ns();
+    table_fill(ht, keys, count);
+    *elapsed_ns = bench_now_ns() - start;
+    return count;
+}
+
+static uint64_t lookup(ht_t *ht, char *keys, size_t count, size_t first, uint64_t *elapsed_ns) {
+    uint64_t rng = 0x2545F4914F6CDD1DULL;
+    size_t found = 0;
+    void *val;
+
+    table_fill(ht, keys, count);
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < LOOKUP_OPS; i++) {
+        char *key = keys + (first + next_random(&rng) % count) * KEY_SIZE;
+        found += ht_get(ht, key, KEY_SIZE - 1, &val) == HT_OK;
+    }
+    *elapsed_ns = bench_now_ns() - start;
+
+    if (found != (first == 0 ? LOOKUP_OPS : 0)) return 0;
+    return LOOKUP_OPS;
+}
+
+static uint64_t lookup_hits(ht_t *ht, char *keys, size_t count, uint64_t *elapsed_ns) {
+    return lookup(ht, keys, count, 0, elapsed_ns);
+}
+
+static uint64_t lookup_misses(ht_t *ht, char *keys, size_t count, uint64_t *elapsed_ns) {
+    return lookup(ht, keys, count, count, elapsed_ns);
+}
+
+/* slides the window of keys in the table along the 2 * count keys, deleting the oldest key and
+ * inserting the next one; leaves the table holding the keys it started with */
+static uint64_t churn(ht_t *ht, char *keys, size_t count, uint64_t *elapsed_ns) {
+    size_t ops = CHURN_OPS - CHURN_OPS % (2 * count);
+    table_fill(ht, keys, count);
+
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < ops; i++) {
+        char *old_key = keys + (i % (2 * count)) * KEY_SIZE;
+        char *new_key = keys + ((i + count) % (2 * count)) * KEY_SIZE;
+        ht_delete(ht, old_key, KEY_SIZE - 1);
+        ht_set(ht, new_key, KEY_SIZE - 1, new_key, KEY_SIZE);
+    }
+    *elapsed_ns = bench_now_ns() - start;
+
+    return 2 * ops;
+}
+
+static void run_table_workload(const char *name, table_workload_func workload) {
+    bench_report("%-16s %-10s %10s %12s %8s", "workload", "backend", "keys", "ops/sec", "ns/op");
+
+    for (size_t s = 0; s < sizeof(table_sizes) / sizeof(table_sizes[0]); s++) {
+        size_t count = table_sizes[s];
+        char *keys = make_keys(2 * count);
+        if (!keys) {
+            bench_report("%-16s %10zu keys: out of memory", name, count);
+            continue;
+        }
+
+        for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+            ht_t *ht = table_create(backends[b].backend, 0);
+            if (!ht) {
+                bench_report("%-16s %-10s %10zu failed", name, backends[b].name, count);
+                continue;
+            }
+
+            uint64_t elapsed_ns = 0;
+            uint64_t ops = workload(ht, keys, count, &elapsed_ns);
+            if (ops == 0 || ht_size(ht) != count) {
+                bench_report("%-16s %-10s %10zu failed", name, backends[b].name, count);
+            } else {
+                double ns_per_op = (double) elapsed_ns / (double) ops;
+                bench_report("%-16s %-10s %10zu %12.0f %8.1f", name, backends[b].name, count,
+                             1e9 / ns_per_op, ns_per_op);
+            }
+            ht_destroy(ht);
+        }
+        free(keys);
+    }
+}
+
+BENCH(ht_insert) {
+    run_table_workload("insert", insert);
+}
+
+BENCH(ht_lookup_hits) {
+    run_table_workload("lookup hits", lookup_hits);
+}
+
+BENCH(ht_lookup_misses) {
+    run_table_workload("lookup misses", lookup_misses);
+}
+
+BENCH(ht_churn) {
+    run_table_workload("delete/insert", churn);
+}
+
+/* the time single inserts take while a table grows, where a resize that moves every entry at
+ * once shows up as the tail */
+BENCH(ht_insert_latency) {
+    bench_report("%-16s %-10s %-12s %8s %10s %10s %10s", "workload", "backend", "resize",
+                 "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+
+    char *keys = make_keys(LATENCY_KEYS);
+    bench_latency_t latency;
+    if (!keys || bench_latency_init(&latency, LATENCY_KEYS) != 0) {
+        bench_report("insert latency: out of memory");
+        free(keys);
+        return;
+    }
+
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        for (int incremental = 0; incremental < 2; incremental++) {
+            const char *resize = incremental ? "incremental" : "at once";
+            ht_t *ht = table_create(backends[b].backend, incremental);
+            if (!ht) {
+                bench_report("%-16s %-10s %-12s failed", "insert", backends[b].name, resize);
+                continue;
+            }
+
+            latency.count = 0;
+            latency.seen = 0;
+            uint64_t max_ns = 0;
+            for (size_t i = 0; i < LATENCY_KEYS; i++) {
+                char *key = keys + i * KEY_SIZE;
+                uint64_t start = bench_now_ns();
+                ht_set(ht, key, KEY_SIZE - 1, key, KEY_SIZE);
+                uint64_t ns = bench_now_ns() - start;
+                bench_latency_add(&latency, ns);
+                if (ns > max_ns) max_ns = ns;
+            }
+
+            bench_report("%-16s %-10s %-12s %8llu %10llu %10llu %10llu", "insert",
+                         backends[b].name, resize,
+                         (unsigned long long) bench_latency_percentile(&latency, 50),
+                         (unsigned long long) bench_latency_percentile(&latency, 99),
+                         (unsigned long long) bench_latency_percentile(&latency, 99.9),
+                         (unsigned long long) max_ns);
+            ht_destroy(ht);
+        }
+    }
+
+    bench_latency_destroy(&latency);
+    free(keys);
+}
+
+static void *dup_bytes(const void *src, size_t size) {
+    void *dest = alloc_mem(size);
+    if (dest) memcpy(dest, src, size);
+    return dest;
+}
+
+/* integer keys and values, copied into the heap through the dup functions or kept inline */
+BENCH(ht_small_keys) {
+    bench_report("%-10s %-10s %10s %10s %10s", "backend", "storage", "insert ns", "lookup ns",
+                 "delete ns");
+
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        for (int inline_small = 0; inline_small < 2; inline_small++) {
+            const char *storage = inline_small ? "inline" : "dup";
+            ht_config_t config = {
+                .hash = fnv1a64,
+                .equals = key_equals,
+                .dup_key = dup_bytes,
+                .dup_val = dup_bytes,
+                .free_key = free_mem,
+                .free_val = free_mem,
+                .seed = 0x9E3779B97F4A7C15ULL,
+                .backend = backends[b].backend,
+                .inline_small = inline_small,
+            };
+            ht_t *ht = ht_create(&config);
+            if (!ht) {
+                bench_report("%-10s %-10s failed", backends[b].name, storage);
+                continue;
+            }
+
+            uint64_t start = bench_now_ns();
+            for (uint64_t id = 0; id < SMALL_KEYS; id++)
+                ht_set(ht, &id, sizeof(id), &id, sizeof(id));
+            uint64_t insert_ns = bench_now_ns() - start;
+
+            uint64_t rng = 0x2545F4914F6CDD1DULL;
+            size_t found = 0;
+            void *val;
+            start = bench_now_ns();
+            for (size_t i = 0; i < LOOKUP_OPS; i++) {
+                uint64_t id = next_random(&rng) % SMALL_KEYS;
+                found += ht_get(ht, &id, sizeof(id), &val) == HT_OK && *(uint64_t *) val == id;
+            }
+            uint64_t lookup_ns = bench_now_ns() - start;
+
+            start = bench_now_ns();
+            for (uint64_t id = 0; id < SMALL_KEYS; id++)
+                ht_delete(ht, &id, sizeof(id));
+            uint64_t delete_ns = bench_now_ns() - start;
+
+            if (found != LOOKUP_OPS || ht_size(ht) != 0)
+                bench_report("%-10s %-10s failed", backends[b].name, storage);
+            else
+                bench_report("%-10s %-10s %10.1f %10.1f %10.1f", backends[b].name, storage,
+                             (double) insert_ns / SMALL_KEYS, (double) lookup_ns / LOOKUP_OPS,
+                             (double) delete_ns / SMALL_KEYS);
+            ht_destroy(ht);
+        }
+    }
+}
+
+static const size_t batch_table_sizes[] = {1000, 16000, 256000, 1000000, 4000000};
+
+/* random lookups and updates of keys in the table, one call per key or BATCH_SIZE keys per call */
+static double batch_run(ht_t *ht, char *keys, size_t count, int set, int batched) {
+    uint64_t rng = 0x2545F4914F6CDD1DULL;
+    const void *batch[BATCH_SIZE];
+    size_t lens[BATCH_SIZE];
+    void *vals[BATCH_SIZE];
+    size_t found = 0;
+
+    for (size_t i = 0; i < BATCH_SIZE; i++)
+        lens[i] = KEY_SIZE - 1;
+
+    uint64_t start = bench_now_ns();
+    for (size_t op = 0; op < LOOKUP_OPS; op += BATCH_SIZE) {
+        for (size_t i = 0; i < BATCH_SIZE; i++)
+            batch[i] = keys + (next_random(&rng) % count) * KEY_SIZE;
+
+        if (batched) {
+            ht_err_t err = set ? ht_set_many(ht, BATCH_SIZE, batch, lens, batch, lens)
+                               : ht_get_many(ht, BATCH_SIZE, batch, lens, vals, NULL);
+            found += err == HT_OK ? BATCH_SIZE : 0;
+        } else {
+            for (size_t i = 0; i < BATCH_SIZE; i++) {
+                if (set)
+                    found += ht_set(ht, batch[i], lens[i], batch[i], lens[i]) == HT_OK;
+                else
+                    found += ht_get(ht, batch[i], lens[i], &vals[i]) == HT_OK;
+            }
+        }
+    }
+    uint64_t elapsed_ns = bench_now_ns() - start;
+
+    if (found != LOOKUP_OPS) return -1;
+    return (double) elapsed_ns / LOOKUP_OPS;
+}
+
+/* a loop of single lookups and updates against the batch calls, over tables that grow from
+ * cache-resident to far beyond the last-level cache */
+BENCH(ht_batch) {
+    bench_report("%-10s %10s %12s %12s %12s %12s", "backend", "keys", "get ns", "get_many ns",
+                 "set ns", "set_many ns");
+
+    for (size_t s = 0; s < sizeof(batch_table_sizes) / sizeof(batch_table_sizes[0]); s++) {
+        size_t count = batch_table_sizes[s];
+        char *keys = make_keys(count);
+        if (!keys) {
+            bench_report("batch %zu keys: out of memory", count);
+            continue;
+        }
+
+        for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+            ht_t *ht = table_create(backends[b].backend, 0);
+            if (!ht) {
+                bench_report("%-10s %10zu failed", backends[b].name, count);
+                continue;
+            }
+
+            table_fill(ht, keys, count);
+            double ns[4];
+            for (int run = 0; run < 4; run++)
+                ns[run] = batch_run(ht, keys, count, run / 2, run % 2);
+
+            if (ns[0] < 0 || ns[1] < 0 || ns[2] < 0 || ns[3] < 0)
+                bench_report("%-10s %10zu failed", backends[b].name, count);
+            else
+                bench_report("%-10s %10zu %12.1f %12.1f %12.1f %12.1f", backends[b].name, count,
+                             ns[0], ns[1], ns[2], ns[3]);
+            ht_destroy(ht);
+        }
+        free(keys);
+    }
+}
+
+/* a bulk load with and without ht_reserve */
+BENCH(ht_bulk_load) {
+    bench_report("%-10s %10s %12s %12s", "backend", "keys", "insert ns", "reserved ns");
+
+    char *keys = make_keys(PURGE_KEYS);
+    if (!keys) {
+        bench_report("reserve: out of memory");
+        return;
+    }
+
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        double ns[2];
+        for (int reserve = 0; reserve < 2; reserve++) {
+            ns[reserve] = -1;
+            ht_t *ht = table_create(backends[b].backend, 0);
+            if (!ht) continue;
+
+            uint64_t start = bench_now_ns();
+            if (reserve) ht_reserve(ht, PURGE_KEYS);
+            table_fill(ht, keys, PURGE_KEYS);
+            if (ht_size(ht) == PURGE_KEYS)
+                ns[reserve] = (double) (bench_now_ns() - start) / PURGE_KEYS;
+            ht_destroy(ht);
+        }
+
+        if (ns[0] < 0 || ns[1] < 0)
+            bench_report("%-10s %10d failed", backends[b].name, PURGE_KEYS);
+        else
+            bench_report("%-10s %10d %12.1f %12.1f", backends[b].name, PURGE_KEYS, ns[0], ns[1]);
+    }
+    free(keys);
+}
+
+/* a table that held a million keys and was purged down to a thousand: deleting them, iterating
+ * what is left and clearing it, with and without automatic shrinking */
+BENCH(ht_purge) {
+    bench_report("%-10s %-8s %10s %10s %12s %10s", "backend", "shrink", "delete ns", "capacity",
+                 "iterate us", "clear us");
+
+    char *keys = make_keys(PURGE_KEYS);
+    if (!keys) {
+        bench_report("purge: out of memory");
+        return;
+    }
+
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        for (int shrink = 0; shrink < 2; shrink++) {
+            const char *name = shrink ? "on" : "off";
+            ht_t *ht = table_create_shrinking(backends[b].backend, 0, shrink);
+            if (!ht) {
+                bench_report("%-10s %-8s failed", backends[b].name, name);
+                continue;
+            }
+
+            table_fill(ht, keys, PURGE_KEYS);
+            uint64_t start = bench_now_ns();
+            for (size_t i = PURGE_KEEP; i < PURGE_KEYS; i++)
+                ht_delete(ht, keys + i * KEY_SIZE, KEY_SIZE - 1);
+            double delete_ns = (double) (bench_now_ns() - start) / (PURGE_KEYS - PURGE_KEEP);
+
+            start = bench_now_ns();
+            size_t seen = 0;
+            ht_iter_t hi = ht_iter_begin(ht);
+            while (ht_iter_next(&hi, NULL, NULL, NULL))
+                seen++;
+            uint64_t iterate_ns = bench_now_ns() - start;
+
+            size_t capacity = ht_capacity(ht);
+            start = bench_now_ns();
+            ht_clear(ht);
+            uint64_t clear_ns = bench_now_ns() - start;
+
+            if (seen != PURGE_KEEP)
+                bench_report("%-10s %-8s failed", backends[b].name, name);
+            else
+                bench_report("%-10s %-8s %10.1f %10zu %12.1f %10.1f", backends[b].name, name,
+                             delete_ns, capacity, iterate_ns / 1e3, clear_ns / 1e3);
+            ht_destroy(ht);
+        }
+    }
+    free(keys);
+}
+
+/* counting occurrences of random keys with a copied int per key: ht_get then ht_set against a
+ * single ht_get_or_insert that increments the value in place */
+BENCH(ht_counter) {
+    static const size_t counter_sizes[] = {1000, 256000};
+    bench_report("%-10s %10s %14s %14s", "backend", "keys", "get+set ns", "get_or_ins ns");
+
+    for (size_t s = 0; s < sizeof(counter_sizes) / sizeof(counter_sizes[0]); s++) {
+        size_t count = counter_sizes[s];
+        char *keys = make_keys(count);
+        if (!keys) {
+            bench_report("counter %zu keys: out of memory", count);
+            continue;
+        }
+
+        for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+            double ns[2] = {-1, -1};
+            for (int entry_api = 0; entry_api < 2; entry_api++) {
+                ht_config_t config = {
+                    .hash = fnv1a64,
+                    .equals = key_equals,
+                    .dup_key = dup_bytes,
+                    .dup_val = dup_bytes,
+                    .free_key = free_mem,
+                    .free_val = free_mem,
+                    .seed = 0x9E3779B97F4A7C15ULL,
+                    .backend = backends[b].backend,
+                };
+                ht_t *ht = ht_create(&config);
+                if (!ht) continue;
+
+                uint64_t rng = 0x2545F4914F6CDD1DULL;
+                uint64_t start = bench_now_ns();
+                for (size_t i = 0; i < COUNTER_OPS; i++) {
+                    char *key = keys + (next_random(&rng) % count) * KEY_SIZE;
+                    void *val;
+                    if (entry_api) {
+                        int zero = 0;
+                        ht_get_or_insert(ht, key, KEY_SIZE - 1, &zero, sizeof(zero), &val, NULL);
+                        (*(int *) val)++;
+                    } else {
+                        int n = ht_get(ht, key, KEY_SIZE - 1, &val) == HT_OK ? *(int *) val : 0;
+                        n++;
+                        ht_set(ht, key, KEY_SIZE - 1, &n, sizeof(n));
+                    }
+                }
+                uint64_t elapsed_ns = bench_now_ns() - start;
+
+                size_t total = 0;
+                ht_iter_t hi = ht_iter_begin(ht);
+                void *val;
+                while (ht_iter_next(&hi, NULL, NULL, &val))
+                    total += *(int *) val;
+                if (total == COUNTER_OPS) ns[entry_api] = (double) elapsed_ns / COUNTER_OPS;
+                ht_destroy(ht);
+            }
+
+            if (ns[0] < 0 || ns[1] < 0)
+                bench_report("%-10s %10zu failed", backends[b].name, count);
+            else
+                bench_report("%-10s %10zu %14.1f %14.1f", backends[b].name, count, ns[0], ns[1]);
+        }
+        free(keys);
+    }
+}
+
+/* lookups of keys of growing length, hashing each key against passing the hash computed when the
+ * key was stored */
+BENCH(ht_prehashed) {
+    static const size_t key_sizes[] = {16, 64, 256, 1024};
+    bench_report("%-10s %10s %12s %12s", "backend", "key bytes", "get ns", "hashed ns");
+
+    for (size_t k = 0; k < sizeof(key_sizes) / sizeof(key_sizes[0]); k++) {
+        size_t key_size = key_sizes[k];
+        char *keys = malloc(HASHED_KEYS * key_size);
+        uint64_t *hashes = malloc(HASHED_KEYS * sizeof(uint64_t));
+        if (!keys || !hashes) {
+            bench_report("prehashed: out of memory");
+            free(keys);
+            free(hashes);
+            continue;
+        }
+
+        for (size_t i = 0; i < HASHED_KEYS; i++) {
+            char *key = keys + i * key_size;
+            memset(key, 'k', key_size);
+            snprintf(key, key_size, "%011zu", i);
+            key[11] = 'k';
+        }
+
+        for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+            ht_t *ht = table_create(backends[b].backend, 0);
+            if (!ht) {
+                bench_report("%-10s %10zu failed", backends[b].name, key_size);
+                continue;
+            }
+
+            for (size_t i = 0; i < HASHED_KEYS; i++) {
+                char *key = keys + i * key_size;
+                hashes[i] = ht_hash(ht, key, key_size);
+                ht_set_hashed(ht, key, key_size, hashes[i], key, key_size);
+            }
+
+            double ns[2];
+            for (int hashed = 0; hashed < 2; hashed++) {
+                uint64_t rng = 0x2545F4914F6CDD1DULL;
+                size_t found = 0;
+                void *val;
+                uint64_t start = bench_now_ns();
+                for (size_t i = 0; i < LOOKUP_OPS; i++) {
+                    size_t n = next_random(&rng) % HASHED_KEYS;
+                    char *key = keys + n * key_size;
+                    ht_err_t err = hashed ? ht_get_hashed(ht, key, key_size, hashes[n], &val)
+                                          : ht_get(ht, key, key_size, &val);
+                    found += err == HT_OK;
+                }
+                ns[hashed] = found == LOOKUP_OPS
+                                 ? (double) (bench_now_ns() - start) / LOOKUP_OPS
+                                 : -1;
+            }
+
+            if (ns[0] < 0 || ns[1] < 0)
+                bench_report("%-10s %10zu failed", backends[b].name, key_size);
+            else
+                bench_report("%-10s %10zu %12.1f %12.1f", backends[b].name, key_size, ns[0], ns[1]);
+            ht_destroy(ht);
+        }
+        free(keys);
+        free(hashes);
+    }
+}
+
+static uint64_t bench_clock_now;
+
+static uint64_t bench_clock(void) {
+    return bench_clock_now;
+}
+
+/* a million permanent keys and a hundred thousand with ttls spread over a hundred ticks of the
+ * clock: deleting what expired each tick with ht_expire_step, against one pass over the table,
+ * which is what finding expired keys by scanning costs per tick */
+BENCH(ht_expiry) {
+    bench_report("%-10s %14s %14s %16s", "backend", "step us/tick", "scan us/tick",
+                 "step ns/expired");
+
+    char *keys = make_keys(EXPIRY_KEYS + EXPIRY_TTL_KEYS);
+    if (!keys) {
+        bench_report("expiry: out of memory");
+        return;
+    }
+
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        ht_config_t config = {
+            .hash = fnv1a64,
+            .equals = key_equals,
+            .seed = 0x9E3779B97F4A7C15ULL,
+            .backend = backends[b].backend,
+            .clock = bench_clock,
+        };
+        ht_t *ht = ht_create(&config);
+        if (!ht) {
+            bench_report("%-10s failed", backends[b].name);
+            continue;
+        }
+
+        bench_clock_now = 0;
+        uint64_t rng = 0x2545F4914F6CDD1DULL;
+        table_fill(ht, keys, EXPIRY_KEYS);
+        for (size_t i = EXPIRY_KEYS; i < EXPIRY_KEYS + EXPIRY_TTL_KEYS; i++) {
+            char *key = keys + i * KEY_SIZE;
+            ht_set_ttl(ht, key, KEY_SIZE - 1, key, KEY_SIZE, 1 + next_random(&rng) % EXPIRY_TICKS);
+        }
+
+        uint64_t scan_ns = 0;
+        for (int tick = 0; tick < 10; tick++) {
+            uint64_t start = bench_now_ns();
+            ht_iter_t hi = ht_iter_begin(ht);
+            while (ht_iter_next(&hi, NULL, NULL, NULL))
+                ;
+            scan_ns += bench_now_ns() - start;
+        }
+
+        size_t expired = 0;
+        uint64_t step_ns = 0;
+        for (int tick = 0; tick < EXPIRY_TICKS; tick++) {
+            bench_clock_now++;
+            uint64_t start = bench_now_ns();
+            expired += ht_expire_step(ht, SIZE_MAX);
+            step_ns += bench_now_ns() - start;
+        }
+
+        if (expired != EXPIRY_TTL_KEYS || ht_size(ht) != EXPIRY_KEYS)
+            bench_report("%-10s failed", backends[b].name);
+        else
+            bench_report("%-10s %14.1f %14.1f %16.1f", backends[b].name,
+                         step_ns / 1e3 / EXPIRY_TICKS, scan_ns / 1e3 / 10,
+                         (double) step_ns / (double) expired);
+        ht_destroy(ht);
+    }
+    free(keys);
+}
+
+static const size_t eviction_samples[] = {1, 5, 16};
+
+/* the cache-aside pattern over a million keys, a cache of a tenth of them in front: every lookup
+ * that misses adds its key. most lookups pick a key skewed towards the first ones, the others a
+ * key of a scan through all of them that is never looked up again */
+BENCH(ht_cache) {
+    bench_report("%-10s %-6s %8s %10s %10s %8s", "backend", "policy", "samples", "hit rate",
+                 "evictions", "ns/op");
+
+    char *keys = make_keys(CACHE_KEYS);
+    if (!keys) {
+        bench_report("cache: out of memory");
+        return;
+    }
+
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        for (int lfu = 0; lfu < 2; lfu++) {
+            for (size_t s = 0; s < sizeof(eviction_samples) / sizeof(eviction_samples[0]); s++) {
+                ht_config_t config = {
+                    .hash = fnv1a64,
+                    .equals = key_equals,
+                    .seed = 0x9E3779B97F4A7C15ULL,
+                    .backend = backends[b].backend,
+                    .eviction = lfu ? HT_EVICT_LFU : HT_EVICT_LRU,
+                    .eviction_samples = eviction_samples[s],
+                };
+
+                /* every entry is as big as the first */
+                ht_t *ht = ht_create(&config);
+                if (ht) ht_set(ht, keys, KEY_SIZE - 1, keys, KEY_SIZE);
+                config.max_bytes = ht ? CACHE_ENTRIES * ht_stats(ht).bytes : 0;
+                ht_destroy(ht);
+                ht = config.max_bytes ? ht_create(&config) : NULL;
+                if (!ht) {
+                    bench_report("%-10s failed", backends[b].name);
+                    continue;
+                }
+
+                uint64_t rng = 0x2545F4914F6CDD1DULL;
+                size_t scan = 0;
+                uint64_t start = bench_now_ns();
+                for (size_t i = 0; i < CACHE_OPS; i++) {
+                    uint64_t r = next_random(&rng);
+                    size_t k;
+                    if (r % 100 < CACHE_SCAN_PERCENT) {
+                        k = scan++ % CACHE_KEYS;
+                    } else {
+                        double u = (double) (r >> 11) / (double) (1ULL << 53);
+                        k = (size_t) (u * u * u * u * CACHE_KEYS);
+                    }
+
+                    char *key = keys + k * KEY_SIZE;
+                    void *val;
+                    if (ht_get(ht, key, KEY_SIZE - 1, &val) != HT_OK)
+                        ht_set(ht, key, KEY_SIZE - 1, key, KEY_SIZE);
+                }
+                uint64_t elapsed_ns = bench_now_ns() - start;
+
+                ht_stats_t stats = ht_stats(ht);
+                bench_report("%-10s %-6s %8zu %9.1f%% %10llu %8.1f", backends[b].name,
+                             lfu ? "lfu" : "lru", eviction_samples[s],
+                             100.0 * (double) stats.hits / (double) (stats.hits + stats.misses),
+                             (unsigned long long) stats.evictions,
+                             (double) elapsed_ns / CACHE_OPS);
+                ht_destroy(ht);
+            }
+        }
+    }
+    free(keys);
+}
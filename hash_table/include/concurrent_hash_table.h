@@ -0,0 +1,34 @@
+#ifndef CONCURRENT_HASH_TABLE_H
+#define CONCURRENT_HASH_TABLE_H
+
+#include "hash_table.h"
+#include <stddef.h>
+
+/* a hash table that any number of threads may use at once. lookups take no lock; writers lock
+ * one of a fixed set of stripes, picked by the key's hash, and a resize takes all of them.
+ * removed entries and replaced arrays are freed once no lookup can still be reading them */
+typedef struct cht cht_t;
+
+/* takes the same configuration as ht_create, apart from the arena, which is not thread-safe, and
+ * max_bytes, as it does not evict; the backend, incremental_resize, inline_small,
+ * min_load_factor, clock and the other eviction settings do not apply */
+cht_t *cht_create(const ht_config_t *cfg);
+
+/* no other thread may be using the table */
+void cht_destroy(cht_t *cht);
+
+ht_err_t cht_set(cht_t *cht, const void *key, size_t key_len, const void *val, size_t val_len);
+
+/* copies up to buf_len bytes of the value into buf and stores its full length in val_len, as
+ * another thread may free the value as soon as the lookup is over */
+ht_err_t cht_get(cht_t *cht, const void *key, size_t key_len, void *buf, size_t buf_len,
+                 size_t *val_len);
+
+ht_err_t cht_has(cht_t *cht, const void *key, size_t key_len);
+
+ht_err_t cht_delete(cht_t *cht, const void *key, size_t key_len);
+
+size_t cht_size(cht_t *cht);
+size_t cht_capacity(cht_t *cht);
+
+#endif
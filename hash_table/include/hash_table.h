@@ -1,6 +1,7 @@
 #ifndef HASH_TABLE_H
 #define HASH_TABLE_H
 
+#include "arena.h"
 #include <stddef.h>
 #include <stdint.h>
 
@@ -9,11 +10,38 @@ typedef enum {
     HT_ERR = -1,
     HT_ENONEM = -2,
     HT_ENOTFOUND = -3,
-    HT_EEXISTS = -4
+    HT_EEXISTS = -4,
+    HT_EMISMATCH = -5
 } ht_err_t;
 
 typedef struct ht ht_t;
 
+/* the largest key or value that inline_small keeps in the table's own entries. by default it is
+ * the size of the pointer it shares room with, so entries are no bigger than without it; a larger
+ * size, such as -DHT_INLINE_SIZE=16, makes every entry grow by the difference, twice */
+#ifndef HT_INLINE_SIZE
+#define HT_INLINE_SIZE 8
+#endif
+
+/* the longest key or value a table stores */
+#define HT_MAX_LEN UINT32_MAX
+
+/* the ttl ht_ttl reports for a key that does not expire */
+#define HT_NO_EXPIRY UINT64_MAX
+
+/* HT_BACKEND_CHAINED keeps an array of entries per bucket; HT_BACKEND_SWISS stores the entries
+ * in one open-addressed array and probes a byte of metadata per slot, 16 slots at a time */
+typedef enum { HT_BACKEND_CHAINED = 0, HT_BACKEND_SWISS } ht_backend_t;
+
+/* which of the sampled keys a cache evicts: the one used least recently, or the one used least
+ * often, as counted by a per-key counter that grows logarithmically and decays as other keys are
+ * used. a sampled key that has expired is always taken first */
+typedef enum { HT_EVICT_LRU = 0, HT_EVICT_LFU } ht_eviction_t;
+
+/* called with each key a cache evicts, just before it is released */
+typedef void (*ht_evict_func)(const void *key, size_t key_len, void *val, size_t val_len,
+                              void *ctx);
+
 typedef struct {
     uint64_t (*hash)(const void *key, size_t len, uint64_t seed);
     int (*equals)(const void *a, size_t alen, const void *b, size_t blen);
@@ -27,8 +55,53 @@ typedef struct {
     uint64_t seed;
     double load_factor;
     size_t initial_capacity;
+
+    /* when set, keys and values are copied into the arena instead of going through
+     * dup_key/dup_val, and are released with the arena rather than through free_key/free_val */
+    arena_t *arena;
+
+    ht_backend_t backend;
+
+    /* when set, a resize moves the entries to the new table a few buckets at a time on later
+     * ht_set and ht_delete calls instead of all at once, so that no single call stalls */
+    int incremental_resize;
+
+    /* when set, keys and values of 1 to HT_INLINE_SIZE bytes are copied into the entry itself and
+     * never go through dup_key/dup_val, free_key/free_val or the arena. the pointers that ht_get
+     * and the iterator hand out for them point into the table and only stay valid until the next
+     * call that can delete or add a key, which once keys expire includes ht_get */
+    int inline_small;
+
+    /* the load under which ht_delete shrinks the table, never below the capacity it was created
+     * with; 0 means a quarter of load_factor and a negative value turns shrinking off */
+    double min_load_factor;
+
+    /* the current time, in whatever unit ttls are given in; milliseconds of CLOCK_MONOTONIC when
+     * NULL. it is only called for keys that have been given a ttl */
+    uint64_t (*clock)(void);
+
+    /* when not 0 the table is a cache, which keeps the bytes ht_stats reports at or under
+     * max_bytes: a key that does not fit is added after evicting others, each one the pick of
+     * eviction_samples keys sampled at random, 5 when 0. a key and value that could never fit on
+     * their own are refused with HT_ENONEM */
+    size_t max_bytes;
+    ht_eviction_t eviction;
+    size_t eviction_samples;
+    ht_evict_func on_evict;
+    void *evict_ctx;
 } ht_config_t;
 
+typedef struct {
+    /* lookups by ht_get, ht_has, ht_get_many and ht_get_or_insert that found their key or not */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+
+    /* the size of an entry for every key, plus the lengths of the keys and values that are not
+     * stored in the entry itself, whether or not the table copied them */
+    size_t bytes;
+} ht_stats_t;
+
 typedef struct {
     ht_t *ht;
     size_t bucket_idx;
@@ -39,6 +112,7 @@ ht_t *ht_create(const ht_config_t *cfg);
 
 void ht_destroy(ht_t *ht);
 
+/* val may only be NULL with a val_len of 0, here and in every call that stores a value */
 ht_err_t ht_set(ht_t *ht, const void *key, size_t key_len, const void *val, size_t val_len);
 
 ht_err_t ht_get(ht_t *ht, const void *key, size_t key_len, void **out_val);
@@ -47,9 +121,117 @@ ht_err_t ht_delete(ht_t *ht, const void *key, size_t key_len);
 
 ht_err_t ht_has(ht_t *ht, const void *key, size_t key_len);
 
+/* the read-modify-write operations below hash the key and look it up once, where a ht_get
+ * followed by a ht_set would do both twice */
+typedef void (*ht_update_func)(void *val, size_t val_len, void *ctx);
+typedef int (*ht_predicate_func)(const void *val, size_t val_len, void *ctx);
+
+/* stores in *out_val the value of key, after adding key with a copy of val if it is missing, and
+ * sets *inserted, when inserted is not NULL, to whether it was added. the value can be read and
+ * changed in place through *out_val until the next call that can delete or add a key */
+ht_err_t ht_get_or_insert(ht_t *ht, const void *key, size_t key_len, const void *val,
+                          size_t val_len, void **out_val, int *inserted);
+
+/* calls update with key's value, which it may change in place, or returns HT_ENOTFOUND */
+ht_err_t ht_update(ht_t *ht, const void *key, size_t key_len, ht_update_func update, void *ctx);
+
+/* replaces key's value with val only if it holds the same expected_len bytes as expected, and
+ * returns HT_EMISMATCH otherwise */
+ht_err_t ht_compare_and_set(ht_t *ht, const void *key, size_t key_len, const void *expected,
+                            size_t expected_len, const void *val, size_t val_len);
+
+/* deletes key only if pred returns non-zero for its value, and returns HT_EMISMATCH otherwise */
+ht_err_t ht_remove_if(ht_t *ht, const void *key, size_t key_len, ht_predicate_func pred,
+                      void *ctx);
+
+/* ht_get, ht_set and ht_delete for count keys at once, keys[i] being key_lens[i] bytes long.
+ * the buckets of a few keys at a time are fetched from memory together before any of them is
+ * looked at, which hides most of the cache misses a loop of single calls waits out in turn.
+ *
+ * ht_get_many stores the value of keys[i] in out_vals[i], or NULL if it is missing, and
+ * ht_delete_many deletes every key it finds; both store each key's result in errs[i] when errs is
+ * not NULL, and return HT_ENOTFOUND if any key was missing. ht_set_many stops at the first key
+ * it fails to set and returns that error, leaving the keys before it set */
+ht_err_t ht_get_many(ht_t *ht, size_t count, const void *const *keys, const size_t *key_lens,
+                     void **out_vals, ht_err_t *errs);
+ht_err_t ht_set_many(ht_t *ht, size_t count, const void *const *keys, const size_t *key_lens,
+                     const void *const *vals, const size_t *val_lens);
+ht_err_t ht_delete_many(ht_t *ht, size_t count, const void *const *keys, const size_t *key_lens,
+                        ht_err_t *errs);
+
+/* keys can be given a ttl, in config->clock's unit, after which they expire: an expired key is
+ * missing to every call and is deleted, through free_key and free_val, by the first call that
+ * comes across it, ht_get and ht_has included, or by ht_expire_step. until then ht_size still
+ * counts it. ht_set makes a key permanent again */
+ht_err_t ht_set_ttl(ht_t *ht, const void *key, size_t key_len, const void *val, size_t val_len,
+                    uint64_t ttl);
+ht_err_t ht_expire(ht_t *ht, const void *key, size_t key_len, uint64_t ttl);
+ht_err_t ht_persist(ht_t *ht, const void *key, size_t key_len);
+
+/* stores the time key has left in *ttl, or HT_NO_EXPIRY */
+ht_err_t ht_ttl(ht_t *ht, const void *key, size_t key_len, uint64_t *ttl);
+
+/* deletes expired keys in order of their deadlines, looking at no more than budget deadlines, and
+ * returns how many it deleted. its work depends on the number of keys that have expired, not on
+ * the size of the table, so it can be called as often as keys should go away on time */
+size_t ht_expire_step(ht_t *ht, size_t budget);
+
+/* the hash that every operation computes for key: config->hash with the table's seed */
+uint64_t ht_hash(const ht_t *ht, const void *key, size_t key_len);
+
+/* the operations above for a key whose hash is already known, such as one kept from ht_hash or
+ * received along with the key; they skip hashing the key. hash must be what ht_hash returns for
+ * key, or the key is not found, or is added where lookups that hash it will not find it */
+ht_err_t ht_set_hashed(ht_t *ht, const void *key, size_t key_len, uint64_t hash, const void *val,
+                       size_t val_len);
+ht_err_t ht_get_hashed(ht_t *ht, const void *key, size_t key_len, uint64_t hash, void **out_val);
+ht_err_t ht_delete_hashed(ht_t *ht, const void *key, size_t key_len, uint64_t hash);
+ht_err_t ht_has_hashed(ht_t *ht, const void *key, size_t key_len, uint64_t hash);
+ht_err_t ht_get_or_insert_hashed(ht_t *ht, const void *key, size_t key_len, uint64_t hash,
+                                 const void *val, size_t val_len, void **out_val, int *inserted);
+ht_err_t ht_update_hashed(ht_t *ht, const void *key, size_t key_len, uint64_t hash,
+                          ht_update_func update, void *ctx);
+ht_err_t ht_compare_and_set_hashed(ht_t *ht, const void *key, size_t key_len, uint64_t hash,
+                                   const void *expected, size_t expected_len, const void *val,
+                                   size_t val_len);
+ht_err_t ht_remove_if_hashed(ht_t *ht, const void *key, size_t key_len, uint64_t hash,
+                             ht_predicate_func pred, void *ctx);
+ht_err_t ht_set_ttl_hashed(ht_t *ht, const void *key, size_t key_len, uint64_t hash,
+                           const void *val, size_t val_len, uint64_t ttl);
+ht_err_t ht_expire_hashed(ht_t *ht, const void *key, size_t key_len, uint64_t hash, uint64_t ttl);
+ht_err_t ht_persist_hashed(ht_t *ht, const void *key, size_t key_len, uint64_t hash);
+ht_err_t ht_ttl_hashed(ht_t *ht, const void *key, size_t key_len, uint64_t hash, uint64_t *ttl);
+
+/* hashes[i] is the hash of keys[i] */
+ht_err_t ht_get_many_hashed(ht_t *ht, size_t count, const void *const *keys,
+                            const size_t *key_lens, const uint64_t *hashes, void **out_vals,
+                            ht_err_t *errs);
+ht_err_t ht_set_many_hashed(ht_t *ht, size_t count, const void *const *keys,
+                            const size_t *key_lens, const uint64_t *hashes,
+                            const void *const *vals, const size_t *val_lens);
+ht_err_t ht_delete_many_hashed(ht_t *ht, size_t count, const void *const *keys,
+                               const size_t *key_lens, const uint64_t *hashes, ht_err_t *errs);
+
+/* makes room for count entries at once, so that adding them does not resize the table, and keeps
+ * the table from shrinking below that room until ht_shrink_to_fit */
+ht_err_t ht_reserve(ht_t *ht, size_t count);
+
+/* rebuilds the table at the smallest capacity that holds its entries, finishing any resize under
+ * way, dropping tombstones and freeing unused memory; undoes ht_reserve */
+ht_err_t ht_shrink_to_fit(ht_t *ht);
+
+/* counts expired keys that have not been deleted yet */
 size_t ht_size(const ht_t *ht);
+
+ht_stats_t ht_stats(const ht_t *ht);
+
+/* zeroes the hit, miss and eviction counters */
+void ht_stats_reset(ht_t *ht);
+
+/* number of buckets, or of slots for HT_BACKEND_SWISS */
 size_t ht_capacity(const ht_t *ht);
 
+/* removes every entry but keeps the table's capacity and memory for the entries that follow */
 void ht_clear(ht_t *ht);
 
 ht_iter_t ht_iter_begin(ht_t *ht);
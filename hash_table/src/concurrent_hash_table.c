@@ -0,0 +1,463 @@
+#include "concurrent_hash_table.h"
+#include "allocator.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LOCK_STRIPES 64
+#define DEFAULT_INITIAL_CAPACITY 64
+#define DEFAULT_LOAD_FACTOR 0.75
+#define CACHE_LINE 64
+
+/* retired memory is reclaimed once a thread has this much of it waiting, and whenever a table
+ * has been replaced or destroyed */
+#define RECLAIM_BATCH 64
+
+typedef struct node {
+    struct node *_Atomic next;
+    uint64_t hash;
+    void *key;
+    size_t key_len;
+    void *val;
+    size_t val_len;
+} node_t;
+
+typedef struct {
+    size_t capacity;
+    node_t *_Atomic buckets[];
+} table_t;
+
+typedef struct {
+    _Alignas(CACHE_LINE) pthread_mutex_t lock;
+} stripe_t;
+
+struct cht {
+    table_t *_Atomic table;
+    _Atomic size_t size;
+    stripe_t stripes[LOCK_STRIPES];
+    ht_config_t config;
+};
+
+/* epoch-based reclamation: a lookup announces the global epoch it started in, and memory that a
+ * writer unlinks is tagged with the epoch it was retired in. the epoch only advances once every
+ * lookup in progress has seen the current one, so two advances after an object's retirement no
+ * lookup can still hold a pointer to it. this is shared by all tables, and the retired memory
+ * carries its own free function, so that a table can be destroyed while some of it waits */
+#define EPOCH_ACTIVE 1
+
+typedef struct epoch_record {
+    /* (epoch << 1) | EPOCH_ACTIVE during a lookup, 0 otherwise */
+    _Alignas(CACHE_LINE) _Atomic uint64_t epoch;
+    _Atomic int in_use;
+    struct epoch_record *next;
+} epoch_record_t;
+
+typedef struct {
+    void *ptr;
+    void (*free)(void *ptr);
+    uint64_t epoch;
+} retired_t;
+
+typedef struct {
+    retired_t *items;
+    size_t count;
+    size_t capacity;
+} retired_list_t;
+
+static _Atomic uint64_t global_epoch = 1;
+static epoch_record_t *_Atomic epoch_records = NULL;
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+static pthread_key_t epoch_key;
+static _Thread_local epoch_record_t *epoch_record = NULL;
+static _Thread_local retired_list_t retired = {0};
+
+/* what threads left behind when they exited, reclaimed by whichever thread gets to it */
+static pthread_mutex_t orphans_lock = PTHREAD_MUTEX_INITIALIZER;
+static retired_list_t orphans = {0};
+
+static int retired_push(retired_list_t *list, retired_t item) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : RECLAIM_BATCH * 2;
+        retired_t *items = realloc_mem(list->items, capacity * sizeof(retired_t));
+        if (!items) return -1;
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    list->items[list->count++] = item;
+    return 0;
+}
+
+/* frees what was retired at least two epochs before epoch */
+static void retired_reclaim(retired_list_t *list, uint64_t epoch) {
+    size_t kept = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        if (list->items[i].epoch + 2 <= epoch)
+            list->items[i].free(list->items[i].ptr);
+        else
+            list->items[kept++] = list->items[i];
+    }
+    list->count = kept;
+}
+
+static void epoch_thread_exit(void *arg) {
+    epoch_record_t *record = arg;
+
+    pthread_mutex_lock(&orphans_lock);
+    for (size_t i = 0; i < retired.count; i++) {
+        if (retired_push(&orphans, retired.items[i]) != 0) break;
+    }
+    pthread_mutex_unlock(&orphans_lock);
+
+    free_mem(retired.items);
+    memset(&retired, 0, sizeof(retired));
+
+    atomic_store_explicit(&record->epoch, 0, memory_order_release);
+    atomic_store_explicit(&record->in_use, 0, memory_order_release);
+    epoch_record = NULL;
+}
+
+static void epoch_key_create(void) {
+    pthread_key_create(&epoch_key, epoch_thread_exit);
+}
+
+/* records are never freed; a thread takes over one that an exited thread left, or adds one */
+static epoch_record_t *epoch_record_get(void) {
+    if (epoch_record) return epoch_record;
+
+    pthread_once(&epoch_once, epoch_key_create);
+
+    epoch_record_t *record = atomic_load(&epoch_records);
+    for (; record; record = record->next) {
+        int unused = 0;
+        if (atomic_compare_exchange_strong(&record->in_use, &unused, 1)) break;
+    }
+
+    if (!record) {
+        record = alloc_aligned_mem(CACHE_LINE, sizeof(epoch_record_t));
+        if (!record) return NULL;
+        atomic_init(&record->epoch, 0);
+        atomic_init(&record->in_use, 1);
+        record->next = atomic_load(&epoch_records);
+        while (!atomic_compare_exchange_weak(&epoch_records, &record->next, record))
+            ;
+    }
+
+    pthread_setspecific(epoch_key, record);
+    epoch_record = record;
+    return record;
+}
+
+/* returns NULL when there was no memory for the thread's record, and the lookup cannot be
+ * announced */
+static epoch_record_t *epoch_enter(void) {
+    epoch_record_t *record = epoch_record_get();
+    if (!record) return NULL;
+
+    uint64_t epoch = atomic_load_explicit(&global_epoch, memory_order_relaxed);
+    atomic_store_explicit(&record->epoch, epoch << 1 | EPOCH_ACTIVE, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    return record;
+}
+
+static void epoch_exit(epoch_record_t *record) {
+    atomic_store_explicit(&record->epoch, 0, memory_order_release);
+}
+
+/* moves the global epoch on if every lookup in progress has seen it, and returns it */
+static uint64_t epoch_try_advance(void) {
+    atomic_thread_fence(memory_order_seq_cst);
+    uint64_t epoch = atomic_load(&global_epoch);
+    for (epoch_record_t *r = atomic_load(&epoch_records); r; r = r->next) {
+        uint64_t local = atomic_load(&r->epoch);
+        if ((local & EPOCH_ACTIVE) && local >> 1 != epoch) return epoch;
+    }
+
+    atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1);
+    return atomic_load(&global_epoch);
+}
+
+/* moves the epoch on by the two steps that make everything retired so far safe to free, as far as
+ * the lookups in progress let it, and frees what has become safe */
+static void epoch_reclaim(void) {
+    epoch_try_advance();
+    uint64_t epoch = epoch_try_advance();
+    retired_reclaim(&retired, epoch);
+    if (pthread_mutex_trylock(&orphans_lock) == 0) {
+        retired_reclaim(&orphans, epoch);
+        pthread_mutex_unlock(&orphans_lock);
+    }
+}
+
+/* hands ptr to free once no lookup can be reading it; called after ptr has been unlinked */
+static void epoch_retire(void *ptr, void (*free_fn)(void *)) {
+    if (!ptr || !free_fn) return;
+
+    retired_t item = {ptr, free_fn, atomic_load(&global_epoch)};
+    if (retired_push(&retired, item) != 0) {
+        /* out of memory to remember it: wait until it can go right away */
+        while (epoch_try_advance() < item.epoch + 2)
+            ;
+        free_fn(ptr);
+        return;
+    }
+
+    if (retired.count >= RECLAIM_BATCH) epoch_reclaim();
+}
+
+static size_t next_pow2(size_t n) {
+    size_t p = 1;
+    while (p < n)
+        p <<= 1;
+    return p;
+}
+
+static table_t *table_new(size_t capacity) {
+    if (capacity > (SIZE_MAX - sizeof(table_t)) / sizeof(node_t *)) return NULL;
+
+    table_t *t = calloc_aligned_mem(CACHE_LINE, 1, sizeof(table_t) + capacity * sizeof(node_t *));
+    if (!t) return NULL;
+
+    t->capacity = capacity;
+    return t;
+}
+
+/* frees a table's array and nodes, but not the keys and values, which belong to the entries of
+ * the table that replaced it */
+static void table_free_nodes(void *arg) {
+    table_t *t = arg;
+    for (size_t i = 0; i < t->capacity; i++) {
+        node_t *node = atomic_load_explicit(&t->buckets[i], memory_order_relaxed);
+        while (node) {
+            node_t *next = atomic_load_explicit(&node->next, memory_order_relaxed);
+            free_mem(node);
+            node = next;
+        }
+    }
+    free_mem(t);
+}
+
+static node_t *_Atomic *bucket_of(table_t *t, uint64_t hash) {
+    return &t->buckets[hash & (t->capacity - 1)];
+}
+
+/* the stripe depends only on the low bits of the hash, which every table size at least as big
+ * as LOCK_STRIPES shares among the keys of a bucket */
+static pthread_mutex_t *stripe_lock(cht_t *cht, uint64_t hash) {
+    return &cht->stripes[hash & (LOCK_STRIPES - 1)].lock;
+}
+
+cht_t *cht_create(const ht_config_t *config) {
+    if (!config || config->arena || config->max_bytes) return NULL;
+
+    cht_t *cht = alloc_aligned_mem(CACHE_LINE, sizeof(cht_t));
+    if (!cht) return NULL;
+
+    cht->config = *config;
+    if (cht->config.initial_capacity == 0) cht->config.initial_capacity = DEFAULT_INITIAL_CAPACITY;
+    if (cht->config.load_factor <= 0.0) cht->config.load_factor = DEFAULT_LOAD_FACTOR;
+
+    size_t capacity = next_pow2(cht->config.initial_capacity);
+    table_t *t = table_new(capacity < LOCK_STRIPES ? LOCK_STRIPES : capacity);
+    if (!t) {
+        free_mem(cht);
+        return NULL;
+    }
+
+    atomic_init(&cht->table, t);
+    atomic_init(&cht->size, 0);
+    for (int i = 0; i < LOCK_STRIPES; i++)
+        pthread_mutex_init(&cht->stripes[i].lock, NULL);
+    return cht;
+}
+
+void cht_destroy(cht_t *cht) {
+    if (!cht) return;
+
+    table_t *t = atomic_load(&cht->table);
+    for (size_t i = 0; i < t->capacity; i++) {
+        for (node_t *node = atomic_load(&t->buckets[i]); node; node = atomic_load(&node->next)) {
+            if (cht->config.free_key && node->key) cht->config.free_key(node->key);
+            if (cht->config.free_val && node->val) cht->config.free_val(node->val);
+        }
+    }
+    table_free_nodes(t);
+
+    for (int i = 0; i < LOCK_STRIPES; i++)
+        pthread_mutex_destroy(&cht->stripes[i].lock);
+    free_mem(cht);
+
+    /* no lookup of this table is left, so what it retired only waits on lookups of others */
+    epoch_reclaim();
+}
+
+/* doubles the table with every stripe locked; the new table gets nodes of its own, since
+ * lookups may still be walking the chains of the old one */
+static void cht_grow(cht_t *cht) {
+    for (int i = 0; i < LOCK_STRIPES; i++)
+        pthread_mutex_lock(&cht->stripes[i].lock);
+
+    table_t *old = atomic_load_explicit(&cht->table, memory_order_relaxed);
+    size_t limit = (size_t) (old->capacity * cht->config.load_factor);
+    table_t *t = atomic_load(&cht->size) > limit ? table_new(old->capacity * 2) : NULL;
+
+    for (size_t i = 0; t && i < old->capacity; i++) {
+        node_t *node = atomic_load_explicit(&old->buckets[i], memory_order_relaxed);
+        for (; node; node = atomic_load_explicit(&node->next, memory_order_relaxed)) {
+            node_t *copy = alloc_mem(sizeof(node_t));
+            if (!copy) {
+                table_free_nodes(t);
+                t = NULL;
+                break;
+            }
+
+            *copy = *node;
+            node_t *_Atomic *bucket = bucket_of(t, node->hash);
+            atomic_init(&copy->next, atomic_load_explicit(bucket, memory_order_relaxed));
+            atomic_init(bucket, copy);
+        }
+    }
+
+    if (t) atomic_store_explicit(&cht->table, t, memory_order_release);
+
+    for (int i = LOCK_STRIPES - 1; i >= 0; i--)
+        pthread_mutex_unlock(&cht->stripes[i].lock);
+
+    /* the old table holds a node for every entry, too much to leave for a batch to free */
+    if (t) {
+        epoch_retire(old, table_free_nodes);
+        epoch_reclaim();
+    }
+}
+
+/* a node is never changed once it is published; a new value replaces the whole node */
+ht_err_t cht_set(cht_t *cht, const void *key, size_t key_len, const void *val, size_t val_len) {
+    if (!cht || !key) return HT_ERR;
+
+    const ht_config_t *config = &cht->config;
+    uint64_t hash = config->hash(key, key_len, config->seed);
+
+    node_t *node = alloc_mem(sizeof(node_t));
+    if (!node) return HT_ENONEM;
+    node->hash = hash;
+    node->key_len = key_len;
+    node->val = config->dup_val ? config->dup_val(val, val_len) : (void *) val;
+    node->val_len = val_len;
+
+    pthread_mutex_t *lock = stripe_lock(cht, hash);
+    pthread_mutex_lock(lock);
+
+    table_t *t = atomic_load_explicit(&cht->table, memory_order_relaxed);
+    node_t *_Atomic *link = bucket_of(t, hash);
+    node_t *old = atomic_load_explicit(link, memory_order_relaxed);
+    for (; old; old = atomic_load_explicit(link, memory_order_relaxed)) {
+        if (old->hash == hash && config->equals(old->key, old->key_len, key, key_len)) break;
+        link = &old->next;
+    }
+
+    if (old) {
+        node->key = old->key;
+        atomic_init(&node->next, atomic_load_explicit(&old->next, memory_order_relaxed));
+        atomic_store_explicit(link, node, memory_order_release);
+        pthread_mutex_unlock(lock);
+
+        epoch_retire(old->val, config->free_val);
+        epoch_retire(old, free_mem);
+        return HT_OK;
+    }
+
+    node->key = config->dup_key ? config->dup_key(key, key_len) : (void *) key;
+    atomic_init(&node->next, atomic_load_explicit(bucket_of(t, hash), memory_order_relaxed));
+    atomic_store_explicit(bucket_of(t, hash), node, memory_order_release);
+    size_t size = atomic_fetch_add(&cht->size, 1) + 1;
+    size_t limit = (size_t) (t->capacity * config->load_factor);
+    pthread_mutex_unlock(lock);
+
+    if (size > limit) cht_grow(cht);
+    return HT_OK;
+}
+
+static node_t *lookup(cht_t *cht, uint64_t hash, const void *key, size_t key_len) {
+    table_t *t = atomic_load_explicit(&cht->table, memory_order_acquire);
+    node_t *node = atomic_load_explicit(bucket_of(t, hash), memory_order_acquire);
+    for (; node; node = atomic_load_explicit(&node->next, memory_order_acquire)) {
+        if (node->hash == hash && cht->config.equals(node->key, node->key_len, key, key_len))
+            return node;
+    }
+    return NULL;
+}
+
+ht_err_t cht_get(cht_t *cht, const void *key, size_t key_len, void *buf, size_t buf_len,
+                 size_t *val_len) {
+    if (!cht || !key) return HT_ERR;
+
+    uint64_t hash = cht->config.hash(key, key_len, cht->config.seed);
+
+    /* a lookup that cannot be announced holds its stripe instead, which keeps the chain it walks
+     * from changing and the table from being replaced */
+    epoch_record_t *record = epoch_enter();
+    pthread_mutex_t *lock = record ? NULL : stripe_lock(cht, hash);
+    if (lock) pthread_mutex_lock(lock);
+
+    node_t *node = lookup(cht, hash, key, key_len);
+    if (node) {
+        size_t n = node->val_len < buf_len ? node->val_len : buf_len;
+        if (buf && node->val) memcpy(buf, node->val, n);
+        if (val_len) *val_len = node->val_len;
+    }
+
+    if (lock)
+        pthread_mutex_unlock(lock);
+    else
+        epoch_exit(record);
+
+    return node ? HT_OK : HT_ENOTFOUND;
+}
+
+ht_err_t cht_has(cht_t *cht, const void *key, size_t key_len) {
+    return cht_get(cht, key, key_len, NULL, 0, NULL);
+}
+
+ht_err_t cht_delete(cht_t *cht, const void *key, size_t key_len) {
+    if (!cht || !key) return HT_ERR;
+
+    const ht_config_t *config = &cht->config;
+    uint64_t hash = config->hash(key, key_len, config->seed);
+
+    pthread_mutex_t *lock = stripe_lock(cht, hash);
+    pthread_mutex_lock(lock);
+
+    table_t *t = atomic_load_explicit(&cht->table, memory_order_relaxed);
+    node_t *_Atomic *link = bucket_of(t, hash);
+    node_t *node = atomic_load_explicit(link, memory_order_relaxed);
+    for (; node; node = atomic_load_explicit(link, memory_order_relaxed)) {
+        if (node->hash == hash && config->equals(node->key, node->key_len, key, key_len)) break;
+        link = &node->next;
+    }
+
+    if (!node) {
+        pthread_mutex_unlock(lock);
+        return HT_ENOTFOUND;
+    }
+
+    atomic_store_explicit(link, atomic_load_explicit(&node->next, memory_order_relaxed),
+                          memory_order_release);
+    atomic_fetch_sub(&cht->size, 1);
+    pthread_mutex_unlock(lock);
+
+    epoch_retire(node->key, config->free_key);
+    epoch_retire(node->val, config->free_val);
+    epoch_retire(node, free_mem);
+    return HT_OK;
+}
+
+size_t cht_size(cht_t *cht) {
+    if (!cht) return 0;
+    return atomic_load(&cht->size);
+}
+
+size_t cht_capacity(cht_t *cht) {
+    if (!cht) return 0;
+    return atomic_load(&cht->table)->capacity;
+}
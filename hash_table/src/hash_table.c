@@ -1,31 +1,162 @@
+#define _POSIX_C_SOURCE 199309L
 #include "hash_table.h"
 #include "allocator.h"
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* a key or value of 1 to HT_INLINE_SIZE bytes is kept in bytes when inline_small is set; any
+ * other one is ptr, as returned by the dup functions or the arena */
+typedef union {
+    void *ptr;
+    unsigned char bytes[HT_INLINE_SIZE];
+} ht_data_t;
+
+/* the lengths are 32 bits, which keeps entries at 48 bytes with the deadline and the stamps */
 typedef struct {
     uint64_t hash;
-    void *key;
-    size_t key_len;
-    void *val;
-    size_t val_len;
+    ht_data_t key;
+    ht_data_t val;
+    uint32_t key_len;
+    uint32_t val_len;
+
+    /* the time by config->clock the entry expires at, or 0 if it never does */
+    uint64_t expires;
+
+    /* in a cache, the table's count of accesses when the entry was last used, and with
+     * HT_EVICT_LFU its logarithmic count of uses */
+    uint32_t used_at;
+    uint8_t uses;
 } ht_entry_t;
 
+typedef struct {
+    uint64_t deadline;
+    uint64_t hash;
+} ht_deadline_t;
+
 typedef struct {
     ht_entry_t *entries;
     size_t size;
     size_t capacity;
 } ht_bucket_t;
 
-struct ht {
+/* the arrays of one table size; a chained table uses buckets, a swiss table one control byte per
+ * slot and the slots themselves */
+typedef struct {
     ht_bucket_t *buckets;
+    uint8_t *ctrl;
+    ht_entry_t *slots;
+    size_t tombstones;
     size_t capacity;
+} ht_table_t;
+
+struct ht {
+    ht_table_t table;
+
+    /* while a resize is under way, the table it started from; its first migrated buckets, or
+     * groups of slots, have been moved to table already */
+    ht_table_t old;
+    size_t migrated;
+    size_t migrate_step;
+
+    /* the capacity the table never shrinks below: the one it was created with, or the one asked
+     * for by ht_reserve if that is bigger */
+    size_t min_capacity;
+    size_t reserved;
+
+    /* a min-heap of the deadlines given to entries, each with its entry's hash, and the number of
+     * entries that have one. an entry that is deleted or given another deadline leaves its old
+     * one behind, to be skipped when it comes up */
+    ht_deadline_t *deadlines;
+    size_t deadlines_len;
+    size_t deadlines_cap;
+    size_t expiring;
+
+    /* the bytes of the entries as ht_stats counts them, the clock the entries of a cache are
+     * stamped with when used, and the state of the generator that picks eviction samples */
+    size_t bytes;
+    uint64_t accesses;
+    uint64_t rng;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+
     size_t size;
     ht_config_t config;
 };
 
+static int is_inline(const ht_config_t *config, size_t len) {
+    return config->inline_small && len > 0 && len <= HT_INLINE_SIZE;
+}
+
+/* a NULL value has no bytes to copy into the entry, so it may only come with a length of 0 */
+static int val_invalid(const void *val, size_t val_len) {
+    return val_len > HT_MAX_LEN || (!val && val_len);
+}
+
+static void *data_of(const ht_config_t *config, ht_data_t *data, size_t len) {
+    return is_inline(config, len) ? data->bytes : data->ptr;
+}
+
+static ht_data_t copy_key(const ht_config_t *config, const void *key, size_t key_len) {
+    ht_data_t data = {0};
+    if (is_inline(config, key_len))
+        memcpy(data.bytes, key, key_len);
+    else if (config->arena)
+        data.ptr = arena_dup(config->arena, key, key_len);
+    else
+        data.ptr = config->dup_key ? config->dup_key(key, key_len) : (void *) key;
+    return data;
+}
+
+static ht_data_t copy_val(const ht_config_t *config, const void *val, size_t val_len) {
+    ht_data_t data = {0};
+    if (is_inline(config, val_len))
+        memcpy(data.bytes, val, val_len);
+    else if (config->arena)
+        data.ptr = arena_dup(config->arena, val, val_len);
+    else
+        data.ptr = config->dup_val ? config->dup_val(val, val_len) : (void *) val;
+    return data;
+}
+
+static void release_key(const ht_config_t *config, ht_data_t *key, size_t key_len) {
+    if (is_inline(config, key_len) || config->arena) return;
+    if (config->free_key && key->ptr) config->free_key(key->ptr);
+}
+
+static void release_val(const ht_config_t *config, ht_data_t *val, size_t val_len) {
+    if (is_inline(config, val_len) || config->arena) return;
+    if (config->free_val && val->ptr) config->free_val(val->ptr);
+}
+
+static void entry_release(const ht_config_t *config, ht_entry_t *entry) {
+    release_key(config, &entry->key, entry->key_len);
+    release_val(config, &entry->val, entry->val_len);
+}
+
+/* what an entry adds to ht_stats' bytes */
+static size_t entry_bytes(const ht_config_t *config, size_t key_len, size_t val_len) {
+    size_t bytes = sizeof(ht_entry_t);
+    if (!is_inline(config, key_len)) bytes += key_len;
+    if (!is_inline(config, val_len)) bytes += val_len;
+    return bytes;
+}
+
+static int entry_matches(const ht_config_t *config, ht_entry_t *entry, uint64_t hash,
+                         const void *key, size_t key_len) {
+    return entry->hash == hash &&
+           config->equals(data_of(config, &entry->key, entry->key_len), entry->key_len, key,
+                          key_len);
+}
+
 static int bucket_reserve(ht_bucket_t *bucket, size_t new_capacity) {
     if (new_capacity <= bucket->capacity) return HT_OK;
 
@@ -41,53 +172,252 @@ static int bucket_reserve(ht_bucket_t *bucket, size_t new_capacity) {
     return HT_OK;
 }
 
-static int bucket_find(const ht_bucket_t *bucket, unsigned hash, const void *key, size_t key_len,
+static int bucket_find(const ht_bucket_t *bucket, uint64_t hash, const void *key, size_t key_len,
                        const ht_config_t *config) {
     for (size_t i = 0; i < bucket->size; i++) {
-        if (bucket->entries[i].hash == hash &&
-            config->equals(bucket->entries[i].key, bucket->entries[i].key_len, key, key_len)) {
-            return (int) i;
-        }
+        if (entry_matches(config, &bucket->entries[i], hash, key, key_len)) return (int) i;
     }
     return -1;
 }
 
-static int bucket_insert(ht_bucket_t *bucket, unsigned hash, void *key, size_t key_len, void *val,
-                         size_t val_len, const ht_config_t *config) {
-    int idx = bucket_find(bucket, hash, key, key_len, config);
-    if (idx >= 0) {
-        if (config->free_val) config->free_val(bucket->entries[idx].val);
-        bucket->entries[idx].val = val;
-        return HT_OK;
+/* open addressing: the slots come in aligned groups of GROUP_SLOTS, each with a control byte that
+ * is CTRL_EMPTY, CTRL_DELETED or, for a full slot, the low 7 bits of its hash. a lookup starts at
+ * the group picked by the rest of the hash and compares a whole group's control bytes at once;
+ * only slots whose 7 bits match get their full hash compared, and only then is equals called */
+#define GROUP_SLOTS 16
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xFE
+#define CTRL_ALIGN 64
+
+/* the share of slots that may be full or deleted, so that every probe meets an empty slot */
+#define SWISS_MAX_LOAD 0.875
+
+static uint8_t hash_tag(uint64_t hash) {
+    return hash & 0x7F;
+}
+
+static int slot_full(uint8_t ctrl) {
+    return !(ctrl & 0x80);
+}
+
+#ifdef __SSE2__
+static unsigned group_match(const uint8_t *group, uint8_t ctrl) {
+    __m128i bytes = _mm_load_si128((const __m128i *) group);
+    return (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char) ctrl)));
+}
+
+/* empty and deleted slots are the ones with the top bit set */
+static unsigned group_match_free(const uint8_t *group) {
+    return (unsigned) _mm_movemask_epi8(_mm_load_si128((const __m128i *) group));
+}
+#else
+static unsigned group_match(const uint8_t *group, uint8_t ctrl) {
+    unsigned mask = 0;
+    for (int i = 0; i < GROUP_SLOTS; i++)
+        mask |= (unsigned) (group[i] == ctrl) << i;
+    return mask;
+}
+
+static unsigned group_match_free(const uint8_t *group) {
+    unsigned mask = 0;
+    for (int i = 0; i < GROUP_SLOTS; i++)
+        mask |= (unsigned) !slot_full(group[i]) << i;
+    return mask;
+}
+#endif
+
+/* groups are probed in triangular steps, which visits every group once as their number is a
+ * power of two */
+static ht_entry_t *swiss_find(const ht_table_t *t, uint64_t hash, const void *key, size_t key_len,
+                              const ht_config_t *config) {
+    size_t groups_mask = t->capacity / GROUP_SLOTS - 1;
+    size_t group = (hash >> 7) & groups_mask;
+    uint8_t tag = hash_tag(hash);
+
+    for (size_t step = 1;; step++) {
+        const uint8_t *ctrl = t->ctrl + group * GROUP_SLOTS;
+        for (unsigned match = group_match(ctrl, tag); match; match &= match - 1) {
+            ht_entry_t *entry = &t->slots[group * GROUP_SLOTS + __builtin_ctz(match)];
+            if (entry_matches(config, entry, hash, key, key_len)) return entry;
+        }
+
+        if (group_match(ctrl, CTRL_EMPTY)) return NULL;
+        group = (group + step) & groups_mask;
     }
+}
 
-    int err = bucket_reserve(bucket, bucket->size + 1);
-    if (err != HT_OK) return err;
+/* takes the first free slot on hash's probe sequence, for a key that is not in the table */
+static ht_entry_t *swiss_claim(ht_table_t *t, uint64_t hash) {
+    size_t groups_mask = t->capacity / GROUP_SLOTS - 1;
+    size_t group = (hash >> 7) & groups_mask;
+
+    for (size_t step = 1;; step++) {
+        unsigned free = group_match_free(t->ctrl + group * GROUP_SLOTS);
+        if (free) {
+            size_t idx = group * GROUP_SLOTS + __builtin_ctz(free);
+            if (t->ctrl[idx] == CTRL_DELETED) t->tombstones--;
+            t->ctrl[idx] = hash_tag(hash);
+            t->slots[idx].hash = hash;
+            return &t->slots[idx];
+        }
+        group = (group + step) & groups_mask;
+    }
+}
+
+/* a probe only moves on from a group without empty slots, so a slot in a group that still has
+ * one can be emptied outright; elsewhere it has to stay a tombstone until the next rebuild */
+static void swiss_remove(ht_table_t *t, ht_entry_t *entry) {
+    size_t idx = (size_t) (entry - t->slots);
+    if (group_match(t->ctrl + idx / GROUP_SLOTS * GROUP_SLOTS, CTRL_EMPTY)) {
+        t->ctrl[idx] = CTRL_EMPTY;
+    } else {
+        t->ctrl[idx] = CTRL_DELETED;
+        t->tombstones++;
+    }
+}
+
+#define DEFAULT_INITIAL_CAPACITY 16
+#define DEFAULT_LOAD_FACTOR 0.75
+#define DEFAULT_EVICTION_SAMPLES 5
+#define BUCKET_ARRAY_ALIGN 64
 
-    bucket->entries[bucket->size].hash = hash;
-    bucket->entries[bucket->size].key = key;
-    bucket->entries[bucket->size].key_len = key_len;
-    bucket->entries[bucket->size].val = val;
-    bucket->entries[bucket->size].val_len = val_len;
-    bucket->size++;
+static int is_swiss(const ht_t *ht) {
+    return ht->config.backend == HT_BACKEND_SWISS;
+}
+
+/* the control bytes and the slots of a swiss table share one allocation, the slots following
+ * the bytes */
+static ht_err_t table_alloc(ht_table_t *t, int swiss, size_t capacity) {
+    memset(t, 0, sizeof(*t));
+    if (swiss) {
+        if (capacity > SIZE_MAX / (1 + sizeof(ht_entry_t))) return HT_ENONEM;
+
+        t->ctrl = alloc_aligned_mem(CTRL_ALIGN, capacity * (1 + sizeof(ht_entry_t)));
+        if (!t->ctrl) return HT_ENONEM;
+        memset(t->ctrl, CTRL_EMPTY, capacity);
+        t->slots = (ht_entry_t *) (t->ctrl + capacity);
+    } else {
+        t->buckets = calloc_aligned_mem(BUCKET_ARRAY_ALIGN, capacity, sizeof(ht_bucket_t));
+        if (!t->buckets) return HT_ENONEM;
+    }
+
+    t->capacity = capacity;
     return HT_OK;
 }
 
-static int bucket_delete(ht_bucket_t *bucket, unsigned hash, void *key, size_t key_len,
-                         const ht_config_t *config) {
-    int idx = bucket_find(bucket, hash, key, key_len, config);
-    if (idx < 0) return HT_ENOTFOUND;
+static void table_free(ht_table_t *t) {
+    if (t->buckets) {
+        for (size_t i = 0; i < t->capacity; i++)
+            free_mem(t->buckets[i].entries);
+        free_mem(t->buckets);
+    }
+    free_mem(t->ctrl);
+    memset(t, 0, sizeof(*t));
+}
+
+static ht_entry_t *table_find(ht_t *ht, const ht_table_t *t, uint64_t hash, const void *key,
+                              size_t key_len) {
+    if (is_swiss(ht)) return swiss_find(t, hash, key, key_len, &ht->config);
+
+    ht_bucket_t *bucket = &t->buckets[hash & (t->capacity - 1)];
+    int i = bucket_find(bucket, hash, key, key_len, &ht->config);
+    return i < 0 ? NULL : &bucket->entries[i];
+}
+
+static int resizing(const ht_t *ht) {
+    return ht->old.capacity != 0;
+}
+
+static ht_entry_t *entry_find(ht_t *ht, uint64_t hash, const void *key, size_t key_len) {
+    ht_entry_t *entry = table_find(ht, &ht->table, hash, key, key_len);
+    if (entry || !resizing(ht)) return entry;
+
+    /* the buckets of the old table that have been migrated are empty */
+    if (!is_swiss(ht) && (hash & (ht->old.capacity - 1)) < ht->migrated) return NULL;
+    return table_find(ht, &ht->old, hash, key, key_len);
+}
+
+/* an entry for a key that is not in the table yet, with only its hash filled in; new entries
+ * always go to the new table of a resize */
+static ht_entry_t *entry_claim(ht_t *ht, uint64_t hash) {
+    if (is_swiss(ht)) return swiss_claim(&ht->table, hash);
+
+    ht_bucket_t *bucket = &ht->table.buckets[hash & (ht->table.capacity - 1)];
+    if (bucket_reserve(bucket, bucket->size + 1) != HT_OK) return NULL;
+
+    ht_entry_t *entry = &bucket->entries[bucket->size++];
+    entry->hash = hash;
+    return entry;
+}
+
+/* takes entry out of whichever table holds it, without releasing its key or value */
+static void entry_remove(ht_t *ht, ht_entry_t *entry) {
+    ht_table_t *t = &ht->table;
+    if (is_swiss(ht)) {
+        if (resizing(ht) && entry >= ht->old.slots && entry < ht->old.slots + ht->old.capacity)
+            t = &ht->old;
+        swiss_remove(t, entry);
+        return;
+    }
 
-    if (config->free_key) config->free_key(bucket->entries[idx].key);
-    if (config->free_val) config->free_val(bucket->entries[idx].val);
+    ht_bucket_t *bucket = &t->buckets[entry->hash & (t->capacity - 1)];
+    if (entry < bucket->entries || entry >= bucket->entries + bucket->size)
+        bucket = &ht->old.buckets[entry->hash & (ht->old.capacity - 1)];
+    *entry = bucket->entries[--bucket->size];
+}
 
-    bucket->entries[idx] = bucket->entries[bucket->size - 1];
-    bucket->size--;
+/* moves the entries of old bucket idx into the new table; on failure the entries that have not
+ * moved yet stay where they are */
+static ht_err_t bucket_migrate(ht_t *ht, size_t idx) {
+    ht_bucket_t *old_bucket = &ht->old.buckets[idx];
+    while (old_bucket->size > 0) {
+        ht_entry_t *entry = &old_bucket->entries[old_bucket->size - 1];
+        ht_bucket_t *bucket = &ht->table.buckets[entry->hash & (ht->table.capacity - 1)];
+        if (bucket_reserve(bucket, bucket->size + 1) != HT_OK) return HT_ENONEM;
+
+        bucket->entries[bucket->size++] = *entry;
+        old_bucket->size--;
+    }
+
+    free_mem(old_bucket->entries);
+    old_bucket->entries = NULL;
+    old_bucket->capacity = 0;
     return HT_OK;
 }
 
-#define DEFAULT_INITIAL_CAPACITY 16
-#define DEFAULT_LOAD_FACTOR 0.75
+/* moved slots become tombstones, as lookups in the old table still have to probe past them */
+static void group_migrate(ht_t *ht, size_t group) {
+    for (size_t idx = group * GROUP_SLOTS; idx < (group + 1) * GROUP_SLOTS; idx++) {
+        if (!slot_full(ht->old.ctrl[idx])) continue;
+
+        *swiss_claim(&ht->table, ht->old.slots[idx].hash) = ht->old.slots[idx];
+        ht->old.ctrl[idx] = CTRL_DELETED;
+    }
+}
+
+static size_t migrate_units(const ht_t *ht) {
+    return is_swiss(ht) ? ht->old.capacity / GROUP_SLOTS : ht->old.capacity;
+}
+
+/* moves up to budget buckets, or groups of slots, of the old table into the new one, and frees
+ * the old table once it is empty */
+static ht_err_t migrate(ht_t *ht, size_t budget) {
+    if (!resizing(ht)) return HT_OK;
+
+    size_t units = migrate_units(ht);
+    for (; budget > 0 && ht->migrated < units; budget--) {
+        if (is_swiss(ht)) {
+            group_migrate(ht, ht->migrated);
+        } else {
+            ht_err_t err = bucket_migrate(ht, ht->migrated);
+            if (err != HT_OK) return err;
+        }
+        ht->migrated++;
+    }
+
+    if (ht->migrated == units) table_free(&ht->old);
+    return HT_OK;
+}
 
 static size_t next_pow2(size_t n) {
     size_t p = 1;
@@ -96,36 +426,78 @@ static size_t next_pow2(size_t n) {
     return p;
 }
 
+static size_t load_limit(const ht_t *ht, size_t capacity) {
+    return (size_t) (capacity * ht->config.load_factor);
+}
+
+/* the new table becomes the one entries are added to, while the old one's entries move over
+ * either at once or, with incremental_resize, migrate_step buckets at a time on later ht_set and
+ * ht_delete calls; the step is big enough for the old table to empty before the new one fills */
 static ht_err_t ht_resize(ht_t *ht, size_t new_capacity) {
-    ht_bucket_t *new_buckets = calloc_mem(new_capacity, sizeof(ht_bucket_t));
-    if (!new_buckets) return HT_ENONEM;
-
-    for (size_t i = 0; i < ht->capacity; i++) {
-        ht_bucket_t *old_bucket = &ht->buckets[i];
-        for (size_t j = 0; j < old_bucket->size; j++) {
-            ht_entry_t *entry = &old_bucket->entries[j];
-
-            size_t idx = entry->hash & (new_capacity - 1);
-            ht_bucket_t *new_bucket = &new_buckets[idx];
-
-            int err = bucket_reserve(new_bucket, new_bucket->size + 1);
-            if (err != HT_OK) {
-                for (size_t k = 0; k < new_capacity; k++)
-                    free_mem(new_buckets[k].entries);
-                free_mem(new_buckets);
-                return err;
-            }
+    ht_err_t err = migrate(ht, SIZE_MAX);
+    if (err != HT_OK) return err;
 
-            new_bucket->entries[new_bucket->size++] = *entry;
-        }
-        free_mem(old_bucket->entries);
-    }
+    ht_table_t table;
+    err = table_alloc(&table, is_swiss(ht), new_capacity);
+    if (err != HT_OK) return err;
 
-    free_mem(ht->buckets);
-    ht->buckets = new_buckets;
-    ht->capacity = new_capacity;
+    ht->old = ht->table;
+    ht->table = table;
+    ht->migrated = 0;
 
-    return HT_OK;
+    size_t limit = load_limit(ht, new_capacity);
+    size_t room = limit > ht->size ? limit - ht->size : 1;
+    ht->migrate_step = migrate_units(ht) / room + 1;
+
+    return ht->config.incremental_resize ? HT_OK : migrate(ht, SIZE_MAX);
+}
+
+/* the smallest capacity that holds n entries within the load factor, or 0 if there is none */
+static size_t capacity_for(const ht_t *ht, size_t n) {
+    double buckets = (double) n / ht->config.load_factor + 1;
+    if (buckets > (double) (SIZE_MAX / 2)) return 0;
+
+    size_t capacity = next_pow2((size_t) buckets);
+    if (is_swiss(ht) && capacity < GROUP_SLOTS) capacity = GROUP_SLOTS;
+    return capacity;
+}
+
+static size_t capacity_floor(const ht_t *ht) {
+    return ht->reserved > ht->min_capacity ? ht->reserved : ht->min_capacity;
+}
+
+/* shrinks the table once its load drops under min_load_factor, to a capacity at which it is at
+ * most half as loaded as the load factor allows, so that it has to double in size before it grows
+ * again. not while a resize is still under way, which would have to be finished at once */
+static void maybe_shrink(ht_t *ht) {
+    size_t capacity = ht->table.capacity;
+    if (ht->config.min_load_factor <= 0 || resizing(ht)) return;
+    if (capacity <= capacity_floor(ht)) return;
+    if ((double) ht->size >= (double) capacity * ht->config.min_load_factor) return;
+
+    size_t target = capacity_for(ht, 2 * ht->size);
+    if (target < capacity_floor(ht)) target = capacity_floor(ht);
+
+    /* a failed shrink leaves the table as it was */
+    if (target < capacity) ht_resize(ht, target);
+}
+
+/* grows the table if one more entry would take it past the load factor; tombstones count
+ * towards the load of a swiss table, and when they make up most of it the table is only
+ * rebuilt at the same size to clear them */
+static ht_err_t make_room(ht_t *ht) {
+    size_t capacity = ht->table.capacity;
+    size_t limit = load_limit(ht, capacity);
+    if (!is_swiss(ht)) return ht->size + 1 > limit ? ht_resize(ht, capacity * 2) : HT_OK;
+
+    if (ht->size + ht->table.tombstones + 1 <= limit) return HT_OK;
+    return ht_resize(ht, ht->size + 1 > limit / 2 ? capacity * 2 : capacity);
+}
+
+static uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
 }
 
 ht_t *ht_create(const ht_config_t *config) {
@@ -143,11 +515,25 @@ ht_t *ht_create(const ht_config_t *config) {
         ht->config.load_factor = DEFAULT_LOAD_FACTOR;
     }
 
-    ht->capacity = next_pow2(ht->config.initial_capacity);
-    ht->size = 0;
+    size_t capacity = next_pow2(ht->config.initial_capacity);
+    if (is_swiss(ht)) {
+        if (ht->config.load_factor > SWISS_MAX_LOAD) ht->config.load_factor = SWISS_MAX_LOAD;
+        if (capacity < GROUP_SLOTS) capacity = GROUP_SLOTS;
+    }
 
-    ht->buckets = calloc_mem(ht->capacity, sizeof(ht_bucket_t));
-    if (!ht->buckets) {
+    if (ht->config.min_load_factor == 0.0) {
+        ht->config.min_load_factor = ht->config.load_factor / 4;
+    }
+
+    if (!ht->config.clock) ht->config.clock = monotonic_ms;
+
+    if (ht->config.eviction_samples == 0) ht->config.eviction_samples = DEFAULT_EVICTION_SAMPLES;
+    ht->rng = ht->config.seed ^ 0x9E3779B97F4A7C15ULL;
+    if (ht->rng == 0) ht->rng = 1;
+
+    ht->size = 0;
+    ht->min_capacity = capacity;
+    if (table_alloc(&ht->table, is_swiss(ht), capacity) != HT_OK) {
         free_mem(ht);
         return NULL;
     }
@@ -155,85 +541,845 @@ ht_t *ht_create(const ht_config_t *config) {
     return ht;
 }
 
+/* the entry the iterator is at, moving it past empty buckets and slots first; during a resize
+ * bucket_idx counts the old table's buckets, or slots, before those of the new one */
+static ht_entry_t *iter_seek(ht_iter_t *hi) {
+    ht_t *ht = hi->ht;
+    for (;; hi->bucket_idx++, hi->entry_idx = 0) {
+        const ht_table_t *t = &ht->old;
+        size_t idx = hi->bucket_idx;
+        if (idx >= t->capacity) {
+            idx -= t->capacity;
+            t = &ht->table;
+            if (idx >= t->capacity) return NULL;
+        }
+
+        if (is_swiss(ht)) {
+            if (slot_full(t->ctrl[idx])) return &t->slots[idx];
+        } else if (hi->entry_idx < t->buckets[idx].size) {
+            return &t->buckets[idx].entries[hi->entry_idx];
+        }
+    }
+}
+
+static void iter_advance(ht_iter_t *hi) {
+    if (is_swiss(hi->ht))
+        hi->bucket_idx++;
+    else
+        hi->entry_idx++;
+}
+
+static void release_entries(ht_t *ht) {
+    ht_iter_t hi = ht_iter_begin(ht);
+    for (ht_entry_t *entry; (entry = iter_seek(&hi)); iter_advance(&hi))
+        entry_release(&ht->config, entry);
+}
+
 void ht_destroy(ht_t *ht) {
     if (!ht) return;
 
-    for (size_t i = 0; i < ht->capacity; i++) {
-        ht_bucket_t *bucket = &ht->buckets[i];
-        for (size_t j = 0; j < bucket->size; j++) {
-            ht_entry_t *entry = &bucket->entries[j];
-            if (ht->config.free_key && entry->key) ht->config.free_key(entry->key);
-            if (ht->config.free_val && entry->val) ht->config.free_val(entry->val);
+    release_entries(ht);
+    table_free(&ht->table);
+    table_free(&ht->old);
+    free_mem(ht->deadlines);
+    free_mem(ht);
+}
+
+static void entry_set_val(ht_t *ht, ht_entry_t *entry, const void *val, size_t val_len) {
+    ht_data_t dup_val = copy_val(&ht->config, val, val_len);
+    release_val(&ht->config, &entry->val, entry->val_len);
+    ht->bytes -= entry_bytes(&ht->config, entry->key_len, entry->val_len);
+    entry->val = dup_val;
+    entry->val_len = (uint32_t) val_len;
+    ht->bytes += entry_bytes(&ht->config, entry->key_len, entry->val_len);
+}
+
+static void entry_delete(ht_t *ht, ht_entry_t *entry) {
+    if (entry->expires) ht->expiring--;
+    ht->bytes -= entry_bytes(&ht->config, entry->key_len, entry->val_len);
+    entry_release(&ht->config, entry);
+    entry_remove(ht, entry);
+
+    ht->size--;
+    maybe_shrink(ht);
+}
+
+/* *now, when given, gets the clock reading the entry was checked against, if it was read at all */
+static int expired_now(const ht_t *ht, const ht_entry_t *entry, uint64_t *now) {
+    if (!entry->expires) return 0;
+
+    uint64_t clock = ht->config.clock();
+    if (now) *now = clock;
+    return entry->expires <= clock;
+}
+
+static int expired(const ht_t *ht, const ht_entry_t *entry) {
+    return expired_now(ht, entry, NULL);
+}
+
+/* a cache picks the entries it evicts by sampling a few at random and taking the one that has
+ * gone unused the longest, or with HT_EVICT_LFU the one used the least, which approximates
+ * evicting the least recently or least frequently used key of the whole table for the price of
+ * an access stamp per entry */
+#define EVICT_MAX_MISSES 8
+
+/* a new entry's uses start above 0 so that it is not evicted before it had a chance to be used */
+#define LFU_INITIAL_USES 5
+#define LFU_LOG_FACTOR 10
+
+static uint64_t next_random(uint64_t *rng) {
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 7;
+    *rng ^= *rng << 17;
+    return *rng;
+}
+
+static int is_cache(const ht_t *ht) {
+    return ht->config.max_bytes != 0;
+}
+
+/* whether a key and value could not fit in the cache even with every other key evicted */
+static int too_big(const ht_t *ht, size_t key_len, size_t val_len) {
+    return is_cache(ht) && entry_bytes(&ht->config, key_len, val_len) > ht->config.max_bytes;
+}
+
+static uint32_t idle_accesses(const ht_t *ht, const ht_entry_t *entry) {
+    return (uint32_t) ht->accesses - entry->used_at;
+}
+
+/* the entry's uses, less one for every time the table has seen as many accesses as it holds keys
+ * since the entry was last used */
+static unsigned lfu_uses(const ht_t *ht, const ht_entry_t *entry) {
+    size_t decay = idle_accesses(ht, entry) / (ht->size ? ht->size : 1);
+    return decay >= entry->uses ? 0 : entry->uses - (unsigned) decay;
+}
+
+/* a use adds to an entry's uses with a chance that falls as they grow, so that the most a byte
+ * holds stands for about a million uses */
+static void entry_touch(ht_t *ht, ht_entry_t *entry) {
+    if (!is_cache(ht)) return;
+
+    if (ht->config.eviction == HT_EVICT_LFU) {
+        unsigned uses = lfu_uses(ht, entry);
+        unsigned base = uses > LFU_INITIAL_USES ? uses - LFU_INITIAL_USES : 0;
+        if (uses < UINT8_MAX && next_random(&ht->rng) % (base * LFU_LOG_FACTOR + 1) == 0) uses++;
+        entry->uses = (uint8_t) uses;
+    }
+    entry->used_at = (uint32_t) ++ht->accesses;
+}
+
+/* how much the entry deserves to be evicted; an expired one more than any other */
+static uint64_t evict_score(const ht_t *ht, const ht_entry_t *entry, uint64_t now) {
+    if (entry->expires && entry->expires <= now) return UINT64_MAX;
+
+    uint64_t idle = idle_accesses(ht, entry);
+    if (ht->config.eviction != HT_EVICT_LFU) return idle;
+    return (uint64_t) (UINT8_MAX - lfu_uses(ht, entry)) << 32 | idle;
+}
+
+/* the first entry at or after a random slot, or a random entry of the first bucket with any at or
+ * after a random bucket, in either table of a resize */
+static ht_entry_t *entry_sample(ht_t *ht) {
+    uint64_t r = next_random(&ht->rng);
+    const ht_table_t *t = resizing(ht) && (r >> 63) ? &ht->old : &ht->table;
+
+    size_t mask = t->capacity - 1;
+    size_t idx = (size_t) r & mask;
+    for (size_t n = 0; n < t->capacity; n++, idx = (idx + 1) & mask) {
+        if (is_swiss(ht)) {
+            if (slot_full(t->ctrl[idx])) return &t->slots[idx];
+        } else if (t->buckets[idx].size) {
+            ht_bucket_t *bucket = &t->buckets[idx];
+            return &bucket->entries[(r >> 32) % bucket->size];
         }
-        free_mem(bucket->entries);
     }
+    return NULL;
+}
 
-    free_mem(ht->buckets);
-    free_mem(ht);
+/* expired entries are deleted without counting as evictions */
+static void entry_evict(ht_t *ht, ht_entry_t *entry, uint64_t now) {
+    if (!entry->expires || entry->expires > now) {
+        ht->evictions++;
+        if (ht->config.on_evict)
+            ht->config.on_evict(data_of(&ht->config, &entry->key, entry->key_len), entry->key_len,
+                                data_of(&ht->config, &entry->val, entry->val_len), entry->val_len,
+                                ht->config.evict_ctx);
+    }
+    entry_delete(ht, entry);
 }
 
-ht_err_t ht_set(ht_t *ht, const void *key, size_t key_len, const void *val, size_t val_len) {
-    if (!ht || !key) return HT_ERR;
+/* the worst of eviction_samples entries sampled at random that do not have the hash keep */
+static ht_entry_t *entry_pick(ht_t *ht, uint64_t keep, uint64_t now) {
+    ht_entry_t *victim = NULL;
+    uint64_t worst = 0;
+    for (size_t i = 0; i < ht->config.eviction_samples; i++) {
+        ht_entry_t *entry = entry_sample(ht);
+        if (!entry || entry->hash == keep) continue;
+
+        uint64_t score = evict_score(ht, entry, now);
+        if (!victim || score > worst) {
+            victim = entry;
+            worst = score;
+        }
+    }
+    return victim;
+}
 
-    if (ht->size + 1 > (size_t) (ht->capacity * ht->config.load_factor)) {
-        ht_err_t err = ht_resize(ht, ht->capacity * 2);
-        if (err != HT_OK) return err;
+/* the first entry that does not have the hash keep, for when sampling keeps finding only those */
+static ht_entry_t *entry_other(ht_t *ht, uint64_t keep) {
+    ht_iter_t hi = ht_iter_begin(ht);
+    for (ht_entry_t *entry; (entry = iter_seek(&hi)); iter_advance(&hi))
+        if (entry->hash != keep) return entry;
+    return NULL;
+}
+
+/* evicts entries until incoming more bytes fit in a cache, sparing those with the hash keep, that
+ * of the key being added or changed. entries can move, so none found before stays valid */
+static void cache_evict(ht_t *ht, size_t incoming, uint64_t keep) {
+    if (!is_cache(ht)) return;
+
+    uint64_t now = ht->expiring ? ht->config.clock() : 0;
+    int misses = 0;
+    while (ht->bytes + incoming > ht->config.max_bytes) {
+        ht_entry_t *victim = entry_pick(ht, keep, now);
+        if (!victim && ++misses >= EVICT_MAX_MISSES) {
+            victim = entry_other(ht, keep);
+            if (!victim) return;
+        }
+        if (victim) entry_evict(ht, victim, now);
     }
+}
+
+/* adds key, which entry_find has just not found, with val, evicting other keys first in a cache */
+static ht_err_t entry_insert(ht_t *ht, uint64_t hash, const void *key, size_t key_len,
+                             const void *val, size_t val_len, ht_entry_t **out_entry) {
+    if (too_big(ht, key_len, val_len)) return HT_ENONEM;
+    size_t bytes = entry_bytes(&ht->config, key_len, val_len);
+    cache_evict(ht, bytes, hash);
+
+    ht_err_t err = make_room(ht);
+    if (err != HT_OK) return err;
 
-    uint64_t hash = ht->config.hash(key, key_len, ht->config.seed);
-    size_t idx = hash & (ht->capacity - 1);
-    ht_bucket_t *bucket = &ht->buckets[idx];
+    ht_entry_t *entry = entry_claim(ht, hash);
+    if (!entry) return HT_ENONEM;
 
-    void *dup_key = ht->config.dup_key ? ht->config.dup_key(key, key_len) : (void *) key;
-    void *dup_val = ht->config.dup_val ? ht->config.dup_val(val, val_len) : (void *) val;
+    entry->key = copy_key(&ht->config, key, key_len);
+    entry->key_len = (uint32_t) key_len;
+    entry->val = copy_val(&ht->config, val, val_len);
+    entry->val_len = (uint32_t) val_len;
+    entry->expires = 0;
+    entry->uses = LFU_INITIAL_USES;
+    entry->used_at = (uint32_t) ++ht->accesses;
+    ht->bytes += bytes;
+    ht->size++;
 
-    size_t prev_bucket_size = bucket->size;
+    if (out_entry) *out_entry = entry;
+    return HT_OK;
+}
 
-    int err = bucket_insert(bucket, hash, dup_key, key_len, dup_val, val_len, &ht->config);
-    if (err == HT_OK && bucket->size > prev_bucket_size) ht->size++;
+/* entry_find for the calls that may change the table: an expired entry it comes across is deleted
+ * and reported missing, and a live one counts as used. *now is as for expired_now */
+static ht_entry_t *entry_find_live_now(ht_t *ht, uint64_t hash, const void *key, size_t key_len,
+                                       uint64_t *now) {
+    ht_entry_t *entry = entry_find(ht, hash, key, key_len);
+    if (!entry) return NULL;
+    if (!expired_now(ht, entry, now)) {
+        entry_touch(ht, entry);
+        return entry;
+    }
 
-    return err;
+    entry_delete(ht, entry);
+    return NULL;
 }
 
-ht_err_t ht_get(ht_t *ht, const void *key, size_t key_len, void **out_val) {
+static ht_entry_t *entry_find_live(ht_t *ht, uint64_t hash, const void *key, size_t key_len) {
+    return entry_find_live_now(ht, hash, key, key_len, NULL);
+}
+
+static void deadline_push(ht_t *ht, uint64_t deadline, uint64_t hash) {
+    ht_deadline_t *heap = ht->deadlines;
+    size_t i = ht->deadlines_len++;
+    for (; i > 0 && heap[(i - 1) / 2].deadline > deadline; i = (i - 1) / 2)
+        heap[i] = heap[(i - 1) / 2];
+    heap[i] = (ht_deadline_t) {deadline, hash};
+}
+
+static void deadline_pop(ht_t *ht) {
+    ht_deadline_t *heap = ht->deadlines;
+    ht_deadline_t last = heap[--ht->deadlines_len];
+    size_t n = ht->deadlines_len, i = 0;
+    for (size_t child; (child = 2 * i + 1) < n; i = child) {
+        if (child + 1 < n && heap[child + 1].deadline < heap[child].deadline) child++;
+        if (heap[child].deadline >= last.deadline) break;
+        heap[i] = heap[child];
+    }
+    if (n > 0) heap[i] = last;
+}
+
+/* makes room in the heap for one more deadline. once most of the heap is left-behind deadlines it
+ * is rebuilt from the entries instead of grown, which costs a pass over the table per as many
+ * deadlines as the table has expiring entries */
+static ht_err_t deadline_reserve(ht_t *ht) {
+    if (ht->deadlines_len < ht->deadlines_cap) return HT_OK;
+
+    if (ht->deadlines_len > 2 * ht->expiring + 64) {
+        ht->deadlines_len = 0;
+        ht_iter_t hi = ht_iter_begin(ht);
+        for (ht_entry_t *entry; (entry = iter_seek(&hi)); iter_advance(&hi))
+            if (entry->expires) deadline_push(ht, entry->expires, entry->hash);
+        return HT_OK;
+    }
+
+    size_t cap = ht->deadlines_cap ? ht->deadlines_cap * 2 : 64;
+    ht_deadline_t *heap = realloc_mem(ht->deadlines, cap * sizeof(ht_deadline_t));
+    if (!heap) return HT_ENONEM;
+
+    ht->deadlines = heap;
+    ht->deadlines_cap = cap;
+    return HT_OK;
+}
+
+/* gives entry a deadline ttl from now, after deadline_reserve has made room for it */
+static void entry_expire(ht_t *ht, ht_entry_t *entry, uint64_t ttl) {
+    uint64_t now = ht->config.clock();
+    uint64_t deadline = ttl > UINT64_MAX - now ? UINT64_MAX : now + ttl;
+    if (deadline == 0) deadline = 1;
+
+    if (!entry->expires) ht->expiring++;
+    entry->expires = deadline;
+    deadline_push(ht, deadline, entry->hash);
+}
+
+static void entry_persist(ht_t *ht, ht_entry_t *entry) {
+    if (entry->expires) ht->expiring--;
+    entry->expires = 0;
+}
+
+/* an expired entry with the given hash, in either table of a resize */
+static ht_entry_t *entry_find_expired(ht_t *ht, uint64_t hash, uint64_t now) {
+    const ht_table_t *tables[] = {&ht->table, &ht->old};
+    for (int t = 0; t < 2 && tables[t]->capacity; t++) {
+        const ht_table_t *table = tables[t];
+        if (is_swiss(ht)) {
+            size_t groups_mask = table->capacity / GROUP_SLOTS - 1;
+            size_t group = (hash >> 7) & groups_mask;
+            for (size_t step = 1;; step++) {
+                const uint8_t *ctrl = table->ctrl + group * GROUP_SLOTS;
+                unsigned match = group_match(ctrl, hash_tag(hash));
+                for (; match; match &= match - 1) {
+                    ht_entry_t *entry = &table->slots[group * GROUP_SLOTS + __builtin_ctz(match)];
+                    if (entry->hash == hash && entry->expires && entry->expires <= now)
+                        return entry;
+                }
+                if (group_match(ctrl, CTRL_EMPTY)) break;
+                group = (group + step) & groups_mask;
+            }
+        } else {
+            ht_bucket_t *bucket = &table->buckets[hash & (table->capacity - 1)];
+            for (size_t i = 0; i < bucket->size; i++) {
+                ht_entry_t *entry = &bucket->entries[i];
+                if (entry->hash == hash && entry->expires && entry->expires <= now) return entry;
+            }
+        }
+    }
+    return NULL;
+}
+
+size_t ht_expire_step(ht_t *ht, size_t budget) {
+    if (!ht) return 0;
+
+    uint64_t now = ht->config.clock();
+    size_t removed = 0;
+    for (; budget > 0 && ht->deadlines_len > 0 && ht->deadlines[0].deadline <= now; budget--) {
+        uint64_t hash = ht->deadlines[0].hash;
+        deadline_pop(ht);
+
+        for (ht_entry_t *entry; (entry = entry_find_expired(ht, hash, now)); removed++)
+            entry_delete(ht, entry);
+    }
+    return removed;
+}
+
+uint64_t ht_hash(const ht_t *ht, const void *key, size_t key_len) {
+    if (!ht || !key) return 0;
+    return ht->config.hash(key, key_len, ht->config.seed);
+}
+
+ht_err_t ht_set_hashed(ht_t *ht, const void *key, size_t key_len, uint64_t hash, const void *val,
+                       size_t val_len) {
+    if (!ht || !key || key_len > HT_MAX_LEN || val_invalid(val, val_len)) return HT_ERR;
+
+    ht_err_t err = migrate(ht, ht->migrate_step);
+    if (err != HT_OK) return err;
+
+    ht_entry_t *entry = entry_find_live(ht, hash, key, key_len);
+    if (!entry) return entry_insert(ht, hash, key, key_len, val, val_len, NULL);
+    if (too_big(ht, key_len, val_len)) return HT_ENONEM;
+
+    entry_set_val(ht, entry, val, val_len);
+    entry_persist(ht, entry);
+    cache_evict(ht, 0, hash);
+    return HT_OK;
+}
+
+ht_err_t ht_get_hashed(ht_t *ht, const void *key, size_t key_len, uint64_t hash, void **out_val) {
     if (!ht || !key || !out_val) return HT_ERR;
 
-    uint64_t hash = ht->config.hash(key, key_len, ht->config.seed);
-    size_t idx = hash & (ht->capacity - 1);
-    ht_bucket_t *bucket = &ht->buckets[idx];
+    ht_entry_t *entry = entry_find_live(ht, hash, key, key_len);
+    if (!entry) {
+        ht->misses++;
+        return HT_ENOTFOUND;
+    }
 
-    int i = bucket_find(bucket, hash, key, key_len, &ht->config);
-    if (i < 0) return HT_ENOTFOUND;
+    ht->hits++;
+    *out_val = data_of(&ht->config, &entry->val, entry->val_len);
+    return HT_OK;
+}
 
-    *out_val = bucket->entries[i].val;
+ht_err_t ht_delete_hashed(ht_t *ht, const void *key, size_t key_len, uint64_t hash) {
+    if (!ht || !key) return HT_ERR;
+
+    /* a failed migration step is retried by the next call */
+    migrate(ht, ht->migrate_step);
+
+    ht_entry_t *entry = entry_find_live(ht, hash, key, key_len);
+    if (!entry) return HT_ENOTFOUND;
+
+    entry_delete(ht, entry);
     return HT_OK;
 }
 
-ht_err_t ht_delete(ht_t *ht, const void *key, size_t key_len) {
+ht_err_t ht_has_hashed(ht_t *ht, const void *key, size_t key_len, uint64_t hash) {
     if (!ht || !key) return HT_ERR;
 
-    uint64_t hash = ht->config.hash(key, key_len, ht->config.seed);
-    size_t idx = hash & (ht->capacity - 1);
-    ht_bucket_t *bucket = &ht->buckets[idx];
+    ht_entry_t *entry = entry_find_live(ht, hash, key, key_len);
+    if (!entry) {
+        ht->misses++;
+        return HT_ENOTFOUND;
+    }
 
-    void *dup_key = ht->config.dup_key ? ht->config.dup_key(key, key_len) : (void *) key;
+    ht->hits++;
+    return HT_OK;
+}
+
+ht_err_t ht_get_or_insert_hashed(ht_t *ht, const void *key, size_t key_len, uint64_t hash,
+                                 const void *val, size_t val_len, void **out_val, int *inserted) {
+    if (!ht || !key || !out_val || key_len > HT_MAX_LEN || val_invalid(val, val_len)) return HT_ERR;
 
-    int err = bucket_delete(bucket, hash, dup_key, key_len, &ht->config);
+    ht_err_t err = migrate(ht, ht->migrate_step);
     if (err != HT_OK) return err;
 
-    ht->size--;
-    return err;
+    ht_entry_t *entry = entry_find_live(ht, hash, key, key_len);
+    if (inserted) *inserted = !entry;
+    if (entry) {
+        ht->hits++;
+    } else {
+        ht->misses++;
+        err = entry_insert(ht, hash, key, key_len, val, val_len, &entry);
+        if (err != HT_OK) return err;
+    }
+
+    *out_val = data_of(&ht->config, &entry->val, entry->val_len);
+    return HT_OK;
 }
 
-ht_err_t ht_has(ht_t *ht, const void *key, size_t key_len) {
+ht_err_t ht_update_hashed(ht_t *ht, const void *key, size_t key_len, uint64_t hash,
+                          ht_update_func update, void *ctx) {
+    if (!ht || !key || !update) return HT_ERR;
+
+    ht_entry_t *entry = entry_find_live(ht, hash, key, key_len);
+    if (!entry) return HT_ENOTFOUND;
+
+    update(data_of(&ht->config, &entry->val, entry->val_len), entry->val_len, ctx);
+    return HT_OK;
+}
+
+ht_err_t ht_compare_and_set_hashed(ht_t *ht, const void *key, size_t key_len, uint64_t hash,
+                                   const void *expected, size_t expected_len, const void *val,
+                                   size_t val_len) {
+    if (!ht || !key || val_invalid(val, val_len)) return HT_ERR;
+
+    ht_entry_t *entry = entry_find_live(ht, hash, key, key_len);
+    if (!entry) return HT_ENOTFOUND;
+
+    void *current = data_of(&ht->config, &entry->val, entry->val_len);
+    if (entry->val_len != expected_len) return HT_EMISMATCH;
+    if (expected_len && (!current || !expected || memcmp(current, expected, expected_len) != 0))
+        return HT_EMISMATCH;
+
+    if (too_big(ht, key_len, val_len)) return HT_ENONEM;
+
+    entry_set_val(ht, entry, val, val_len);
+    cache_evict(ht, 0, hash);
+    return HT_OK;
+}
+
+ht_err_t ht_remove_if_hashed(ht_t *ht, const void *key, size_t key_len, uint64_t hash,
+                             ht_predicate_func pred, void *ctx) {
+    if (!ht || !key || !pred) return HT_ERR;
+
+    migrate(ht, ht->migrate_step);
+
+    ht_entry_t *entry = entry_find_live(ht, hash, key, key_len);
+    if (!entry) return HT_ENOTFOUND;
+    if (!pred(data_of(&ht->config, &entry->val, entry->val_len), entry->val_len, ctx))
+        return HT_EMISMATCH;
+
+    entry_delete(ht, entry);
+    return HT_OK;
+}
+
+ht_err_t ht_set_ttl_hashed(ht_t *ht, const void *key, size_t key_len, uint64_t hash,
+                           const void *val, size_t val_len, uint64_t ttl) {
+    if (!ht || !key || key_len > HT_MAX_LEN || val_invalid(val, val_len)) return HT_ERR;
+
+    ht_err_t err = deadline_reserve(ht);
+    if (err != HT_OK) return err;
+    err = migrate(ht, ht->migrate_step);
+    if (err != HT_OK) return err;
+
+    ht_entry_t *entry = entry_find_live(ht, hash, key, key_len);
+    if (entry) {
+        if (too_big(ht, key_len, val_len)) return HT_ENONEM;
+        entry_set_val(ht, entry, val, val_len);
+    } else {
+        err = entry_insert(ht, hash, key, key_len, val, val_len, &entry);
+        if (err != HT_OK) return err;
+    }
+
+    entry_expire(ht, entry, ttl);
+    cache_evict(ht, 0, hash);
+    return HT_OK;
+}
+
+ht_err_t ht_expire_hashed(ht_t *ht, const void *key, size_t key_len, uint64_t hash, uint64_t ttl) {
     if (!ht || !key) return HT_ERR;
 
-    uint64_t hash = ht->config.hash(key, key_len, ht->config.seed);
-    size_t idx = hash & (ht->capacity - 1);
-    ht_bucket_t *bucket = &ht->buckets[idx];
+    ht_err_t err = deadline_reserve(ht);
+    if (err != HT_OK) return err;
 
-    int i = bucket_find(bucket, hash, key, key_len, &ht->config);
-    if (i < 0) return HT_ENOTFOUND;
+    ht_entry_t *entry = entry_find_live(ht, hash, key, key_len);
+    if (!entry) return HT_ENOTFOUND;
+
+    entry_expire(ht, entry, ttl);
+    return HT_OK;
+}
+
+ht_err_t ht_persist_hashed(ht_t *ht, const void *key, size_t key_len, uint64_t hash) {
+    if (!ht || !key) return HT_ERR;
+
+    ht_entry_t *entry = entry_find_live(ht, hash, key, key_len);
+    if (!entry) return HT_ENOTFOUND;
+
+    entry_persist(ht, entry);
+    return HT_OK;
+}
+
+ht_err_t ht_ttl_hashed(ht_t *ht, const void *key, size_t key_len, uint64_t hash, uint64_t *ttl) {
+    if (!ht || !key || !ttl) return HT_ERR;
+
+    /* the time left is taken from the same clock reading that found the entry live */
+    uint64_t now = 0;
+    ht_entry_t *entry = entry_find_live_now(ht, hash, key, key_len, &now);
+    if (!entry) return HT_ENOTFOUND;
+
+    if (!entry->expires)
+        *ttl = HT_NO_EXPIRY;
+    else
+        *ttl = entry->expires > now ? entry->expires - now : 0;
+    return HT_OK;
+}
+
+ht_err_t ht_set(ht_t *ht, const void *key, size_t key_len, const void *val, size_t val_len) {
+    return ht_set_hashed(ht, key, key_len, ht_hash(ht, key, key_len), val, val_len);
+}
+
+ht_err_t ht_get(ht_t *ht, const void *key, size_t key_len, void **out_val) {
+    return ht_get_hashed(ht, key, key_len, ht_hash(ht, key, key_len), out_val);
+}
+
+ht_err_t ht_delete(ht_t *ht, const void *key, size_t key_len) {
+    return ht_delete_hashed(ht, key, key_len, ht_hash(ht, key, key_len));
+}
+
+ht_err_t ht_has(ht_t *ht, const void *key, size_t key_len) {
+    return ht_has_hashed(ht, key, key_len, ht_hash(ht, key, key_len));
+}
+
+ht_err_t ht_get_or_insert(ht_t *ht, const void *key, size_t key_len, const void *val,
+                          size_t val_len, void **out_val, int *inserted) {
+    return ht_get_or_insert_hashed(ht, key, key_len, ht_hash(ht, key, key_len), val, val_len,
+                                   out_val, inserted);
+}
+
+ht_err_t ht_update(ht_t *ht, const void *key, size_t key_len, ht_update_func update, void *ctx) {
+    return ht_update_hashed(ht, key, key_len, ht_hash(ht, key, key_len), update, ctx);
+}
+
+ht_err_t ht_compare_and_set(ht_t *ht, const void *key, size_t key_len, const void *expected,
+                            size_t expected_len, const void *val, size_t val_len) {
+    return ht_compare_and_set_hashed(ht, key, key_len, ht_hash(ht, key, key_len), expected,
+                                     expected_len, val, val_len);
+}
+
+ht_err_t ht_remove_if(ht_t *ht, const void *key, size_t key_len, ht_predicate_func pred,
+                      void *ctx) {
+    return ht_remove_if_hashed(ht, key, key_len, ht_hash(ht, key, key_len), pred, ctx);
+}
+
+ht_err_t ht_set_ttl(ht_t *ht, const void *key, size_t key_len, const void *val, size_t val_len,
+                    uint64_t ttl) {
+    return ht_set_ttl_hashed(ht, key, key_len, ht_hash(ht, key, key_len), val, val_len, ttl);
+}
+
+ht_err_t ht_expire(ht_t *ht, const void *key, size_t key_len, uint64_t ttl) {
+    return ht_expire_hashed(ht, key, key_len, ht_hash(ht, key, key_len), ttl);
+}
+
+ht_err_t ht_persist(ht_t *ht, const void *key, size_t key_len) {
+    return ht_persist_hashed(ht, key, key_len, ht_hash(ht, key, key_len));
+}
+
+ht_err_t ht_ttl(ht_t *ht, const void *key, size_t key_len, uint64_t *ttl) {
+    return ht_ttl_hashed(ht, key, key_len, ht_hash(ht, key, key_len), ttl);
+}
+
+/* the batch operations work through their keys BATCH_KEYS at a time. every key of a batch is
+ * hashed and its bucket, or control bytes, prefetched; then the entries those lead to; then the
+ * stored keys the entries point at. only then are the keys looked up one by one, by which time
+ * their cache misses have been waited out side by side rather than one after another. during a
+ * resize only the table new entries go to is prefetched */
+#define BATCH_KEYS 16
+
+static void prefetch_home(const ht_t *ht, uint64_t hash) {
+    const ht_table_t *t = &ht->table;
+    if (is_swiss(ht)) {
+        size_t group = (hash >> 7) & (t->capacity / GROUP_SLOTS - 1);
+        __builtin_prefetch(t->ctrl + group * GROUP_SLOTS);
+    } else {
+        __builtin_prefetch(&t->buckets[hash & (t->capacity - 1)]);
+    }
+}
+
+/* reads what prefetch_home fetched: a chained bucket's entry array, or the first slot of a swiss
+ * group whose control byte matches */
+static void prefetch_entry(const ht_t *ht, uint64_t hash) {
+    const ht_table_t *t = &ht->table;
+    if (is_swiss(ht)) {
+        size_t group = (hash >> 7) & (t->capacity / GROUP_SLOTS - 1);
+        unsigned match = group_match(t->ctrl + group * GROUP_SLOTS, hash_tag(hash));
+        if (match) __builtin_prefetch(&t->slots[group * GROUP_SLOTS + __builtin_ctz(match)]);
+    } else {
+        const ht_bucket_t *bucket = &t->buckets[hash & (t->capacity - 1)];
+        if (bucket->size) __builtin_prefetch(bucket->entries);
+    }
+}
+
+/* reads what prefetch_entry fetched: the key an out-of-line entry with the same hash points to */
+static void prefetch_key(const ht_t *ht, uint64_t hash) {
+    const ht_table_t *t = &ht->table;
+    const ht_entry_t *entry = NULL;
+    if (is_swiss(ht)) {
+        size_t group = (hash >> 7) & (t->capacity / GROUP_SLOTS - 1);
+        unsigned match = group_match(t->ctrl + group * GROUP_SLOTS, hash_tag(hash));
+        if (match) entry = &t->slots[group * GROUP_SLOTS + __builtin_ctz(match)];
+    } else {
+        const ht_bucket_t *bucket = &t->buckets[hash & (t->capacity - 1)];
+        for (size_t i = 0; i < bucket->size && !entry; i++)
+            if (bucket->entries[i].hash == hash) entry = &bucket->entries[i];
+    }
+    if (entry && entry->hash == hash && !is_inline(&ht->config, entry->key_len))
+        __builtin_prefetch(entry->key.ptr);
+}
+
+/* the hashes of a batch, either the given ones or computed into buf, with the batch prefetched */
+static const uint64_t *batch_prefetch(const ht_t *ht, size_t count, const void *const *keys,
+                                      const size_t *key_lens, const uint64_t *hashes,
+                                      uint64_t *buf) {
+    if (!hashes) {
+        for (size_t i = 0; i < count; i++)
+            buf[i] = ht->config.hash(keys[i], key_lens[i], ht->config.seed);
+        hashes = buf;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        prefetch_home(ht, hashes[i]);
+    for (size_t i = 0; i < count; i++)
+        prefetch_entry(ht, hashes[i]);
+    for (size_t i = 0; i < count; i++)
+        prefetch_key(ht, hashes[i]);
+    return hashes;
+}
+
+static int batch_valid(size_t count, const void *const *keys, const size_t *key_lens) {
+    if (count == 0) return 1;
+    if (!keys || !key_lens) return 0;
+    for (size_t i = 0; i < count; i++)
+        if (!keys[i]) return 0;
+    return 1;
+}
+
+/* the batch operations take hashes as NULL when they are to compute them */
+static ht_err_t get_many(ht_t *ht, size_t count, const void *const *keys, const size_t *key_lens,
+                         const uint64_t *hashes, void **out_vals, ht_err_t *errs) {
+    if (!ht || !out_vals || !batch_valid(count, keys, key_lens)) return HT_ERR;
+
+    ht_err_t result = HT_OK;
+    uint64_t buf[BATCH_KEYS];
+    for (size_t start = 0; start < count; start += BATCH_KEYS) {
+        size_t n = count - start < BATCH_KEYS ? count - start : BATCH_KEYS;
+        const uint64_t *h = batch_prefetch(ht, n, keys + start, key_lens + start,
+                                           hashes ? hashes + start : NULL, buf);
+
+        /* expired entries are left for later calls to delete, as deleting one could move the
+         * inline values already handed out */
+        for (size_t i = 0; i < n; i++) {
+            size_t k = start + i;
+            ht_entry_t *entry = entry_find(ht, h[i], keys[k], key_lens[k]);
+            if (entry && expired(ht, entry)) entry = NULL;
+            if (entry) {
+                entry_touch(ht, entry);
+                ht->hits++;
+            } else {
+                ht->misses++;
+            }
+
+            out_vals[k] = entry ? data_of(&ht->config, &entry->val, entry->val_len) : NULL;
+            if (errs) errs[k] = entry ? HT_OK : HT_ENOTFOUND;
+            if (!entry) result = HT_ENOTFOUND;
+        }
+    }
+    return result;
+}
+
+static ht_err_t set_many(ht_t *ht, size_t count, const void *const *keys, const size_t *key_lens,
+                         const uint64_t *hashes, const void *const *vals, const size_t *val_lens) {
+    if (!ht || (count && (!vals || !val_lens)) || !batch_valid(count, keys, key_lens))
+        return HT_ERR;
+
+    uint64_t buf[BATCH_KEYS];
+    for (size_t start = 0; start < count; start += BATCH_KEYS) {
+        size_t n = count - start < BATCH_KEYS ? count - start : BATCH_KEYS;
+        const uint64_t *h = batch_prefetch(ht, n, keys + start, key_lens + start,
+                                           hashes ? hashes + start : NULL, buf);
+
+        for (size_t i = 0; i < n; i++) {
+            size_t k = start + i;
+            ht_err_t err = ht_set_hashed(ht, keys[k], key_lens[k], h[i], vals[k], val_lens[k]);
+            if (err != HT_OK) return err;
+        }
+    }
+    return HT_OK;
+}
+
+static ht_err_t delete_many(ht_t *ht, size_t count, const void *const *keys,
+                            const size_t *key_lens, const uint64_t *hashes, ht_err_t *errs) {
+    if (!ht || !batch_valid(count, keys, key_lens)) return HT_ERR;
+
+    ht_err_t result = HT_OK;
+    uint64_t buf[BATCH_KEYS];
+    for (size_t start = 0; start < count; start += BATCH_KEYS) {
+        size_t n = count - start < BATCH_KEYS ? count - start : BATCH_KEYS;
+        const uint64_t *h = batch_prefetch(ht, n, keys + start, key_lens + start,
+                                           hashes ? hashes + start : NULL, buf);
+
+        for (size_t i = 0; i < n; i++) {
+            size_t k = start + i;
+            ht_err_t err = ht_delete_hashed(ht, keys[k], key_lens[k], h[i]);
+            if (errs) errs[k] = err;
+            if (err != HT_OK) result = err;
+        }
+    }
+    return result;
+}
+
+ht_err_t ht_get_many(ht_t *ht, size_t count, const void *const *keys, const size_t *key_lens,
+                     void **out_vals, ht_err_t *errs) {
+    return get_many(ht, count, keys, key_lens, NULL, out_vals, errs);
+}
+
+ht_err_t ht_set_many(ht_t *ht, size_t count, const void *const *keys, const size_t *key_lens,
+                     const void *const *vals, const size_t *val_lens) {
+    return set_many(ht, count, keys, key_lens, NULL, vals, val_lens);
+}
+
+ht_err_t ht_delete_many(ht_t *ht, size_t count, const void *const *keys, const size_t *key_lens,
+                        ht_err_t *errs) {
+    return delete_many(ht, count, keys, key_lens, NULL, errs);
+}
+
+ht_err_t ht_get_many_hashed(ht_t *ht, size_t count, const void *const *keys,
+                            const size_t *key_lens, const uint64_t *hashes, void **out_vals,
+                            ht_err_t *errs) {
+    if (count && !hashes) return HT_ERR;
+    return get_many(ht, count, keys, key_lens, hashes, out_vals, errs);
+}
+
+ht_err_t ht_set_many_hashed(ht_t *ht, size_t count, const void *const *keys,
+                            const size_t *key_lens, const uint64_t *hashes,
+                            const void *const *vals, const size_t *val_lens) {
+    if (count && !hashes) return HT_ERR;
+    return set_many(ht, count, keys, key_lens, hashes, vals, val_lens);
+}
+
+ht_err_t ht_delete_many_hashed(ht_t *ht, size_t count, const void *const *keys,
+                               const size_t *key_lens, const uint64_t *hashes, ht_err_t *errs) {
+    if (count && !hashes) return HT_ERR;
+    return delete_many(ht, count, keys, key_lens, hashes, errs);
+}
+
+ht_err_t ht_reserve(ht_t *ht, size_t count) {
+    if (!ht) return HT_ERR;
+
+    size_t capacity = capacity_for(ht, count);
+    if (capacity == 0) return HT_ENONEM;
+
+    if (capacity > ht->table.capacity) {
+        ht_err_t err = ht_resize(ht, capacity);
+        if (err != HT_OK) return err;
+    }
+    ht->reserved = capacity;
+    return HT_OK;
+}
+
+/* gives a chained table's buckets arrays no bigger than their entries need */
+static void buckets_trim(ht_table_t *t) {
+    for (size_t i = 0; i < t->capacity; i++) {
+        ht_bucket_t *bucket = &t->buckets[i];
+        if (bucket->capacity == bucket->size) continue;
+
+        if (bucket->size == 0) {
+            free_mem(bucket->entries);
+            bucket->entries = NULL;
+            bucket->capacity = 0;
+            continue;
+        }
+
+        ht_entry_t *entries = realloc_mem(bucket->entries, bucket->size * sizeof(ht_entry_t));
+        if (!entries) continue;
+        bucket->entries = entries;
+        bucket->capacity = bucket->size;
+    }
+}
+
+ht_err_t ht_shrink_to_fit(ht_t *ht) {
+    if (!ht) return HT_ERR;
+
+    ht_err_t err = migrate(ht, SIZE_MAX);
+    if (err != HT_OK) return err;
+
+    ht->reserved = 0;
+    size_t target = capacity_for(ht, ht->size);
+    if (target < ht->min_capacity) target = ht->min_capacity;
+
+    if (target < ht->table.capacity || ht->table.tombstones > 0) {
+        err = ht_resize(ht, target);
+        if (err != HT_OK) return err;
+        err = migrate(ht, SIZE_MAX);
+        if (err != HT_OK) return err;
+    }
+
+    if (!is_swiss(ht)) buckets_trim(&ht->table);
     return HT_OK;
 }
 
@@ -242,26 +1388,47 @@ size_t ht_size(const ht_t *ht) {
     return ht->size;
 }
 
+ht_stats_t ht_stats(const ht_t *ht) {
+    ht_stats_t stats = {0};
+    if (!ht) return stats;
+
+    stats.hits = ht->hits;
+    stats.misses = ht->misses;
+    stats.evictions = ht->evictions;
+    stats.bytes = ht->bytes;
+    return stats;
+}
+
+void ht_stats_reset(ht_t *ht) {
+    if (!ht) return;
+
+    ht->hits = 0;
+    ht->misses = 0;
+    ht->evictions = 0;
+}
+
 size_t ht_capacity(const ht_t *ht) {
     if (!ht) return 0;
-    return ht->capacity;
+    return ht->table.capacity;
 }
 
 void ht_clear(ht_t *ht) {
     if (!ht) return;
 
-    for (size_t i = 0; i < ht->capacity; i++) {
-        ht_bucket_t *bucket = &ht->buckets[i];
-        for (size_t j = 0; j < bucket->size; j++) {
-            ht_entry_t *entry = &bucket->entries[j];
-            int err = bucket_delete(bucket, entry->hash, entry->key, entry->key_len, &ht->config);
-            if (err != HT_OK) return;
-        }
-
-        free_mem(bucket->entries);
-        bucket->entries = NULL;
-        bucket->size = 0;
-        bucket->capacity = 0;
+    release_entries(ht);
+    table_free(&ht->old);
+    ht->deadlines_len = 0;
+    ht->expiring = 0;
+    ht->bytes = 0;
+
+    ht_table_t *t = &ht->table;
+    if (is_swiss(ht)) {
+        memset(t->ctrl, CTRL_EMPTY, t->capacity);
+        t->tombstones = 0;
+    } else {
+        /* the buckets keep their entry arrays for the entries that come next */
+        for (size_t i = 0; i < t->capacity; i++)
+            t->buckets[i].size = 0;
     }
 
     ht->size = 0;
@@ -269,36 +1436,22 @@ void ht_clear(ht_t *ht) {
 
 ht_iter_t ht_iter_begin(ht_t *ht) {
     ht_iter_t hi = {.ht = ht, .bucket_idx = 0, .entry_idx = 0};
-    while (hi.bucket_idx < ht->capacity && ht->buckets[hi.bucket_idx].size == 0)
-        hi.bucket_idx++;
-
     return hi;
 }
 
 int ht_iter_next(ht_iter_t *hi, void **key, size_t *key_len, void **val) {
     if (!hi || !hi->ht) return 0;
-    if (hi->bucket_idx >= hi->ht->capacity) return 0;
 
-    ht_bucket_t *bucket = &hi->ht->buckets[hi->bucket_idx];
-    if (hi->entry_idx >= bucket->size) {
-        hi->entry_idx = 0;
-        hi->bucket_idx++;
-
-        while (hi->bucket_idx < hi->ht->capacity && hi->ht->buckets[hi->bucket_idx].size == 0)
-            hi->bucket_idx++;
-
-        if (hi->bucket_idx >= hi->ht->capacity) {
-            hi->bucket_idx = 0;
-            return 0;
-        }
-
-        bucket = &hi->ht->buckets[hi->bucket_idx];
-    }
+    ht_entry_t *entry;
+    while ((entry = iter_seek(hi)) && expired(hi->ht, entry))
+        iter_advance(hi);
+    if (!entry) return 0;
+    iter_advance(hi);
 
-    ht_entry_t *entry = &bucket->entries[hi->entry_idx++];
-    if (key) *key = entry->key;
+    const ht_config_t *config = &hi->ht->config;
+    if (key) *key = data_of(config, &entry->key, entry->key_len);
     if (key_len) *key_len = entry->key_len;
-    if (val) *val = entry->val;
+    if (val) *val = data_of(config, &entry->val, entry->val_len);
 
     return 1;
 }
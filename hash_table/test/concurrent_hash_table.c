@@ -0,0 +1,214 @@
+#include "concurrent_hash_table.h"
+#include "allocator.h"
+#include "arena.h"
+#include "test.h"
+#include "utils.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+static void *dup_mem(const void *src, size_t size) {
+    if (!src || !size) return NULL;
+
+    void *dest = alloc_mem(size);
+    if (!dest) return NULL;
+
+    memcpy(dest, src, size);
+    return dest;
+}
+
+static int mem_eq(const void *a, size_t alen, const void *b, size_t blen) {
+    if (!a || !b || alen != blen) return 0;
+    return memcmp(a, b, alen) == 0;
+}
+
+static ht_config_t cht_config = {
+    .hash = fnv1a64,
+    .dup_key = dup_mem,
+    .dup_val = dup_mem,
+    .equals = mem_eq,
+    .free_key = free_mem,
+    .free_val = free_mem,
+    .seed = 0xDEADABADCAFEC,
+};
+
+TEST(cht_set_get_delete) {
+    cht_t *cht = cht_create(&cht_config);
+    ASSERT_NOT_NULL("cht should not be null", cht);
+
+    ASSERT_INT_EQUAL("cht_set should not return error", HT_OK,
+                     cht_set(cht, "name", 4, "hisyam", 6));
+    ASSERT_INT_EQUAL("cht_set should update the value", HT_OK,
+                     cht_set(cht, "name", 4, "kurniawan", 9));
+    ASSERT_ULONG_EQUAL("update should not increment size", 1UL, cht_size(cht));
+
+    char buf[16] = {0};
+    size_t len = 0;
+    ASSERT_INT_EQUAL("cht_get should find the key", HT_OK,
+                     cht_get(cht, "name", 4, buf, sizeof(buf), &len));
+    ASSERT_ULONG_EQUAL("cht_get should report the value's length", 9UL, len);
+    ASSERT_STR_EQUAL("value should be updated", "kurniawan", buf, 9);
+
+    char small[4] = {0};
+    ASSERT_INT_EQUAL("cht_get should find the key", HT_OK,
+                     cht_get(cht, "name", 4, small, sizeof(small), &len));
+    ASSERT_STR_EQUAL("a small buffer should get the start of the value", "kurn", small, 4);
+
+    ASSERT_INT_EQUAL("cht_delete should not return error", HT_OK, cht_delete(cht, "name", 4));
+    ASSERT_INT_EQUAL("deleted key should not exist", HT_ENOTFOUND, cht_has(cht, "name", 4));
+    ASSERT_INT_EQUAL("deleting again should not find the key", HT_ENOTFOUND,
+                     cht_delete(cht, "name", 4));
+    ASSERT_ULONG_EQUAL("size should be 0", 0UL, cht_size(cht));
+
+    cht_destroy(cht);
+}
+
+TEST(cht_grows_and_keeps_keys) {
+    cht_t *cht = cht_create(&cht_config);
+    ASSERT_NOT_NULL("cht should not be null", cht);
+    size_t capacity = cht_capacity(cht);
+
+    char key[16];
+    for (int i = 0; i < 10000; i++) {
+        snprintf(key, sizeof(key), "k%d", i);
+        ASSERT_INT_EQUAL("cht_set should not return error", HT_OK,
+                         cht_set(cht, key, strlen(key), &i, sizeof(i)));
+    }
+
+    ASSERT_TRUE("capacity should grow", cht_capacity(cht) > capacity);
+    ASSERT_ULONG_EQUAL("size should equal number of inserts", 10000UL, cht_size(cht));
+    for (int i = 0; i < 10000; i++) {
+        snprintf(key, sizeof(key), "k%d", i);
+        int val = -1;
+        ASSERT_INT_EQUAL("cht_get should find the key", HT_OK,
+                         cht_get(cht, key, strlen(key), &val, sizeof(val), NULL));
+        ASSERT_INT_EQUAL("key should keep its value", i, val);
+    }
+
+    cht_destroy(cht);
+}
+
+static void cht_fill(cht_t *cht, int count) {
+    char key[16];
+    for (int i = 0; i < count; i++) {
+        snprintf(key, sizeof(key), "k%d", i);
+        cht_set(cht, key, strlen(key), &i, sizeof(i));
+    }
+    cht_set(cht, "k0", 2, "replaced", 8);
+    cht_delete(cht, "k1", 2);
+}
+
+/* retired nodes and tables have to be freed by the time the table is destroyed; the first round
+ * sets up the memory that stays, such as the thread's epoch record and its list of retired
+ * memory */
+TEST(cht_destroy_frees_retired_memory) {
+    ht_config_t config = cht_config;
+    config.initial_capacity = 1;
+
+    cht_t *cht = cht_create(&config);
+    ASSERT_NOT_NULL("cht should not be null", cht);
+    cht_fill(cht, 1000);
+    cht_has(cht, "k0", 2);
+    cht_destroy(cht);
+
+    alloc_stats_t before;
+    alloc_stats(&before);
+
+    cht = cht_create(&config);
+    ASSERT_NOT_NULL("cht should not be null", cht);
+    cht_fill(cht, 5000);
+    ASSERT_TRUE("cht should have grown", cht_capacity(cht) > 1000);
+    cht_destroy(cht);
+
+    alloc_stats_t after;
+    alloc_stats(&after);
+    ASSERT_ULONG_EQUAL("every allocation of the table should be freed",
+                       (unsigned long) before.live_allocations,
+                       (unsigned long) after.live_allocations);
+}
+
+TEST(cht_rejects_arena) {
+    arena_t *arena = arena_create(0);
+    ht_config_t config = cht_config;
+    config.arena = arena;
+
+    ASSERT_NULL("an arena is not thread-safe", cht_create(&config));
+    arena_destroy(arena);
+}
+
+TEST(cht_rejects_max_bytes) {
+    ht_config_t config = cht_config;
+    config.max_bytes = 1 << 20;
+
+    ASSERT_NULL("a cht does not evict", cht_create(&config));
+}
+
+#define CHT_THREADS 4
+#define CHT_KEYS 512
+#define CHT_ROUNDS 20
+
+typedef struct {
+    cht_t *cht;
+    int id;
+    int bad;
+} cht_worker_t;
+
+/* writers own the keys w<id>:<n> and keep replacing and deleting them, storing n in every value;
+ * readers look up the keys of every writer and check the values they find */
+static void *cht_writer(void *arg) {
+    cht_worker_t *w = arg;
+    char key[32];
+    for (int round = 0; round < CHT_ROUNDS; round++) {
+        for (int n = 0; n < CHT_KEYS; n++) {
+            snprintf(key, sizeof(key), "w%d:%d", w->id, n);
+            int val[4] = {n, n, n, n};
+            if (cht_set(w->cht, key, strlen(key), val, sizeof(val)) != HT_OK) w->bad++;
+        }
+        for (int n = round % 2; n < CHT_KEYS; n += 2) {
+            snprintf(key, sizeof(key), "w%d:%d", w->id, n);
+            if (cht_delete(w->cht, key, strlen(key)) != HT_OK) w->bad++;
+        }
+    }
+    return NULL;
+}
+
+static void *cht_reader(void *arg) {
+    cht_worker_t *w = arg;
+    char key[32];
+    for (int round = 0; round < CHT_ROUNDS * 4; round++) {
+        for (int n = 0; n < CHT_KEYS; n++) {
+            snprintf(key, sizeof(key), "w%d:%d", n % 2, n);
+            int val[4] = {-1, -1, -1, -1};
+            size_t len = 0;
+            if (cht_get(w->cht, key, strlen(key), val, sizeof(val), &len) != HT_OK) continue;
+            if (len != sizeof(val) || val[0] != n || val[3] != n) w->bad++;
+        }
+    }
+    return NULL;
+}
+
+TEST(cht_concurrent_readers_and_writers) {
+    ht_config_t config = cht_config;
+    config.initial_capacity = 1;
+
+    cht_t *cht = cht_create(&config);
+    ASSERT_NOT_NULL("cht should not be null", cht);
+
+    pthread_t threads[CHT_THREADS];
+    cht_worker_t workers[CHT_THREADS];
+    for (int i = 0; i < CHT_THREADS; i++) {
+        workers[i] = (cht_worker_t) {.cht = cht, .id = i % 2, .bad = 0};
+        pthread_create(&threads[i], NULL, i < 2 ? cht_writer : cht_reader, &workers[i]);
+    }
+
+    int bad = 0;
+    for (int i = 0; i < CHT_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        bad += workers[i].bad;
+    }
+
+    ASSERT_INT_EQUAL("no operation should fail or see a torn value", 0, bad);
+    ASSERT_ULONG_EQUAL("each writer should leave every other key", (unsigned long) CHT_KEYS,
+                       cht_size(cht));
+    cht_destroy(cht);
+}
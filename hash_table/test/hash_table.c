@@ -154,3 +154,942 @@ TEST(ht_iterator) {
 
     ht_destroy(ht);
 }
+
+TEST(ht_arena_backed_keys_and_values) {
+    arena_t *arena = arena_create(0);
+    ASSERT_NOT_NULL("arena should not be null", arena);
+
+    ht_config_t config = default_config;
+    config.arena = arena;
+
+    ht_t *ht = ht_create(&config);
+    ASSERT_NOT_NULL("ht should not be null", ht);
+
+    for (int i = 0; i < 100; i++) {
+        char key[16];
+        snprintf(key, sizeof(key), "k%d", i);
+        ASSERT_INT_EQUAL("ht_set should not return error", HT_OK,
+                         ht_set(ht, key, strlen(key), &i, sizeof(i)));
+    }
+
+    void *val = NULL;
+    ASSERT_INT_EQUAL("ht_get should find the key", HT_OK, ht_get(ht, "k42", 3, &val));
+    ASSERT_INT_EQUAL("value should be copied into the arena", 42, *(int *) val);
+
+    ASSERT_INT_EQUAL("ht_delete should not return error", HT_OK, ht_delete(ht, "k42", 3));
+    ASSERT_INT_EQUAL("deleted key should not exist", HT_ENOTFOUND, ht_has(ht, "k42", 3));
+
+    ht_destroy(ht);
+    arena_destroy(arena);
+}
+
+TEST(ht_swiss_insert_delete_many) {
+    ht_config_t config = default_config;
+    config.backend = HT_BACKEND_SWISS;
+
+    ht_t *ht = ht_create(&config);
+    ASSERT_NOT_NULL("ht should not be null", ht);
+
+    char key[16];
+    for (int i = 0; i < 10000; i++) {
+        snprintf(key, sizeof(key), "k%d", i);
+        ASSERT_INT_EQUAL("ht_set should not return error", HT_OK,
+                         ht_set(ht, key, strlen(key), &i, sizeof(i)));
+    }
+    ASSERT_ULONG_EQUAL("size should equal number of inserts", 10000UL, ht_size(ht));
+
+    for (int i = 0; i < 10000; i += 2) {
+        snprintf(key, sizeof(key), "k%d", i);
+        ASSERT_INT_EQUAL("ht_delete should not return error", HT_OK,
+                         ht_delete(ht, key, strlen(key)));
+    }
+
+    for (int i = 0; i < 10000; i++) {
+        snprintf(key, sizeof(key), "k%d", i);
+        void *val = NULL;
+        if (i % 2 == 0) {
+            ASSERT_INT_EQUAL("deleted key should not exist", HT_ENOTFOUND,
+                             ht_get(ht, key, strlen(key), &val));
+        } else {
+            ASSERT_INT_EQUAL("kept key should be found", HT_OK,
+                             ht_get(ht, key, strlen(key), &val));
+            ASSERT_INT_EQUAL("kept key should keep its value", i, *(int *) val);
+        }
+    }
+
+    ht_iter_t hi = ht_iter_begin(ht);
+    int count = 0;
+    while (ht_iter_next(&hi, NULL, NULL, NULL))
+        count++;
+    ASSERT_INT_EQUAL("iterator should visit all elements", 5000, count);
+
+    ht_clear(ht);
+    ASSERT_ULONG_EQUAL("size should be 0", 0UL, ht_size(ht));
+    ASSERT_INT_EQUAL("cleared key should not exist", HT_ENOTFOUND, ht_has(ht, "k1", 2));
+
+    ht_destroy(ht);
+}
+
+/* every key lands in the same group with the same control byte, so lookups have to probe on
+ * and fall back to equals */
+static uint64_t colliding_hash(const void *key, size_t len, uint64_t seed) {
+    (void) key;
+    (void) len;
+    (void) seed;
+    return 42;
+}
+
+/* the same control byte but a different full hash for every key */
+static uint64_t tag_colliding_hash(const void *key, size_t len, uint64_t seed) {
+    return fnv1a64(key, len, seed) << 7 | 42;
+}
+
+TEST(ht_swiss_colliding_hashes) {
+    uint64_t (*hashes[])(const void *, size_t, uint64_t) = {colliding_hash, tag_colliding_hash};
+
+    for (int h = 0; h < 2; h++) {
+        ht_config_t config = default_config;
+        config.backend = HT_BACKEND_SWISS;
+        config.hash = hashes[h];
+
+        ht_t *ht = ht_create(&config);
+        ASSERT_NOT_NULL("ht should not be null", ht);
+
+        char key[16];
+        for (int i = 0; i < 100; i++) {
+            snprintf(key, sizeof(key), "k%d", i);
+            ASSERT_INT_EQUAL("ht_set should not return error", HT_OK,
+                             ht_set(ht, key, strlen(key), &i, sizeof(i)));
+        }
+        for (int i = 0; i < 100; i += 3) {
+            snprintf(key, sizeof(key), "k%d", i);
+            ht_delete(ht, key, strlen(key));
+        }
+
+        for (int i = 0; i < 100; i++) {
+            snprintf(key, sizeof(key), "k%d", i);
+            void *val = NULL;
+            ht_err_t err = ht_get(ht, key, strlen(key), &val);
+            ASSERT_INT_EQUAL("only deleted keys should be missing",
+                             i % 3 == 0 ? HT_ENOTFOUND : HT_OK, err);
+            if (err == HT_OK) ASSERT_INT_EQUAL("key should keep its value", i, *(int *) val);
+        }
+
+        ht_destroy(ht);
+    }
+}
+
+TEST(ht_swiss_reuses_deleted_slots) {
+    ht_config_t config = default_config;
+    config.backend = HT_BACKEND_SWISS;
+
+    ht_t *ht = ht_create(&config);
+    ASSERT_NOT_NULL("ht should not be null", ht);
+
+    char key[16];
+    for (int i = 0; i < 8; i++) {
+        snprintf(key, sizeof(key), "k%d", i);
+        ht_set(ht, key, strlen(key), "val", 3);
+    }
+    size_t capacity = ht_capacity(ht);
+
+    /* churning through keys must not grow a table whose size stays the same */
+    for (int i = 8; i < 100000; i++) {
+        snprintf(key, sizeof(key), "k%d", i - 8);
+        ASSERT_INT_EQUAL("ht_delete should not return error", HT_OK,
+                         ht_delete(ht, key, strlen(key)));
+        snprintf(key, sizeof(key), "k%d", i);
+        ASSERT_INT_EQUAL("ht_set should not return error", HT_OK,
+                         ht_set(ht, key, strlen(key), "val", 3));
+    }
+
+    ASSERT_ULONG_EQUAL("size should stay the same", 8UL, ht_size(ht));
+    ASSERT_ULONG_EQUAL("capacity should stay the same", capacity, ht_capacity(ht));
+    ht_destroy(ht);
+}
+
+TEST(ht_incremental_resize_keeps_entries_reachable) {
+    ht_backend_t backends[] = {HT_BACKEND_CHAINED, HT_BACKEND_SWISS};
+
+    for (int b = 0; b < 2; b++) {
+        ht_config_t config = default_config;
+        config.backend = backends[b];
+        config.incremental_resize = 1;
+
+        ht_t *ht = ht_create(&config);
+        ASSERT_NOT_NULL("ht should not be null", ht);
+
+        /* checking every key now and then catches resizes half way through */
+        char key[16];
+        for (int i = 0; i < 5000; i++) {
+            snprintf(key, sizeof(key), "k%d", i);
+            ASSERT_INT_EQUAL("ht_set should not return error", HT_OK,
+                             ht_set(ht, key, strlen(key), &i, sizeof(i)));
+
+            if (i % 251 != 0) continue;
+            for (int j = 0; j <= i; j++) {
+                snprintf(key, sizeof(key), "k%d", j);
+                ASSERT_INT_EQUAL("every key should stay reachable", HT_OK,
+                                 ht_has(ht, key, strlen(key)));
+            }
+
+            ht_iter_t hi = ht_iter_begin(ht);
+            int count = 0;
+            while (ht_iter_next(&hi, NULL, NULL, NULL))
+                count++;
+            ASSERT_INT_EQUAL("iterator should visit every key once", i + 1, count);
+        }
+
+        for (int i = 0; i < 5000; i += 3) {
+            snprintf(key, sizeof(key), "k%d", i);
+            ASSERT_INT_EQUAL("ht_delete should not return error", HT_OK,
+                             ht_delete(ht, key, strlen(key)));
+        }
+        for (int i = 0; i < 5000; i++) {
+            snprintf(key, sizeof(key), "k%d", i);
+            void *val = NULL;
+            ht_err_t err = ht_get(ht, key, strlen(key), &val);
+            ASSERT_INT_EQUAL("only deleted keys should be missing",
+                             i % 3 == 0 ? HT_ENOTFOUND : HT_OK, err);
+            if (err == HT_OK) ASSERT_INT_EQUAL("key should keep its value", i, *(int *) val);
+        }
+        ASSERT_ULONG_EQUAL("size should count the remaining keys", 3333UL, ht_size(ht));
+
+        ht_destroy(ht);
+    }
+}
+
+static int dup_calls, free_calls;
+
+static void *counting_dup(const void *src, size_t size) {
+    dup_calls++;
+    return dup_mem(src, size);
+}
+
+static void counting_free(void *ptr) {
+    free_calls++;
+    free_mem(ptr);
+}
+
+TEST(ht_inline_small_keys_and_values) {
+    ht_backend_t backends[] = {HT_BACKEND_CHAINED, HT_BACKEND_SWISS};
+
+    for (int b = 0; b < 2; b++) {
+        ht_config_t config = default_config;
+        config.dup_key = counting_dup;
+        config.dup_val = counting_dup;
+        config.free_key = counting_free;
+        config.free_val = counting_free;
+        config.backend = backends[b];
+        config.incremental_resize = 1;
+        config.inline_small = 1;
+        dup_calls = free_calls = 0;
+
+        ht_t *ht = ht_create(&config);
+        ASSERT_NOT_NULL("ht should not be null", ht);
+
+        for (uint64_t id = 0; id < 2000; id++) {
+            uint64_t val = id * 3;
+            ASSERT_INT_EQUAL("ht_set should not return error", HT_OK,
+                             ht_set(ht, &id, sizeof(id), &val, sizeof(val)));
+        }
+        ASSERT_INT_EQUAL("small keys and values should not be copied out", 0, dup_calls);
+
+        for (uint64_t id = 0; id < 2000; id++) {
+            void *val = NULL;
+            ASSERT_INT_EQUAL("ht_get should find the key", HT_OK,
+                             ht_get(ht, &id, sizeof(id), &val));
+            ASSERT_ULONG_EQUAL("inline value should survive resizes", (unsigned long) id * 3,
+                               (unsigned long) *(uint64_t *) val);
+        }
+
+        char large[HT_INLINE_SIZE + 1];
+        memset(large, 'x', sizeof(large));
+        uint64_t id = 7;
+        ASSERT_INT_EQUAL("ht_set should not return error", HT_OK,
+                         ht_set(ht, &id, sizeof(id), large, sizeof(large)));
+        ASSERT_INT_EQUAL("a large value should be copied out", 1, dup_calls);
+        ASSERT_INT_EQUAL("ht_set should not return error", HT_OK,
+                         ht_set(ht, large, sizeof(large), "v", 1));
+        ASSERT_INT_EQUAL("a large key should be copied out", 2, dup_calls);
+
+        void *val = NULL;
+        ASSERT_INT_EQUAL("ht_get should find the key", HT_OK, ht_get(ht, &id, sizeof(id), &val));
+        ASSERT_MEM_EQUAL("large value should match", large, val, sizeof(large));
+
+        int seen = 0;
+        ht_iter_t hi = ht_iter_begin(ht);
+        void *key;
+        size_t key_len;
+        while (ht_iter_next(&hi, &key, &key_len, &val)) {
+            if (key_len == sizeof(uint64_t) && *(uint64_t *) key == 1999) {
+                ASSERT_ULONG_EQUAL("iterator should see inline values", 1999UL * 3,
+                                   (unsigned long) *(uint64_t *) val);
+                seen++;
+            }
+        }
+        ASSERT_INT_EQUAL("iterator should see inline keys", 1, seen);
+
+        ASSERT_INT_EQUAL("ht_set should not return error", HT_OK,
+                         ht_set(ht, &id, sizeof(id), "small", 5));
+        ASSERT_INT_EQUAL("replacing a large value should free it", 1, free_calls);
+
+        /* a NULL value has nothing to keep inline, so it must not claim a length */
+        ASSERT_INT_EQUAL("a NULL value with a length should be refused", HT_ERR,
+                         ht_set(ht, &id, sizeof(id), NULL, 4));
+        ASSERT_INT_EQUAL("a NULL value with a length should be refused", HT_ERR,
+                         ht_get_or_insert(ht, "new", 3, NULL, 4, &val, NULL));
+        ASSERT_INT_EQUAL("a refused value should leave the old one", HT_OK,
+                         ht_get(ht, &id, sizeof(id), &val));
+        ASSERT_STR_EQUAL("a refused value should leave the old one", "small", (char *) val, 5);
+
+        ht_destroy(ht);
+        ASSERT_INT_EQUAL("destroy should free only what was copied out", dup_calls, free_calls);
+    }
+}
+
+TEST(ht_batch_get_set_delete) {
+    ht_backend_t backends[] = {HT_BACKEND_CHAINED, HT_BACKEND_SWISS};
+    enum { COUNT = 1000 };
+    static char names[2 * COUNT][16];
+    static const void *keys[2 * COUNT];
+    static size_t key_lens[2 * COUNT];
+    static int nums[COUNT];
+    static const void *vals[COUNT];
+    static size_t val_lens[COUNT];
+    static void *out[2 * COUNT];
+    static ht_err_t errs[2 * COUNT];
+
+    for (int i = 0; i < 2 * COUNT; i++) {
+        snprintf(names[i], sizeof(names[i]), "k%d", i);
+        keys[i] = names[i];
+        key_lens[i] = strlen(names[i]);
+    }
+    for (int i = 0; i < COUNT; i++) {
+        nums[i] = i;
+        vals[i] = &nums[i];
+        val_lens[i] = sizeof(int);
+    }
+
+    for (int b = 0; b < 2; b++) {
+        ht_config_t config = default_config;
+        config.backend = backends[b];
+        ht_t *ht = ht_create(&config);
+        ASSERT_NOT_NULL("ht should not be null", ht);
+
+        ASSERT_INT_EQUAL("ht_set_many should not return error", HT_OK,
+                         ht_set_many(ht, COUNT, keys, key_lens, vals, val_lens));
+        ASSERT_ULONG_EQUAL("size should count every key", (unsigned long) COUNT, ht_size(ht));
+
+        /* the second half of the keys was never set */
+        ASSERT_INT_EQUAL("ht_get_many should report missing keys", HT_ENOTFOUND,
+                         ht_get_many(ht, 2 * COUNT, keys, key_lens, out, errs));
+        for (int i = 0; i < 2 * COUNT; i++) {
+            if (i < COUNT) {
+                ASSERT_INT_EQUAL("set keys should be found", HT_OK, errs[i]);
+                ASSERT_INT_EQUAL("key should have its value", i, *(int *) out[i]);
+            } else {
+                ASSERT_INT_EQUAL("missing keys should not be found", HT_ENOTFOUND, errs[i]);
+                ASSERT_NULL("missing keys should have no value", out[i]);
+            }
+        }
+
+        ASSERT_INT_EQUAL("ht_delete_many should report missing keys", HT_ENOTFOUND,
+                         ht_delete_many(ht, COUNT + 1, keys + COUNT / 2, key_lens + COUNT / 2,
+                                        errs));
+        ASSERT_INT_EQUAL("the last key was never set", HT_ENOTFOUND, errs[COUNT]);
+        ASSERT_ULONG_EQUAL("size should count the remaining keys", (unsigned long) COUNT / 2,
+                           ht_size(ht));
+        ASSERT_INT_EQUAL("remaining keys should all be found", HT_OK,
+                         ht_get_many(ht, COUNT / 2, keys, key_lens, out, NULL));
+
+        ASSERT_INT_EQUAL("a NULL key should be rejected", HT_ERR,
+                         ht_get_many(ht, 1, (const void *[]) {NULL}, key_lens, out, NULL));
+        ASSERT_INT_EQUAL("an empty batch should succeed", HT_OK,
+                         ht_set_many(ht, 0, NULL, NULL, NULL, NULL));
+
+        ht_destroy(ht);
+    }
+}
+
+TEST(ht_reserve_avoids_resizes) {
+    ht_backend_t backends[] = {HT_BACKEND_CHAINED, HT_BACKEND_SWISS};
+
+    for (int b = 0; b < 2; b++) {
+        ht_config_t config = default_config;
+        config.backend = backends[b];
+        ht_t *ht = ht_create(&config);
+        ASSERT_NOT_NULL("ht should not be null", ht);
+
+        ASSERT_INT_EQUAL("ht_reserve should not return error", HT_OK, ht_reserve(ht, 10000));
+        size_t capacity = ht_capacity(ht);
+        ASSERT_TRUE("capacity should hold the reserved entries", capacity * 0.75 >= 10000);
+
+        char key[16];
+        for (int i = 0; i < 10000; i++) {
+            snprintf(key, sizeof(key), "k%d", i);
+            ht_set(ht, key, strlen(key), &i, sizeof(i));
+        }
+        ASSERT_ULONG_EQUAL("filling the reserved room should not resize", capacity,
+                           ht_capacity(ht));
+
+        for (int i = 0; i < 10000; i++) {
+            snprintf(key, sizeof(key), "k%d", i);
+            ht_delete(ht, key, strlen(key));
+        }
+        ASSERT_ULONG_EQUAL("a reserved table should not shrink", capacity, ht_capacity(ht));
+
+        ASSERT_INT_EQUAL("ht_shrink_to_fit should not return error", HT_OK, ht_shrink_to_fit(ht));
+        ASSERT_TRUE("ht_shrink_to_fit should undo the reservation", ht_capacity(ht) <= 16);
+        ASSERT_INT_EQUAL("an impossible reservation should fail", HT_ENONEM,
+                         ht_reserve(ht, SIZE_MAX));
+
+        ht_destroy(ht);
+    }
+}
+
+/* every key holds two blocks, which keeps the table well inside the live blocks ALLOC_DEBUG
+ * can give a mapping of their own */
+#define SHRINK_KEYS 5000
+
+TEST(ht_shrinks_after_deletes) {
+    ht_backend_t backends[] = {HT_BACKEND_CHAINED, HT_BACKEND_SWISS};
+
+    for (int b = 0; b < 4; b++) {
+        ht_config_t config = default_config;
+        config.backend = backends[b % 2];
+        config.incremental_resize = b / 2;
+        ht_t *ht = ht_create(&config);
+        ASSERT_NOT_NULL("ht should not be null", ht);
+
+        char key[16];
+        for (int i = 0; i < SHRINK_KEYS; i++) {
+            snprintf(key, sizeof(key), "k%d", i);
+            ASSERT_INT_EQUAL("ht_set should not return error", HT_OK,
+                             ht_set(ht, key, strlen(key), &i, sizeof(i)));
+        }
+        size_t peak = ht_capacity(ht);
+
+        for (int i = 0; i < SHRINK_KEYS; i++) {
+            if (i % 100 == 0) continue;
+            snprintf(key, sizeof(key), "k%d", i);
+            ASSERT_INT_EQUAL("ht_delete should not return error", HT_OK,
+                             ht_delete(ht, key, strlen(key)));
+        }
+        ASSERT_TRUE("capacity should shrink with the load", ht_capacity(ht) <= peak / 16);
+
+        for (int i = 0; i < SHRINK_KEYS; i += 100) {
+            snprintf(key, sizeof(key), "k%d", i);
+            void *val = NULL;
+            ASSERT_INT_EQUAL("remaining keys should survive the shrink", HT_OK,
+                             ht_get(ht, key, strlen(key), &val));
+            ASSERT_INT_EQUAL("key should keep its value", i, *(int *) val);
+        }
+
+        /* shrinking stops short of where the next inserts would grow the table right away */
+        size_t capacity = ht_capacity(ht);
+        for (int i = 1; i < SHRINK_KEYS / 100; i++) {
+            snprintf(key, sizeof(key), "k%d", i);
+            ASSERT_INT_EQUAL("ht_set should not return error", HT_OK,
+                             ht_set(ht, key, strlen(key), &i, sizeof(i)));
+        }
+        ASSERT_ULONG_EQUAL("re-adding as many keys should not grow the table", capacity,
+                           ht_capacity(ht));
+
+        ht_destroy(ht);
+    }
+}
+
+TEST(ht_shrinking_can_be_turned_off) {
+    ht_config_t config = default_config;
+    config.min_load_factor = -1;
+    ht_t *ht = ht_create(&config);
+    ASSERT_NOT_NULL("ht should not be null", ht);
+
+    char key[16];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "k%d", i);
+        ht_set(ht, key, strlen(key), &i, sizeof(i));
+    }
+    size_t peak = ht_capacity(ht);
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "k%d", i);
+        ht_delete(ht, key, strlen(key));
+    }
+    ASSERT_ULONG_EQUAL("capacity should stay at its peak", peak, ht_capacity(ht));
+
+    ASSERT_INT_EQUAL("ht_shrink_to_fit should not return error", HT_OK, ht_shrink_to_fit(ht));
+    ASSERT_ULONG_EQUAL("ht_shrink_to_fit should go back to the initial capacity", 16UL,
+                       ht_capacity(ht));
+    ht_destroy(ht);
+}
+
+TEST(ht_clear_keeps_capacity) {
+    ht_backend_t backends[] = {HT_BACKEND_CHAINED, HT_BACKEND_SWISS};
+
+    for (int b = 0; b < 2; b++) {
+        ht_config_t config = default_config;
+        config.backend = backends[b];
+        ht_t *ht = ht_create(&config);
+        ASSERT_NOT_NULL("ht should not be null", ht);
+
+        char key[16];
+        for (int round = 0; round < 2; round++) {
+            for (int i = 0; i < 1000; i++) {
+                snprintf(key, sizeof(key), "k%d", i);
+                ht_set(ht, key, strlen(key), &i, sizeof(i));
+            }
+            size_t capacity = ht_capacity(ht);
+
+            ht_clear(ht);
+            ASSERT_ULONG_EQUAL("size should be 0", 0UL, ht_size(ht));
+            ASSERT_ULONG_EQUAL("ht_clear should keep the capacity", capacity, ht_capacity(ht));
+            ASSERT_INT_EQUAL("cleared keys should be gone", HT_ENOTFOUND, ht_has(ht, "k1", 2));
+        }
+        ht_destroy(ht);
+    }
+}
+
+static void add_to_count(void *val, size_t val_len, void *ctx) {
+    if (val_len == sizeof(int)) *(int *) val += *(int *) ctx;
+}
+
+static int count_below(const void *val, size_t val_len, void *ctx) {
+    return val_len == sizeof(int) && *(const int *) val < *(int *) ctx;
+}
+
+TEST(ht_get_or_insert_counts_in_place) {
+    const char *words[] = {"a", "b", "a", "c", "a", "b"};
+
+    for (int b = 0; b < 4; b++) {
+        ht_config_t config = default_config;
+        config.backend = b % 2 ? HT_BACKEND_SWISS : HT_BACKEND_CHAINED;
+        config.inline_small = b / 2;
+        ht_t *ht = ht_create(&config);
+        ASSERT_NOT_NULL("ht should not be null", ht);
+
+        int added = 0;
+        for (int i = 0; i < 6; i++) {
+            int zero = 0, inserted = -1;
+            void *val = NULL;
+            ASSERT_INT_EQUAL("ht_get_or_insert should not return error", HT_OK,
+                             ht_get_or_insert(ht, words[i], 1, &zero, sizeof(zero), &val,
+                                              &inserted));
+            ASSERT_NOT_NULL("value should be returned", val);
+            added += inserted;
+            (*(int *) val)++;
+        }
+        ASSERT_INT_EQUAL("each word should be inserted once", 3, added);
+        ASSERT_ULONG_EQUAL("size should count distinct words", 3UL, ht_size(ht));
+
+        void *val = NULL;
+        ht_get(ht, "a", 1, &val);
+        ASSERT_INT_EQUAL("a should be counted three times", 3, *(int *) val);
+        ht_get(ht, "b", 1, &val);
+        ASSERT_INT_EQUAL("b should be counted twice", 2, *(int *) val);
+
+        int ten = 10;
+        ASSERT_INT_EQUAL("ht_update should not return error", HT_OK,
+                         ht_update(ht, "c", 1, add_to_count, &ten));
+        ht_get(ht, "c", 1, &val);
+        ASSERT_INT_EQUAL("update should change the value in place", 11, *(int *) val);
+        ASSERT_INT_EQUAL("updating a missing key should fail", HT_ENOTFOUND,
+                         ht_update(ht, "d", 1, add_to_count, &ten));
+
+        ht_destroy(ht);
+    }
+}
+
+TEST(ht_compare_and_set_and_remove_if) {
+    for (int b = 0; b < 2; b++) {
+        ht_config_t config = default_config;
+        config.backend = b ? HT_BACKEND_SWISS : HT_BACKEND_CHAINED;
+        ht_t *ht = ht_create(&config);
+        ASSERT_NOT_NULL("ht should not be null", ht);
+
+        ht_set(ht, "state", 5, "idle", 4);
+        ASSERT_INT_EQUAL("a stale expected value should not match", HT_EMISMATCH,
+                         ht_compare_and_set(ht, "state", 5, "busy", 4, "done", 4));
+        ASSERT_INT_EQUAL("a shorter expected value should not match", HT_EMISMATCH,
+                         ht_compare_and_set(ht, "state", 5, "idl", 3, "done", 4));
+        ASSERT_INT_EQUAL("the current value should match", HT_OK,
+                         ht_compare_and_set(ht, "state", 5, "idle", 4, "running", 7));
+
+        void *val = NULL;
+        ht_get(ht, "state", 5, &val);
+        ASSERT_STR_EQUAL("value should be swapped", "running", (char *) val, 7);
+        ASSERT_INT_EQUAL("a missing key should not be set", HT_ENOTFOUND,
+                         ht_compare_and_set(ht, "other", 5, "idle", 4, "done", 4));
+
+        int one = 1, five = 5, limit = 3;
+        ht_set(ht, "low", 3, &one, sizeof(one));
+        ht_set(ht, "high", 4, &five, sizeof(five));
+        ASSERT_INT_EQUAL("a value that fails the predicate should stay", HT_EMISMATCH,
+                         ht_remove_if(ht, "high", 4, count_below, &limit));
+        ASSERT_INT_EQUAL("a value that passes the predicate should go", HT_OK,
+                         ht_remove_if(ht, "low", 3, count_below, &limit));
+        ASSERT_INT_EQUAL("removed key should be gone", HT_ENOTFOUND, ht_has(ht, "low", 3));
+        ASSERT_INT_EQUAL("kept key should stay", HT_OK, ht_has(ht, "high", 4));
+        ASSERT_INT_EQUAL("a missing key should not be removed", HT_ENOTFOUND,
+                         ht_remove_if(ht, "low", 3, count_below, &limit));
+        ASSERT_ULONG_EQUAL("size should count the remaining keys", 2UL, ht_size(ht));
+
+        ht_destroy(ht);
+    }
+}
+
+static int hash_calls;
+
+static uint64_t counting_hash(const void *key, size_t len, uint64_t seed) {
+    hash_calls++;
+    return fnv1a64(key, len, seed);
+}
+
+TEST(ht_hashed_variants_skip_hashing) {
+    for (int b = 0; b < 2; b++) {
+        ht_config_t config = default_config;
+        config.hash = counting_hash;
+        config.backend = b ? HT_BACKEND_SWISS : HT_BACKEND_CHAINED;
+        ht_t *ht = ht_create(&config);
+        ASSERT_NOT_NULL("ht should not be null", ht);
+
+        uint64_t hash = ht_hash(ht, "name", 4);
+        ASSERT_TRUE("ht_hash should use the table's seed",
+                    hash == fnv1a64("name", 4, default_config.seed));
+        hash_calls = 0;
+
+        int one = 1, two = 2, inserted = 0;
+        void *val = NULL;
+        ASSERT_INT_EQUAL("ht_set_hashed should not return error", HT_OK,
+                         ht_set_hashed(ht, "name", 4, hash, &one, sizeof(one)));
+        ASSERT_INT_EQUAL("ht_has_hashed should find the key", HT_OK,
+                         ht_has_hashed(ht, "name", 4, hash));
+        ASSERT_INT_EQUAL("ht_get_or_insert_hashed should find the key", HT_OK,
+                         ht_get_or_insert_hashed(ht, "name", 4, hash, &two, sizeof(two), &val,
+                                                 &inserted));
+        ASSERT_INT_EQUAL("the key should not be inserted again", 0, inserted);
+        ASSERT_INT_EQUAL("ht_compare_and_set_hashed should swap the value", HT_OK,
+                         ht_compare_and_set_hashed(ht, "name", 4, hash, &one, sizeof(one), &two,
+                                                   sizeof(two)));
+        ASSERT_INT_EQUAL("ht_get_hashed should find the key", HT_OK,
+                         ht_get_hashed(ht, "name", 4, hash, &val));
+        ASSERT_INT_EQUAL("value should be swapped", 2, *(int *) val);
+        ASSERT_INT_EQUAL("ht_delete_hashed should delete the key", HT_OK,
+                         ht_delete_hashed(ht, "name", 4, hash));
+        ASSERT_INT_EQUAL("no operation should hash the key", 0, hash_calls);
+
+        ASSERT_INT_EQUAL("deleted key should not exist", HT_ENOTFOUND, ht_has(ht, "name", 4));
+
+        const void *keys[] = {"a", "b", "c"};
+        size_t lens[] = {1, 1, 1};
+        uint64_t hashes[3];
+        void *vals[3];
+        for (int i = 0; i < 3; i++)
+            hashes[i] = ht_hash(ht, keys[i], lens[i]);
+        hash_calls = 0;
+
+        ASSERT_INT_EQUAL("ht_set_many_hashed should not return error", HT_OK,
+                         ht_set_many_hashed(ht, 3, keys, lens, hashes, keys, lens));
+        ASSERT_INT_EQUAL("ht_get_many_hashed should find every key", HT_OK,
+                         ht_get_many_hashed(ht, 3, keys, lens, hashes, vals, NULL));
+        ASSERT_STR_EQUAL("values should match", "b", (char *) vals[1], 1);
+        ASSERT_INT_EQUAL("ht_delete_many_hashed should delete every key", HT_OK,
+                         ht_delete_many_hashed(ht, 3, keys, lens, hashes, NULL));
+        ASSERT_INT_EQUAL("no batch operation should hash the keys", 0, hash_calls);
+        ASSERT_ULONG_EQUAL("size should be 0", 0UL, ht_size(ht));
+
+        ht_destroy(ht);
+    }
+}
+
+static uint64_t fake_now;
+
+static uint64_t fake_clock(void) {
+    return fake_now;
+}
+
+static ht_config_t ttl_config(ht_backend_t backend) {
+    ht_config_t config = default_config;
+    config.dup_key = counting_dup;
+    config.dup_val = counting_dup;
+    config.free_key = counting_free;
+    config.free_val = counting_free;
+    config.backend = backend;
+    config.clock = fake_clock;
+    dup_calls = free_calls = 0;
+    fake_now = 1000;
+    return config;
+}
+
+TEST(ht_ttl_expires_lazily) {
+    for (int b = 0; b < 2; b++) {
+        ht_config_t config = ttl_config(b ? HT_BACKEND_SWISS : HT_BACKEND_CHAINED);
+        ht_t *ht = ht_create(&config);
+        ASSERT_NOT_NULL("ht should not be null", ht);
+
+        ASSERT_INT_EQUAL("ht_set_ttl should not return error", HT_OK,
+                         ht_set_ttl(ht, "session", 7, "abc", 3, 10));
+        ht_set(ht, "user", 4, "hisyam", 6);
+
+        uint64_t ttl = 0;
+        ASSERT_INT_EQUAL("ht_ttl should find the key", HT_OK, ht_ttl(ht, "session", 7, &ttl));
+        ASSERT_ULONG_EQUAL("ttl should count down from the one given", 10UL, (unsigned long) ttl);
+        ASSERT_INT_EQUAL("ht_ttl should find the key", HT_OK, ht_ttl(ht, "user", 4, &ttl));
+        ASSERT_TRUE("a key without a ttl should not expire", ttl == HT_NO_EXPIRY);
+
+        fake_now += 9;
+        void *val = NULL;
+        ASSERT_INT_EQUAL("key should live until its deadline", HT_OK,
+                         ht_get(ht, "session", 7, &val));
+
+        fake_now += 1;
+        int iterated = 0;
+        ht_iter_t hi = ht_iter_begin(ht);
+        while (ht_iter_next(&hi, NULL, NULL, NULL))
+            iterated++;
+        ASSERT_INT_EQUAL("iterator should skip expired keys", 1, iterated);
+        ASSERT_ULONG_EQUAL("expired key should be counted until deleted", 2UL, ht_size(ht));
+
+        ASSERT_INT_EQUAL("expired key should be missing", HT_ENOTFOUND,
+                         ht_get(ht, "session", 7, &val));
+        ASSERT_ULONG_EQUAL("lookup should delete the expired key", 1UL, ht_size(ht));
+        ASSERT_INT_EQUAL("expired key and value should be freed", 2, free_calls);
+
+        ht_set_ttl(ht, "token", 5, "x", 1, 5);
+        ASSERT_INT_EQUAL("ht_persist should find the key", HT_OK, ht_persist(ht, "token", 5));
+        ht_set_ttl(ht, "nonce", 5, "y", 1, 5);
+        ht_set(ht, "nonce", 5, "z", 1);
+        ASSERT_INT_EQUAL("ht_expire should find the key", HT_OK, ht_expire(ht, "user", 4, 5));
+        fake_now += 100;
+
+        ASSERT_INT_EQUAL("a persisted key should not expire", HT_OK, ht_has(ht, "token", 5));
+        ASSERT_INT_EQUAL("ht_set should drop the ttl", HT_OK, ht_has(ht, "nonce", 5));
+        ASSERT_INT_EQUAL("a key given a ttl later should expire", HT_ENOTFOUND,
+                         ht_has(ht, "user", 4));
+        ASSERT_INT_EQUAL("an expired key cannot be given a ttl", HT_ENOTFOUND,
+                         ht_expire(ht, "user", 4, 5));
+
+        ht_destroy(ht);
+        ASSERT_INT_EQUAL("every copy should be freed once", dup_calls, free_calls);
+    }
+}
+
+static uint64_t fake_step;
+
+/* moves on by fake_step every time it is read */
+static uint64_t stepping_clock(void) {
+    uint64_t now = fake_now;
+    fake_now += fake_step;
+    return now;
+}
+
+TEST(ht_ttl_reads_the_clock_once) {
+    for (int b = 0; b < 2; b++) {
+        ht_config_t config = ttl_config(b ? HT_BACKEND_SWISS : HT_BACKEND_CHAINED);
+        config.clock = stepping_clock;
+        fake_step = 0;
+        ht_t *ht = ht_create(&config);
+        ASSERT_NOT_NULL("ht should not be null", ht);
+
+        ASSERT_INT_EQUAL("ht_set_ttl should not return error", HT_OK,
+                         ht_set_ttl(ht, "session", 7, "abc", 3, 10));
+
+        /* live at the first reading, past the deadline at any later one */
+        fake_now += 9;
+        fake_step = 5;
+        uint64_t ttl = 0;
+        ASSERT_INT_EQUAL("ht_ttl should find the key", HT_OK, ht_ttl(ht, "session", 7, &ttl));
+        ASSERT_ULONG_EQUAL("ttl should be what was left at the reading that found the key", 1UL,
+                           (unsigned long) ttl);
+
+        fake_step = 0;
+        ht_destroy(ht);
+    }
+}
+
+TEST(ht_expire_step_does_bounded_work) {
+    for (int b = 0; b < 4; b++) {
+        ht_config_t config = ttl_config(b % 2 ? HT_BACKEND_SWISS : HT_BACKEND_CHAINED);
+        config.incremental_resize = b / 2;
+        ht_t *ht = ht_create(&config);
+        ASSERT_NOT_NULL("ht should not be null", ht);
+
+        char key[16];
+        for (int i = 1; i <= 1000; i++) {
+            snprintf(key, sizeof(key), "k%d", i);
+            ASSERT_INT_EQUAL("ht_set_ttl should not return error", HT_OK,
+                             ht_set_ttl(ht, key, strlen(key), &i, sizeof(i), (uint64_t) i));
+        }
+        for (int i = 1; i <= 2000; i++) {
+            snprintf(key, sizeof(key), "p%d", i);
+            ht_set(ht, key, strlen(key), &i, sizeof(i));
+        }
+
+        /* keys that were deleted or given a later deadline leave stale deadlines behind */
+        for (int i = 1; i <= 100; i++) {
+            snprintf(key, sizeof(key), "k%d", i);
+            ht_delete(ht, key, strlen(key));
+            snprintf(key, sizeof(key), "k%d", i + 100);
+            ht_expire(ht, key, strlen(key), 5000);
+        }
+
+        ASSERT_ULONG_EQUAL("nothing should expire before its deadline", 0UL,
+                           ht_expire_step(ht, SIZE_MAX));
+
+        /* the first 100 deadlines are those of deleted keys and the next 100 have been replaced,
+         * leaving 300 keys to delete with the 300 deadlines after them */
+        fake_now += 500;
+        ASSERT_ULONG_EQUAL("stale deadlines should use up the budget", 0UL,
+                           ht_expire_step(ht, 200));
+        for (int i = 0; i < 6; i++)
+            ASSERT_TRUE("one call should not go past its budget", ht_expire_step(ht, 50) <= 50);
+
+        /* k201 to k500 had their deadlines pass */
+        ASSERT_ULONG_EQUAL("every expired key should be deleted", 3000UL - 100 - 300,
+                           ht_size(ht));
+        ASSERT_INT_EQUAL("a key given a later deadline should survive", HT_OK,
+                         ht_has(ht, "k150", 4));
+        ASSERT_INT_EQUAL("a key with a later deadline should survive", HT_OK,
+                         ht_has(ht, "k501", 4));
+
+        fake_now += 10000;
+        ht_expire_step(ht, SIZE_MAX);
+        ASSERT_ULONG_EQUAL("only keys without a ttl should be left", 2000UL, ht_size(ht));
+
+        ht_destroy(ht);
+        ASSERT_INT_EQUAL("every copy should be freed once", dup_calls, free_calls);
+    }
+}
+
+static void count_eviction(const void *key, size_t key_len, void *val, size_t val_len,
+                           void *ctx) {
+    (void) key;
+    (void) val;
+
+    /* every key the tests evict is 6 bytes long with an int value */
+    if (key_len == 6 && val_len == sizeof(int)) (*(int *) ctx)++;
+}
+
+static ht_config_t cache_config(ht_backend_t backend, ht_eviction_t eviction, int *evicted) {
+    ht_config_t config = default_config;
+    config.dup_key = counting_dup;
+    config.dup_val = counting_dup;
+    config.free_key = counting_free;
+    config.free_val = counting_free;
+    config.backend = backend;
+    config.eviction = eviction;
+    config.on_evict = count_eviction;
+    config.evict_ctx = evicted;
+    dup_calls = free_calls = 0;
+    *evicted = 0;
+
+    /* every entry of the tests below is as big as this one */
+    ht_t *probe = ht_create(&config);
+    ht_set(probe, "k00000", 6, &(int) {0}, sizeof(int));
+    config.max_bytes = 100 * ht_stats(probe).bytes;
+    ht_destroy(probe);
+    dup_calls = free_calls = 0;
+    return config;
+}
+
+TEST(ht_cache_evicts_to_stay_under_max_bytes) {
+    for (int b = 0; b < 2; b++) {
+        int evicted;
+        ht_config_t config = cache_config(b ? HT_BACKEND_SWISS : HT_BACKEND_CHAINED,
+                                          HT_EVICT_LRU, &evicted);
+        ht_t *ht = ht_create(&config);
+        ASSERT_NOT_NULL("ht should not be null", ht);
+
+        char key[16];
+        for (int i = 0; i < 1000; i++) {
+            snprintf(key, sizeof(key), "k%05d", i);
+            ASSERT_INT_EQUAL("ht_set should not return error", HT_OK,
+                             ht_set(ht, key, strlen(key), &i, sizeof(i)));
+            ASSERT_TRUE("bytes should stay under max_bytes",
+                        ht_stats(ht).bytes <= config.max_bytes);
+        }
+
+        ht_stats_t stats = ht_stats(ht);
+        ASSERT_ULONG_EQUAL("a full cache should hold as many keys as fit", 100UL, ht_size(ht));
+        ASSERT_ULONG_EQUAL("every key past those should evict one", 900UL,
+                           (unsigned long) stats.evictions);
+        ASSERT_INT_EQUAL("on_evict should see every eviction", 900, evicted);
+        ASSERT_INT_EQUAL("evicted keys and values should be freed", 2 * 900, free_calls);
+        ASSERT_TRUE("the newest key should be kept", ht_has(ht, "k00999", 6) == HT_OK);
+
+        ht_stats_reset(ht);
+        void *val = NULL;
+        ht_get(ht, "k00999", 6, &val);
+        ht_get(ht, "missing", 7, &val);
+        stats = ht_stats(ht);
+        ASSERT_ULONG_EQUAL("a found key should count as a hit", 1UL, (unsigned long) stats.hits);
+        ASSERT_ULONG_EQUAL("a missing key should count as a miss", 1UL,
+                           (unsigned long) stats.misses);
+        ASSERT_ULONG_EQUAL("resetting should zero evictions", 0UL,
+                           (unsigned long) stats.evictions);
+
+        static char big[4096];
+        ASSERT_INT_EQUAL("a value that can never fit should be refused", HT_ENONEM,
+                         ht_set(ht, "huge", 4, big, config.max_bytes));
+        ASSERT_INT_EQUAL("a value that can never fit should not replace one", HT_ENONEM,
+                         ht_set(ht, "k00999", 6, big, config.max_bytes));
+
+        /* a value that grows evicts other keys, but not its own */
+        ASSERT_INT_EQUAL("ht_set should not return error", HT_OK,
+                         ht_set(ht, "k00999", 6, big, config.max_bytes / 2));
+        ASSERT_INT_EQUAL("the grown key should be kept", HT_OK, ht_has(ht, "k00999", 6));
+        ASSERT_TRUE("bytes should stay under max_bytes", ht_stats(ht).bytes <= config.max_bytes);
+        ASSERT_TRUE("others should make room for it", ht_size(ht) < 60);
+
+        ht_clear(ht);
+        ASSERT_ULONG_EQUAL("clear should release every byte", 0UL,
+                           (unsigned long) ht_stats(ht).bytes);
+
+        ht_destroy(ht);
+        ASSERT_INT_EQUAL("every copy should be freed once", dup_calls, free_calls);
+    }
+}
+
+/* hot keys are used a lot and then a scan adds a key after another, using each once: by recency
+ * the scan pushes the hot keys out, by frequency it only churns through itself */
+TEST(ht_cache_lfu_survives_scans_lru_does_not) {
+    for (int b = 0; b < 4; b++) {
+        int evicted;
+        ht_config_t config = cache_config(b % 2 ? HT_BACKEND_SWISS : HT_BACKEND_CHAINED,
+                                          b / 2 ? HT_EVICT_LFU : HT_EVICT_LRU, &evicted);
+        ht_t *ht = ht_create(&config);
+        ASSERT_NOT_NULL("ht should not be null", ht);
+
+        char key[16];
+        for (int i = 0; i < 100; i++) {
+            snprintf(key, sizeof(key), "k%05d", i);
+            ht_set(ht, key, strlen(key), &i, sizeof(i));
+        }
+        for (int round = 0; round < 1000; round++) {
+            for (int i = 0; i < 10; i++) {
+                void *val;
+                snprintf(key, sizeof(key), "k%05d", i);
+                ASSERT_INT_EQUAL("a hot key should be found", HT_OK,
+                                 ht_get(ht, key, strlen(key), &val));
+            }
+        }
+        for (int i = 100; i < 400; i++) {
+            snprintf(key, sizeof(key), "k%05d", i);
+            ht_set(ht, key, strlen(key), &i, sizeof(i));
+        }
+
+        int hot = 0;
+        for (int i = 0; i < 10; i++) {
+            snprintf(key, sizeof(key), "k%05d", i);
+            hot += ht_has(ht, key, strlen(key)) == HT_OK;
+        }
+        if (config.eviction == HT_EVICT_LFU)
+            ASSERT_INT_EQUAL("lfu should keep every hot key", 10, hot);
+        else
+            ASSERT_INT_EQUAL("lru should evict the hot keys", 0, hot);
+        ASSERT_ULONG_EQUAL("the cache should stay full", 100UL, ht_size(ht));
+
+        ht_destroy(ht);
+        ASSERT_INT_EQUAL("every copy should be freed once", dup_calls, free_calls);
+    }
+}
@@ -0,0 +1,610 @@
+#define _GNU_SOURCE
+#include "allocator.h"
+#include "bench.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define LATENCY_SAMPLES (1 << 20)
+
+/* only one call in TIMED_EVERY reads the clock, so that timing barely shows in ops/sec */
+#define TIMED_EVERY 8
+
+#define CHURN_SLOTS 8192
+#define CHURN_OPS 4000000
+#define QUEUE_SLOTS 4096
+#define QUEUE_MESSAGES 2000000
+#define DOUBLING_ROUNDS 4
+#define DOUBLING_ENTRIES (1 << 20)
+#define FRAG_ROUNDS 5
+#define FRAG_PAIRS 100000
+
+typedef struct {
+    const char *name;
+    void *(*alloc)(size_t size);
+    void *(*realloc)(void *ptr, size_t size);
+    void *(*aligned)(size_t alignment, size_t size);
+    void (*free)(void *ptr);
+} bench_allocator_t;
+
+static const bench_allocator_t allocators[] = {
+    {"alloc_mem", alloc_mem, realloc_mem, alloc_aligned_mem, free_mem},
+    {"glibc malloc", malloc, realloc, aligned_alloc, free},
+};
+
+typedef struct {
+    const bench_allocator_t *allocator;
+    bench_latency_t latency;
+    uint64_t ops;
+    uint64_t start_ns;
+    uint64_t rng;
+} bench_ctx_t;
+
+typedef struct {
+    uint64_t ops;
+    uint64_t elapsed_ns;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    size_t peak_rss_kib;
+    int failed;
+} bench_result_t;
+
+typedef int (*workload_func)(bench_ctx_t *ctx, const void *arg);
+
+static uint64_t next_random(bench_ctx_t *ctx) {
+    ctx->rng ^= ctx->rng << 13;
+    ctx->rng ^= ctx->rng >> 7;
+    ctx->rng ^= ctx->rng << 17;
+    return ctx->rng;
+}
+
+static int ctx_init(bench_ctx_t *ctx, const bench_allocator_t *allocator, uint64_t seed) {
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->allocator = allocator;
+    ctx->rng = seed | 1;
+    return bench_latency_init(&ctx->latency, LATENCY_SAMPLES);
+}
+
+/* marks the end of a workload's setup */
+static void ctx_start(bench_ctx_t *ctx) {
+    bench_rss_reset();
+    ctx->start_ns = bench_now_ns();
+}
+
+static void touch(char *p, size_t size) {
+    for (size_t i = 0; i < size; i += 4096)
+        p[i] = 1;
+    if (size > 0)
+        p[size - 1] = 1;
+}
+
+static void *timed_alloc(bench_ctx_t *ctx, size_t size) {
+    if (ctx->ops++ % TIMED_EVERY != 0)
+        return ctx->allocator->alloc(size);
+
+    uint64_t start = bench_now_ns();
+    void *p = ctx->allocator->alloc(size);
+    bench_latency_add(&ctx->latency, bench_now_ns() - start);
+    return p;
+}
+
+static void *timed_aligned(bench_ctx_t *ctx, size_t alignment, size_t size) {
+    if (ctx->ops++ % TIMED_EVERY != 0)
+        return ctx->allocator->aligned(alignment, size);
+
+    uint64_t start = bench_now_ns();
+    void *p = ctx->allocator->aligned(alignment, size);
+    bench_latency_add(&ctx->latency, bench_now_ns() - start);
+    return p;
+}
+
+static void *timed_realloc(bench_ctx_t *ctx, void *ptr, size_t size) {
+    if (ctx->ops++ % TIMED_EVERY != 0)
+        return ctx->allocator->realloc(ptr, size);
+
+    uint64_t start = bench_now_ns();
+    void *p = ctx->allocator->realloc(ptr, size);
+    bench_latency_add(&ctx->latency, bench_now_ns() - start);
+    return p;
+}
+
+static void timed_free(bench_ctx_t *ctx, void *ptr) {
+    if (ctx->ops++ % TIMED_EVERY != 0) {
+        ctx->allocator->free(ptr);
+        return;
+    }
+
+    uint64_t start = bench_now_ns();
+    ctx->allocator->free(ptr);
+    bench_latency_add(&ctx->latency, bench_now_ns() - start);
+}
+
+/* mostly small blocks, some medium ones and a few big enough to be mapped */
+static size_t churn_size(bench_ctx_t *ctx) {
+    uint64_t r = next_random(ctx);
+    uint64_t pick = r % 100;
+    r >>= 8;
+    if (pick < 80)
+        return 16 + r % 496;
+    if (pick < 95)
+        return 512 + r % 7680;
+    return 8192 + r % (256 * 1024 - 8192);
+}
+
+static int random_churn(bench_ctx_t *ctx, const void *arg) {
+    (void) arg;
+    static char *slots[CHURN_SLOTS];
+
+    ctx_start(ctx);
+    for (int i = 0; i < CHURN_OPS; i++) {
+        size_t slot = next_random(ctx) % CHURN_SLOTS;
+        if (slots[slot]) {
+            timed_free(ctx, slots[slot]);
+            slots[slot] = NULL;
+        } else {
+            size_t size = churn_size(ctx);
+            if (!(slots[slot] = timed_alloc(ctx, size)))
+                return -1;
+            touch(slots[slot], size);
+        }
+    }
+
+    for (int i = 0; i < CHURN_SLOTS; i++)
+        if (slots[i])
+            timed_free(ctx, slots[i]);
+    return 0;
+}
+
+typedef struct {
+    char *slots[QUEUE_SLOTS];
+    _Atomic size_t head;
+    _Atomic size_t tail;
+    bench_ctx_t consumer;
+} queue_t;
+
+/* frees every message on a different thread than the one that allocated it */
+static void *consume(void *arg) {
+    queue_t *queue = arg;
+    for (size_t taken = 0; taken < QUEUE_MESSAGES; taken++) {
+        size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        while (atomic_load_explicit(&queue->head, memory_order_acquire) == tail)
+            ;
+
+        char *msg = queue->slots[tail % QUEUE_SLOTS];
+        if (msg[0] != 'm')
+            abort();
+        timed_free(&queue->consumer, msg);
+        atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+static int producer_consumer(bench_ctx_t *ctx, const void *arg) {
+    (void) arg;
+    static queue_t queue;
+    if (ctx_init(&queue.consumer, ctx->allocator, 42) != 0)
+        return -1;
+
+    pthread_t consumer;
+    ctx_start(ctx);
+    if (pthread_create(&consumer, NULL, consume, &queue) != 0)
+        return -1;
+
+    for (size_t put = 0; put < QUEUE_MESSAGES; put++) {
+        size_t size = 32 + next_random(ctx) % 993;
+        char *msg = timed_alloc(ctx, size);
+        if (!msg)
+            abort();
+        memset(msg, 'm', size);
+
+        size_t head = atomic_load_explicit(&queue.head, memory_order_relaxed);
+        while (head - atomic_load_explicit(&queue.tail, memory_order_acquire) == QUEUE_SLOTS)
+            ;
+        queue.slots[head % QUEUE_SLOTS] = msg;
+        atomic_store_explicit(&queue.head, head + 1, memory_order_release);
+    }
+
+    pthread_join(consumer, NULL);
+    ctx->ops += queue.consumer.ops;
+    bench_latency_merge(&ctx->latency, &queue.consumer.latency);
+    bench_latency_destroy(&queue.consumer.latency);
+    return 0;
+}
+
+/* a hash table that doubles its bucket array once it is three quarters full, allocating an
+ * entry per insert */
+static int doubling(bench_ctx_t *ctx, const void *arg) {
+    (void) arg;
+    static char *entries[DOUBLING_ENTRIES];
+
+    ctx_start(ctx);
+    for (int round = 0; round < DOUBLING_ROUNDS; round++) {
+        size_t capacity = 16;
+        char **table = timed_alloc(ctx, capacity * sizeof(char *));
+        if (!table)
+            return -1;
+
+        for (size_t n = 0; n < DOUBLING_ENTRIES; n++) {
+            if (!(entries[n] = timed_alloc(ctx, 48)))
+                return -1;
+            memset(entries[n], 'e', 48);
+
+            if ((n + 1) * 4 > capacity * 3) {
+                char **grown = timed_alloc(ctx, capacity * 2 * sizeof(char *));
+                if (!grown)
+                    return -1;
+                memcpy(grown, table, capacity * sizeof(char *));
+                memset(grown + capacity, 0, capacity * sizeof(char *));
+                timed_free(ctx, table);
+                table = grown;
+                capacity *= 2;
+            }
+            table[n % capacity] = entries[n];
+        }
+
+        for (size_t n = 0; n < DOUBLING_ENTRIES; n++)
+            timed_free(ctx, entries[n]);
+        timed_free(ctx, table);
+    }
+    return 0;
+}
+
+/* small blocks pinned between freed larger ones leave holes that the next, slightly bigger
+ * requests cannot use */
+static int fragmentation(bench_ctx_t *ctx, const void *arg) {
+    (void) arg;
+    static char *small[FRAG_PAIRS], *large[FRAG_PAIRS];
+
+    ctx_start(ctx);
+    for (int round = 0; round < FRAG_ROUNDS; round++) {
+        for (int i = 0; i < FRAG_PAIRS; i++) {
+            small[i] = timed_alloc(ctx, 64);
+            large[i] = timed_alloc(ctx, 1024);
+            if (!small[i] || !large[i])
+                return -1;
+            touch(small[i], 64);
+            touch(large[i], 1024);
+        }
+        for (int i = 0; i < FRAG_PAIRS; i++)
+            timed_free(ctx, large[i]);
+
+        for (int i = 0; i < FRAG_PAIRS / 2; i++) {
+            if (!(large[i] = timed_alloc(ctx, 1500)))
+                return -1;
+            touch(large[i], 1500);
+        }
+        for (int i = 0; i < FRAG_PAIRS; i++)
+            timed_free(ctx, small[i]);
+        for (int i = 0; i < FRAG_PAIRS / 2; i++)
+            timed_free(ctx, large[i]);
+    }
+    return 0;
+}
+
+/* a recorded trace, with the addresses it saw turned into dense block ids */
+typedef struct {
+    char kind;
+    uint32_t id;
+    uint32_t old_id;
+    size_t size;
+    size_t alignment;
+} trace_op_t;
+
+typedef struct {
+    trace_op_t *ops;
+    size_t count;
+    size_t capacity;
+    uint32_t ids;
+} trace_t;
+
+/* address to id map, open addressing with backward-shift deletion */
+typedef struct {
+    uint64_t *keys;
+    uint32_t *ids;
+    size_t capacity;
+    size_t size;
+} addr_map_t;
+
+static void *map_pages(size_t size) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static size_t addr_slot(const addr_map_t *map, uint64_t key) {
+    return (size_t) ((key >> 4) * 0x9E3779B97F4A7C15ULL) & (map->capacity - 1);
+}
+
+static int addr_map_put(addr_map_t *map, uint64_t key, uint32_t id);
+
+static int addr_map_grow(addr_map_t *map) {
+    addr_map_t grown = {0};
+    grown.capacity = map->capacity ? map->capacity * 2 : 1024;
+    grown.keys = map_pages(grown.capacity * sizeof(uint64_t));
+    grown.ids = map_pages(grown.capacity * sizeof(uint32_t));
+    if (!grown.keys || !grown.ids)
+        return -1;
+
+    for (size_t i = 0; i < map->capacity; i++)
+        if (map->keys[i])
+            addr_map_put(&grown, map->keys[i], map->ids[i]);
+
+    if (map->keys) {
+        munmap(map->keys, map->capacity * sizeof(uint64_t));
+        munmap(map->ids, map->capacity * sizeof(uint32_t));
+    }
+    *map = grown;
+    return 0;
+}
+
+static int addr_map_put(addr_map_t *map, uint64_t key, uint32_t id) {
+    if ((map->size + 1) * 2 > map->capacity && addr_map_grow(map) != 0)
+        return -1;
+
+    size_t i = addr_slot(map, key);
+    while (map->keys[i] && map->keys[i] != key)
+        i = (i + 1) & (map->capacity - 1);
+    if (!map->keys[i])
+        map->size++;
+    map->keys[i] = key;
+    map->ids[i] = id;
+    return 0;
+}
+
+/* returns 0 when the address was never seen */
+static uint32_t addr_map_take(addr_map_t *map, uint64_t key) {
+    if (map->capacity == 0)
+        return 0;
+
+    size_t i = addr_slot(map, key);
+    while (map->keys[i] && map->keys[i] != key)
+        i = (i + 1) & (map->capacity - 1);
+    if (!map->keys[i])
+        return 0;
+
+    uint32_t id = map->ids[i];
+    map->keys[i] = 0;
+    map->size--;
+
+    size_t mask = map->capacity - 1;
+    for (size_t j = (i + 1) & mask; map->keys[j]; j = (j + 1) & mask) {
+        size_t home = addr_slot(map, map->keys[j]);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            map->keys[i] = map->keys[j];
+            map->ids[i] = map->ids[j];
+            map->keys[j] = 0;
+            i = j;
+        }
+    }
+    return id;
+}
+
+static int trace_push(trace_t *trace, trace_op_t op) {
+    if (trace->count == trace->capacity) {
+        size_t capacity = trace->capacity ? trace->capacity * 2 : 4096;
+        trace_op_t *ops = map_pages(capacity * sizeof(trace_op_t));
+        if (!ops)
+            return -1;
+        if (trace->ops) {
+            memcpy(ops, trace->ops, trace->count * sizeof(trace_op_t));
+            munmap(trace->ops, trace->capacity * sizeof(trace_op_t));
+        }
+        trace->ops = ops;
+        trace->capacity = capacity;
+    }
+    trace->ops[trace->count++] = op;
+    return 0;
+}
+
+/* reads the lines written by liballoc_trace.so with ALLOC_TRACE set:
+ *   m <size> <addr>            malloc, calloc
+ *   a <alignment> <size> <addr> aligned allocations
+ *   r <old addr> <size> <addr> realloc
+ *   f <addr>                   free
+ * frees of blocks allocated before tracing began are dropped */
+static int trace_load(const char *path, trace_t *trace) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    off_t len = lseek(fd, 0, SEEK_END);
+    char *text = len > 0 ? mmap(NULL, (size_t) len, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (text == MAP_FAILED)
+        return -1;
+
+    addr_map_t map = {0};
+    memset(trace, 0, sizeof(*trace));
+
+    int rc = 0;
+    const char *end = text + len;
+    for (const char *line = text; rc == 0 && line < end;) {
+        const char *eol = memchr(line, '\n', (size_t) (end - line));
+        if (!eol)
+            break;
+
+        char buf[128];
+        size_t n = (size_t) (eol - line);
+        if (n > sizeof(buf) - 1)
+            n = sizeof(buf) - 1;
+        memcpy(buf, line, n);
+        buf[n] = '\0';
+        line = eol + 1;
+
+        trace_op_t op = {.kind = buf[0]};
+        unsigned long long a = 0, b = 0, c = 0;
+        switch (buf[0]) {
+        case 'm':
+            if (sscanf(buf + 1, "%llu %llx", &a, &b) != 2)
+                continue;
+            op.size = a;
+            op.id = ++trace->ids;
+            rc = addr_map_put(&map, b, op.id);
+            break;
+        case 'a':
+            if (sscanf(buf + 1, "%llu %llu %llx", &a, &b, &c) != 3)
+                continue;
+            op.alignment = a;
+            op.size = b;
+            op.id = ++trace->ids;
+            rc = addr_map_put(&map, c, op.id);
+            break;
+        case 'r':
+            if (sscanf(buf + 1, "%llx %llu %llx", &a, &b, &c) != 3)
+                continue;
+            op.old_id = a ? addr_map_take(&map, a) : 0;
+            op.size = b;
+            op.id = ++trace->ids;
+            if (c)
+                rc = addr_map_put(&map, c, op.id);
+            break;
+        case 'f':
+            if (sscanf(buf + 1, "%llx", &a) != 1 || !(op.id = addr_map_take(&map, a)))
+                continue;
+            break;
+        default:
+            continue;
+        }
+
+        if (rc == 0)
+            rc = trace_push(trace, op);
+    }
+
+    munmap(text, (size_t) len);
+    if (map.keys) {
+        munmap(map.keys, map.capacity * sizeof(uint64_t));
+        munmap(map.ids, map.capacity * sizeof(uint32_t));
+    }
+    return rc;
+}
+
+static int trace_replay(bench_ctx_t *ctx, const void *arg) {
+    trace_t trace;
+    if (trace_load(arg, &trace) != 0)
+        return -1;
+
+    char **blocks = map_pages(((size_t) trace.ids + 1) * sizeof(char *));
+    if (!blocks)
+        return -1;
+
+    ctx_start(ctx);
+    for (size_t i = 0; i < trace.count; i++) {
+        trace_op_t *op = &trace.ops[i];
+        switch (op->kind) {
+        case 'm':
+            blocks[op->id] = timed_alloc(ctx, op->size);
+            break;
+        case 'a':
+            blocks[op->id] = timed_aligned(ctx, op->alignment, op->size);
+            break;
+        case 'r':
+            blocks[op->id] = timed_realloc(ctx, blocks[op->old_id], op->size);
+            blocks[op->old_id] = NULL;
+            break;
+        case 'f':
+            timed_free(ctx, blocks[op->id]);
+            blocks[op->id] = NULL;
+            break;
+        }
+        if (op->kind != 'f' && op->size > 0 && blocks[op->id])
+            touch(blocks[op->id], op->size);
+    }
+
+    for (uint32_t id = 1; id <= trace.ids; id++)
+        if (blocks[id])
+            timed_free(ctx, blocks[id]);
+    return 0;
+}
+
+/* every run gets a fresh process, so that the allocators do not share a heap and the peak RSS
+ * is the workload's own */
+static bench_result_t run_isolated(const bench_allocator_t *allocator, workload_func workload,
+                                   const void *arg) {
+    bench_result_t result = {.failed = 1};
+    int fds[2];
+    if (pipe(fds) != 0)
+        return result;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        bench_ctx_t ctx;
+        if (ctx_init(&ctx, allocator, 0x2545F4914F6CDD1DULL) == 0 && workload(&ctx, arg) == 0) {
+            result.elapsed_ns = bench_now_ns() - ctx.start_ns;
+            result.ops = ctx.ops;
+            result.p50_ns = bench_latency_percentile(&ctx.latency, 50);
+            result.p99_ns = bench_latency_percentile(&ctx.latency, 99);
+            result.peak_rss_kib = bench_rss_peak_kib();
+            result.failed = 0;
+        }
+        ssize_t n = write(fds[1], &result, sizeof(result));
+        _exit(n == sizeof(result) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    if (pid > 0) {
+        if (read(fds[0], &result, sizeof(result)) != sizeof(result))
+            result.failed = 1;
+        waitpid(pid, NULL, 0);
+    }
+    close(fds[0]);
+    return result;
+}
+
+static void run_workload(const char *name, workload_func workload, const void *arg) {
+    bench_report("%-24s %-14s %12s %8s %8s %14s", "workload", "allocator", "ops/sec", "p50 ns",
+                 "p99 ns", "peak RSS KiB");
+
+    for (size_t i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++) {
+        bench_result_t r = run_isolated(&allocators[i], workload, arg);
+        if (r.failed) {
+            bench_report("%-24s %-14s failed", name, allocators[i].name);
+            continue;
+        }
+
+        double ops_per_sec = r.elapsed_ns ? (double) r.ops * 1e9 / (double) r.elapsed_ns : 0;
+        bench_report("%-24s %-14s %12.0f %8llu %8llu %14zu", name, allocators[i].name, ops_per_sec,
+                     (unsigned long long) r.p50_ns, (unsigned long long) r.p99_ns, r.peak_rss_kib);
+    }
+}
+
+BENCH(alloc_random_churn) {
+    run_workload("random churn", random_churn, NULL);
+}
+
+BENCH(alloc_producer_consumer) {
+    run_workload("producer/consumer", producer_consumer, NULL);
+}
+
+BENCH(alloc_doubling) {
+    run_workload("doubling", doubling, NULL);
+}
+
+BENCH(alloc_fragmentation) {
+    run_workload("fragmentation", fragmentation, NULL);
+}
+
+/* BENCH_TRACES holds the paths of the traces to replay, separated by spaces */
+BENCH(alloc_trace_replay) {
+    const char *env = getenv("BENCH_TRACES");
+    if (!env || !*env) {
+        bench_report("trace replay: no traces, set BENCH_TRACES or run `make bench`");
+        return;
+    }
+
+    char paths[4096];
+    snprintf(paths, sizeof(paths), "%s", env);
+    char *save;
+    for (char *path = strtok_r(paths, " ", &save); path; path = strtok_r(NULL, " ", &save)) {
+        char name[64];
+        const char *base = strrchr(path, '/');
+        snprintf(name, sizeof(name), "trace %s", base ? base + 1 : path);
+        run_workload(name, trace_replay, path);
+    }
+}
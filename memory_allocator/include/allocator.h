@@ -4,9 +4,70 @@
 #define _DEFAULT_SOURCE
 #include <stddef.h>
 
+/* hardening levels, picked when building with -DALLOC_HARDENING=<level>. ALLOC_RELEASE only checks
+ * the magic number in front of a block and never poisons memory. ALLOC_HARDENED, the default, also
+ * makes sure a pointer lies in the heap before looking at it and poisons freed blocks.
+ * ALLOC_DEBUG maps every block on its own, right against an inaccessible guard page, and keeps
+ * freed blocks inaccessible for a while, so that overflows and use after free fault at once. as
+ * each live block then takes two mappings, ALLOC_DEBUG runs out of them at about 30000 live blocks
+ * with Linux's default vm.max_map_count of 65530, after which allocations return NULL */
+#define ALLOC_RELEASE 0
+#define ALLOC_HARDENED 1
+#define ALLOC_DEBUG 2
+
+#ifndef ALLOC_HARDENING
+#define ALLOC_HARDENING ALLOC_HARDENED
+#endif
+
+/* all functions are thread-safe; a block may be freed by a thread other than the one that
+ * allocated it */
 void *alloc_mem(size_t size);
 void *realloc_mem(void *ptr, size_t size);
 void *calloc_mem(size_t nmemb, size_t size);
 void free_mem(void *ptr);
 
+/* alignment must be a power of two; the block is released with free_mem, and realloc_mem only
+ * keeps the alignment while the block is resized in place */
+void *alloc_aligned_mem(size_t alignment, size_t size);
+void *calloc_aligned_mem(size_t alignment, size_t nmemb, size_t size);
+
+/* number of bytes the block can hold, which may be more than were asked for */
+size_t usable_size_mem(void *ptr);
+
+/* returns free heap memory beyond pad bytes to the OS; returns the number of bytes released */
+size_t trim_mem(size_t pad);
+
+/* asks the kernel to back the heap with transparent huge pages, or stops asking; applies to the
+ * heap as it is and as it grows. returns -1 with errno set when the kernel does not support them */
+int alloc_huge_pages(int enable);
+
+#define ALLOC_HISTOGRAM_BUCKETS 32
+
+/* block sizes include their headers; bucket i of free_histogram counts the free blocks of 2^i up to
+ * 2^(i + 1) - 1 bytes, with the last bucket taking every larger block. small blocks live in slabs
+ * outside the heap and count the size of their slot as requested */
+typedef struct {
+    size_t live_allocations;
+    size_t requested_bytes;    /* sum of the sizes asked for by live allocations */
+    size_t heap_bytes;         /* in use in the heap's regions */
+    size_t mmap_bytes;         /* mapped for blocks of their own */
+    size_t mmap_blocks;
+    size_t slab_bytes;         /* held by slabs, whether their slots are in use or not */
+    size_t free_blocks;        /* free blocks in the shared free lists */
+    size_t free_bytes;
+    size_t largest_free_block;
+    size_t cached_blocks;      /* free blocks held by per-thread caches */
+    size_t cached_bytes;
+    size_t free_histogram[ALLOC_HISTOGRAM_BUCKETS];
+    double fragmentation;      /* 1 - largest_free_block / free_bytes */
+} alloc_stats_t;
+
+/* costs a lock and a pass over the free-list heads, not a walk of the heap */
+void alloc_stats(alloc_stats_t *stats);
+
+/* walks every heap block and checks its header, reporting each problem on stderr; returns the
+ * number of problems found. meant for debugging, it expects no other allocator calls to run
+ * meanwhile */
+size_t heap_check(void);
+
 #endif
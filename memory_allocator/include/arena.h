@@ -0,0 +1,19 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* bump allocator for memory that shares one lifetime; an arena is not thread-safe */
+typedef struct arena arena_t;
+
+/* chunk_size of 0 picks the default; requests too big for a chunk get a chunk of their own */
+arena_t *arena_create(size_t chunk_size);
+void arena_destroy(arena_t *arena);
+
+void *arena_alloc(arena_t *arena, size_t size);
+void *arena_dup(arena_t *arena, const void *src, size_t size);
+
+/* releases every allocation at once and keeps the chunks for reuse */
+void arena_reset(arena_t *arena);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/* allocator for objects of one fixed size, carved from contiguous slabs; a pool is not
+ * thread-safe */
+typedef struct pool pool_t;
+
+typedef struct {
+    size_t object_size;
+    size_t objects_per_slab;
+    size_t slabs;
+    size_t objects_in_use;
+} pool_stats_t;
+
+/* objects_per_slab of 0 picks a default that fills a 64 KiB slab */
+pool_t *pool_create(size_t object_size, size_t objects_per_slab);
+void pool_destroy(pool_t *pool);
+
+void *pool_alloc(pool_t *pool);
+void pool_free(pool_t *pool, void *obj);
+
+void pool_stats(const pool_t *pool, pool_stats_t *stats);
+
+/* frees every slab that has no object in use; returns the number of slabs released */
+size_t pool_release_empty(pool_t *pool);
+
+#endif
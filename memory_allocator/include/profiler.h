@@ -0,0 +1,28 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stddef.h>
+
+/* sampling heap profiler for the blocks of alloc_mem and friends: while it runs, about one
+ * allocation per sample_interval bytes has its call stack recorded until it is freed; an interval
+ * of 0 picks the default of 512 KiB */
+int profiler_start(size_t sample_interval);
+
+/* stops taking samples; blocks sampled so far stay in the profile until they are freed */
+void profiler_stop(void);
+
+/* writes the live samples in the heap_v2 text format that pprof reads; returns 0 on success and
+ * -1 with errno set otherwise */
+int profiler_dump(int fd);
+
+/* dumps the profile to path, replacing it, every time signo is delivered; returns 0 on success
+ * and -1 with errno set otherwise */
+int profiler_dump_on_signal(int signo, const char *path);
+
+/* used by the allocator: the thread has allocated past its sampling countdown, so the block of
+ * size bytes becomes a sample unless the profiler is off; stores the next countdown in *next */
+typedef struct prof_sample prof_sample_t;
+prof_sample_t *profiler_record(size_t size, size_t *next);
+void profiler_release(prof_sample_t *sample);
+
+#endif
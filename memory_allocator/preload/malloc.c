@@ -0,0 +1,95 @@
+#define _GNU_SOURCE
+#include "allocator.h"
+#include <errno.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* the C library's allocation functions on top of the allocator, built into liballoc.so for
+ * LD_PRELOAD. the allocator needs no initialisation and never calls into malloc itself, so the
+ * calls the dynamic loader and libc make while the program starts up are served like any other.
+ * glibc also provides memalign, valloc and pvalloc, which would hand out blocks from its own heap
+ * if they were not replaced as well */
+
+/* ALLOC_HUGEPAGES=1 backs the heap with transparent huge pages */
+__attribute__((constructor)) static void huge_pages_init(void) {
+    const char *huge = getenv("ALLOC_HUGEPAGES");
+    if (huge && strcmp(huge, "1") == 0)
+        alloc_huge_pages(1);
+}
+
+static void *check_enomem(void *mem) {
+    if (!mem)
+        errno = ENOMEM;
+    return mem;
+}
+
+void *malloc(size_t size) {
+    return check_enomem(alloc_mem(size));
+}
+
+/* free must leave errno alone, but unmapping and trimming may set it */
+void free(void *ptr) {
+    int saved = errno;
+    free_mem(ptr);
+    errno = saved;
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    return check_enomem(calloc_mem(nmemb, size));
+}
+
+void *realloc(void *ptr, size_t size) {
+    return check_enomem(realloc_mem(ptr, size));
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) || alignment % sizeof(void *) != 0)
+        return EINVAL;
+
+    void *mem = alloc_aligned_mem(alignment, size);
+    if (!mem)
+        return ENOMEM;
+
+    *memptr = mem;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return check_enomem(alloc_aligned_mem(alignment, size));
+}
+
+/* like glibc, rounds an alignment that is not a power of two up to the next one */
+void *memalign(size_t alignment, size_t size) {
+    size_t power = 1;
+    while (power < alignment && power <= SIZE_MAX / 2)
+        power <<= 1;
+    if (power < alignment) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return check_enomem(alloc_aligned_mem(power, size));
+}
+
+void *valloc(size_t size) {
+    return memalign((size_t) sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    if (size > SIZE_MAX - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *ptr) {
+    return ptr ? usable_size_mem(ptr) : 0;
+}
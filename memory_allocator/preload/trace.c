@@ -0,0 +1,162 @@
+#define _GNU_SOURCE
+#include "allocator.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TRACE_BUFFER (64 * 1024)
+
+/* the allocation recorder of liballoc_trace.so, which is liballoc.so with malloc.c built to call
+ * the trace_ functions below in place of alloc_mem, calloc_mem, realloc_mem, alloc_aligned_mem
+ * and free_mem. with ALLOC_TRACE set, every call is logged to <ALLOC_TRACE>.<pid> for the
+ * benchmarks to replay; the lock is held across the call itself, so that the order in the log is
+ * the order in which blocks changed hands, and it is recursive because unwinding for the profiler
+ * may allocate */
+static pthread_mutex_t trace_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static int trace_fd = -1;
+static char trace_prefix[256];
+static char trace_buf[TRACE_BUFFER];
+static size_t trace_len = 0;
+
+void *trace_alloc_mem(size_t size);
+void *trace_calloc_mem(size_t nmemb, size_t size);
+void *trace_realloc_mem(void *ptr, size_t size);
+void *trace_alloc_aligned_mem(size_t alignment, size_t size);
+void trace_free_mem(void *ptr);
+
+static void trace_flush(void) {
+    size_t done = 0;
+    while (done < trace_len) {
+        ssize_t n = write(trace_fd, trace_buf + done, trace_len - done);
+        if (n <= 0)
+            break;
+        done += (size_t) n;
+    }
+    trace_len = 0;
+}
+
+static void trace_open(void) {
+    char path[300];
+    snprintf(path, sizeof(path), "%s.%d", trace_prefix, (int) getpid());
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+static void trace_lock_acquire(void) {
+    pthread_mutex_lock(&trace_lock);
+}
+
+static void trace_lock_release(void) {
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/* a forked child logs to a file of its own */
+static void trace_reopen(void) {
+    trace_len = 0;
+    if (trace_fd >= 0) {
+        close(trace_fd);
+        trace_open();
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+__attribute__((constructor)) static void trace_init(void) {
+    const char *prefix = getenv("ALLOC_TRACE");
+    if (!prefix || strlen(prefix) >= sizeof(trace_prefix))
+        return;
+
+    strcpy(trace_prefix, prefix);
+    trace_open();
+    pthread_atfork(trace_lock_acquire, trace_lock_release, trace_reopen);
+}
+
+__attribute__((destructor)) static void trace_fini(void) {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0)
+        trace_flush();
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_word(char sep, uintptr_t value, int hex) {
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = "0123456789abcdef"[value % (hex ? 16 : 10)];
+        value /= hex ? 16 : 10;
+    } while (value);
+
+    trace_buf[trace_len++] = sep;
+    while (n > 0)
+        trace_buf[trace_len++] = digits[--n];
+}
+
+/* logs kind followed by count values, written in hex where their bit in hex_mask is set; the
+ * trace lock must be held */
+static void trace_log(char kind, int count, unsigned hex_mask, uintptr_t a, uintptr_t b,
+                      uintptr_t c) {
+    if (trace_len + 3 * 24 + 2 > TRACE_BUFFER)
+        trace_flush();
+
+    uintptr_t values[3] = {a, b, c};
+    trace_buf[trace_len++] = kind;
+    for (int i = 0; i < count; i++)
+        trace_word(' ', values[i], (hex_mask >> i) & 1);
+    trace_buf[trace_len++] = '\n';
+}
+
+static int tracing(void) {
+    if (trace_fd < 0)
+        return 0;
+    pthread_mutex_lock(&trace_lock);
+    return 1;
+}
+
+static void *traced_alloc(size_t alignment, size_t size, void *mem) {
+    if (alignment)
+        trace_log('a', 3, 0x4, alignment, size, (uintptr_t) mem);
+    else
+        trace_log('m', 2, 0x2, size, (uintptr_t) mem, 0);
+    pthread_mutex_unlock(&trace_lock);
+    return mem;
+}
+
+void *trace_alloc_mem(size_t size) {
+    if (tracing())
+        return traced_alloc(0, size, alloc_mem(size));
+    return alloc_mem(size);
+}
+
+void *trace_calloc_mem(size_t nmemb, size_t size) {
+    if (tracing())
+        return traced_alloc(0, nmemb * size, calloc_mem(nmemb, size));
+    return calloc_mem(nmemb, size);
+}
+
+void *trace_realloc_mem(void *ptr, size_t size) {
+    if (!tracing())
+        return realloc_mem(ptr, size);
+
+    void *mem = realloc_mem(ptr, size);
+    trace_log('r', 3, 0x5, (uintptr_t) ptr, size, (uintptr_t) mem);
+    pthread_mutex_unlock(&trace_lock);
+    return mem;
+}
+
+void *trace_alloc_aligned_mem(size_t alignment, size_t size) {
+    if (tracing())
+        return traced_alloc(alignment, size, alloc_aligned_mem(alignment, size));
+    return alloc_aligned_mem(alignment, size);
+}
+
+void trace_free_mem(void *ptr) {
+    if (ptr && tracing()) {
+        trace_log('f', 1, 0x1, (uintptr_t) ptr, 0, 0);
+        free_mem(ptr);
+        pthread_mutex_unlock(&trace_lock);
+    } else {
+        free_mem(ptr);
+    }
+}
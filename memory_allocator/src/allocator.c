@@ -1,40 +1,785 @@
+#define _GNU_SOURCE
 #include "allocator.h"
+#include "profiler.h"
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #define MIN_ALLOC 1024
+#define MIN_BLOCK_UNITS 2
 #define MAGIC_ALLOCATED 0xDEADBEEF
 #define MAGIC_FREED 0xABADCAFE
+#define MAGIC_SLAB 0xCAFEF00D
 #define POISON_BYTE 0xAA
 
+/* requests of at least MMAP_THRESHOLD bytes get their own mapping; once TRIM_THRESHOLD bytes have
+ * been freed to the shared heap, everything above TRIM_PAD bytes of free space at its top is given
+ * back to the OS */
+#define MMAP_THRESHOLD (128 * 1024)
+#define TRIM_THRESHOLD (1024 * 1024)
+#define TRIM_PAD (128 * 1024)
+
+/* the heap is made of regions of address space aligned to their size, each used from its start up
+ * to its own break; region_map has a bit for every region-sized slot of the ADDRESS_BITS-bit
+ * address space. with huge pages, a region's break moves in steps of HUGE_PAGE_SIZE */
+#define REGION_SHIFT 26
+#define HEAP_REGION_SIZE ((size_t) 1 << REGION_SHIFT)
+#define ADDRESS_BITS 47
+#define REGION_MAP_WORDS (((size_t) 1 << (ADDRESS_BITS - REGION_SHIFT)) / 64)
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+#define BLOCK_MMAPPED 0x1
+#define BLOCK_TRIMMED 0x2
+#define BLOCK_BINNED 0x4
+#define BLOCK_FENCE 0x8
+#define BLOCK_GUARDED 0x10
+
+/* debug builds keep up to QUARANTINE_BLOCKS freed blocks, of up to QUARANTINE_BYTES in all,
+ * inaccessible before unmapping them */
+#define QUARANTINE_BLOCKS 4096
+#define QUARANTINE_BYTES (64 * 1024 * 1024)
+
+/* blocks of up to SMALL_BIN_UNITS units get an exact-fit bin each, bigger blocks share one bin
+ * per power of two */
+#define SMALL_BIN_UNITS 64
+#define SMALL_BIN_SHIFT 6
+#define LARGE_BINS (sizeof(size_t) * 8 - SMALL_BIN_SHIFT)
+#define NBINS (SMALL_BIN_UNITS + LARGE_BINS)
+#define BINMAP_WORDS ((NBINS + 63) / 64)
+
+/* per-thread caches hold up to TCACHE_COUNT blocks of each size up to TCACHE_MAX_UNITS units and
+ * move TCACHE_BATCH blocks at a time between the cache and the shared heap */
+#define TCACHE_MAX_UNITS 32
+#define TCACHE_COUNT 16
+#define TCACHE_BATCH 8
+
+/* requests of up to SLAB_MAX_SIZE bytes are served from page-sized slabs of equal slots, which
+ * need no header per block; slabs are carved from one range of address space reserved up front
+ * and committed SLAB_COMMIT bytes at a time, and up to SLAB_KEEP_EMPTY slabs with no block in use
+ * are kept for reuse before their pages are given back to the OS */
+#define SLAB_SIZE 4096
+#define SLAB_MAX_SIZE 256
+#define SLAB_ALIGN 16
+#define SLAB_CLASSES 13
+#define SLAB_MAP_WORDS 8
+#define SLAB_RESERVE ((size_t) 64 << 30)
+#define SLAB_MIN_RESERVE ((size_t) 64 << 20)
+#define SLAB_COMMIT (1024 * 1024)
+#define SLAB_KEEP_EMPTY 64
+
 typedef long Align;
 
+/* prev_free mirrors whether the physically preceding block sits in the shared bins, in which case
+ * the last word of that block holds its size; it is only written under heap_lock, apart from flags,
+ * which the owner of an allocated block may read without it. an allocated block keeps the size its
+ * caller asked for and its profiler sample where a free block keeps its bin links */
 union header {
     struct {
-        union header *next;
+        union {
+            union header *next;
+            prof_sample_t *sample;
+        };
+        union {
+            union header *prev;
+            size_t requested;
+        };
         size_t size;
         uint32_t magic;
+        uint16_t flags;
+        uint16_t prev_free;
     } s;
     Align x;
 };
 
 typedef union header header_t;
 
-static header_t base;
-static header_t *freep = NULL;
-static char *heap_start = NULL;
-static char *heap_end = NULL;
+/* kept in the first unit of its region */
+typedef struct region {
+    struct region *next;
+    char *_Atomic brk;
+} region_t;
+
+/* mapped blocks are kept on a list, and in a hash table of their user pointers for lookups */
+typedef struct mmap_chunk {
+    struct mmap_chunk *next;
+    struct mmap_chunk *prev;
+    struct mmap_chunk *bucket_next;
+    char *base;
+    size_t len;
+} mmap_chunk_t;
+
+typedef struct {
+    void *user;
+    char *base;
+    size_t len;
+} quarantined_t;
+
+typedef enum { SLAB_EMPTY = 0, SLAB_OWNED, SLAB_PARTIAL, SLAB_FULL } slab_state_t;
+
+/* free_map has a bit set for every free slot. only the thread owning a slab clears bits, while any
+ * thread may set them, so blocks come and go without a lock; a slab nobody owns sits on the
+ * partial or empty list, or on no list at all while it is full, and moves between them under
+ * heap_lock */
+typedef struct slab {
+    struct slab *next;
+    struct slab *prev;
+    _Atomic uint64_t free_map[SLAB_MAP_WORDS];
+    _Atomic size_t free_slots;
+    _Atomic int state;
+    _Atomic uint16_t hint;
+    uint16_t size_class;
+    uint16_t slot_size;
+    uint16_t slots;
+    uint32_t magic;
+} slab_t;
+
+/* offset of the first slot */
+#define SLAB_OBJECTS ((sizeof(slab_t) + SLAB_ALIGN - 1) & ~(size_t) (SLAB_ALIGN - 1))
+
+typedef enum { TCACHE_UNINIT = 0, TCACHE_ACTIVE, TCACHE_DEAD } tcache_state_t;
+
+/* statistics counters; each thread only ever adds to its own set, and the sets of all threads are
+ * summed up when the statistics are read, so the numbers of a single set may wrap around */
+typedef struct {
+    _Atomic size_t allocations;
+    _Atomic size_t requested;
+    _Atomic size_t cached_blocks;
+    _Atomic size_t cached_units;
+} alloc_counters_t;
+
+typedef struct tcache {
+    header_t *bins[TCACHE_MAX_UNITS];
+    unsigned counts[TCACHE_MAX_UNITS];
+    slab_t *slabs[SLAB_CLASSES];
+    tcache_state_t state;
+    size_t until_sample;
+    alloc_counters_t counters;
+    struct tcache *next_cache;
+    struct tcache *prev_cache;
+} tcache_t;
+
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key;
+static _Thread_local tcache_t tcache;
+
+static header_t *bins[NBINS];
+static uint64_t binmap[BINMAP_WORDS];
+static size_t released_since_trim = 0;
+static mmap_chunk_t *mmap_chunks = NULL;
+static mmap_chunk_t **mmap_buckets = NULL;
+static size_t mmap_bucket_shift = 0;
+static quarantined_t quarantine[QUARANTINE_BLOCKS];
+static size_t quarantine_head = 0;
+static size_t quarantine_count = 0;
+static size_t quarantine_bytes = 0;
+
+/* all of the following are protected by heap_lock, apart from exited_counters, which threads whose
+ * cache is gone add to atomically */
+static tcache_t *tcaches = NULL;
+static alloc_counters_t exited_counters;
+static size_t bin_counts[NBINS];
+static size_t free_blocks = 0;
+static size_t free_units = 0;
+static size_t heap_bytes = 0;
+static size_t mmap_bytes = 0;
+static size_t mmap_blocks = 0;
+
+/* heap chunks are chained through their fences, starting at first_chunk; the heap grows in the
+ * newest region, at the head of regions. region_map and the breaks are read without the lock */
+static header_t *first_chunk = NULL;
+static header_t *last_fence = NULL;
+static region_t *regions = NULL;
+static int huge_pages = 0;
+static _Atomic uint64_t region_map[REGION_MAP_WORDS];
+
+static const uint16_t slab_sizes[SLAB_CLASSES] = {8,   16,  32,  48,  64,  80, 96,
+                                                  112, 128, 160, 192, 224, 256};
+
+/* slabs lie between slab_start and slab_top, both of which are read without the lock; the rest is
+ * protected by heap_lock */
+static char *_Atomic slab_start = NULL;
+static char *_Atomic slab_top = NULL;
+static char *slab_committed = NULL;
+static char *slab_end = NULL;
+static int slab_reserve_failed = 0;
+static slab_t *partial_slabs[SLAB_CLASSES];
+static slab_t *empty_slabs = NULL;
+static size_t empty_slab_count = 0;
+static slab_t **released_slabs = NULL;
+static size_t released_count = 0;
+static size_t released_capacity = 0;
+
+static size_t bytes_to_units(size_t n_bytes) {
+    size_t n_units = (n_bytes + sizeof(header_t) - 1) / sizeof(header_t) + 1;
+    return n_units < MIN_BLOCK_UNITS ? MIN_BLOCK_UNITS : n_units;
+}
+
+/* length of a mapping that holds n_bytes of user data starting offset bytes into it, or 0 on
+ * overflow */
+static size_t mmap_length(size_t offset, size_t n_bytes) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    if (n_bytes > SIZE_MAX - offset - page)
+        return 0;
+
+    return (n_bytes + offset + page - 1) & ~(page - 1);
+}
+
+static mmap_chunk_t *mmap_chunk(header_t *header) {
+    return (mmap_chunk_t *) header - 1;
+}
+
+static void *mmap_user(mmap_chunk_t *chunk) {
+    return (void *) ((header_t *) (chunk + 1) + 1);
+}
+
+static mmap_chunk_t **mmap_bucket(void *ptr) {
+    uint64_t hash = ((uint64_t) (uintptr_t) ptr >> 4) * 0x9E3779B97F4A7C15ULL;
+    return &mmap_buckets[hash >> (64 - mmap_bucket_shift)];
+}
+
+/* heap_lock must be held */
+static void mmap_hash(mmap_chunk_t *chunk) {
+    if (!mmap_buckets)
+        return;
+
+    mmap_chunk_t **bucket = mmap_bucket(mmap_user(chunk));
+    chunk->bucket_next = *bucket;
+    *bucket = chunk;
+}
+
+/* doubles the buckets once there are as many mapped blocks as buckets; a failed mapping leaves the
+ * old ones, with longer chains. heap_lock must be held */
+static void mmap_buckets_grow(void) {
+    if (mmap_buckets && mmap_blocks < ((size_t) 1 << mmap_bucket_shift))
+        return;
+
+    size_t shift = mmap_buckets ? mmap_bucket_shift + 1 : 10;
+    size_t len = sizeof(mmap_chunk_t *) << shift;
+    void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return;
+
+    if (mmap_buckets)
+        munmap(mmap_buckets, sizeof(mmap_chunk_t *) << mmap_bucket_shift);
+    mmap_buckets = mem;
+    mmap_bucket_shift = shift;
+    for (mmap_chunk_t *chunk = mmap_chunks; chunk; chunk = chunk->next)
+        mmap_hash(chunk);
+}
+
+static void mmap_unhash(mmap_chunk_t *chunk) {
+    if (!mmap_buckets)
+        return;
+
+    mmap_chunk_t **link = mmap_bucket(mmap_user(chunk));
+    while (*link != chunk)
+        link = &(*link)->bucket_next;
+    *link = chunk->bucket_next;
+}
+
+/* falls back to walking the list when the buckets could never be mapped */
+static int mmap_lookup(void *ptr) {
+    pthread_mutex_lock(&heap_lock);
+    mmap_chunk_t *chunk = mmap_buckets ? *mmap_bucket(ptr) : mmap_chunks;
+    while (chunk && mmap_user(chunk) != ptr)
+        chunk = mmap_buckets ? chunk->bucket_next : chunk->next;
+    pthread_mutex_unlock(&heap_lock);
+
+    return chunk != NULL;
+}
+
+static void mmap_register(header_t *header, char *base, size_t len) {
+    mmap_chunk_t *chunk = mmap_chunk(header);
+    chunk->base = base;
+    chunk->len = len;
+
+    pthread_mutex_lock(&heap_lock);
+    mmap_buckets_grow();
+    mmap_hash(chunk);
+
+    chunk->prev = NULL;
+    chunk->next = mmap_chunks;
+    if (mmap_chunks)
+        mmap_chunks->prev = chunk;
+    mmap_chunks = chunk;
+    mmap_bytes += len;
+    mmap_blocks++;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/* the chunk and block headers sit right below the user pointer, which is placed at the first
+ * offset into the mapping that satisfies alignment; a mapping is only page aligned, but as the
+ * user pointer is a multiple of the page size into it, it is never more than the alignment in */
+static header_t *mmap_alloc(size_t n_bytes, size_t alignment) {
+    size_t room = sizeof(mmap_chunk_t) + sizeof(header_t);
+    size_t len = mmap_length((room + alignment - 1) & ~(alignment - 1), n_bytes);
+    if (len == 0)
+        return NULL;
+
+    char *base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    uintptr_t user = ((uintptr_t) base + room + alignment - 1) & ~(uintptr_t) (alignment - 1);
+    size_t offset = user - (uintptr_t) base;
+    header_t *header = (header_t *) user - 1;
+    header->s.size = (len - offset) / sizeof(header_t) + 1;
+    header->s.magic = MAGIC_ALLOCATED;
+    header->s.flags = BLOCK_MMAPPED;
+    header->s.prev_free = 0;
+
+    mmap_register(header, base, len);
+    return header;
+}
+
+/* in debug builds, every block has a mapping of its own that ends in a PROT_NONE guard page, and
+ * the block is placed as close to the guard page as alignment allows, so that running off its end
+ * faults at once */
+static header_t *guarded_alloc(size_t n_bytes, size_t alignment) {
+    if (alignment == 0)
+        alignment = n_bytes <= 8 ? 8 : SLAB_ALIGN;
+
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t room = sizeof(mmap_chunk_t) + sizeof(header_t) + alignment - 1;
+    size_t len = mmap_length(room, n_bytes);
+    if (len == 0 || len > SIZE_MAX - page)
+        return NULL;
+    len += page;
+
+    char *base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    char *guard = base + len - page;
+    if (mprotect(guard, page, PROT_NONE) != 0) {
+        munmap(base, len);
+        return NULL;
+    }
+
+    uintptr_t user = ((uintptr_t) guard - n_bytes) & ~(uintptr_t) (alignment - 1);
+    header_t *header = (header_t *) user - 1;
+    header->s.size = ((uintptr_t) guard - user) / sizeof(header_t) + 1;
+    header->s.magic = MAGIC_ALLOCATED;
+    header->s.flags = BLOCK_MMAPPED | BLOCK_GUARDED;
+    header->s.prev_free = 0;
+
+    mmap_register(header, base, len);
+    return header;
+}
+
+/* number of bytes a heap or mapped block can hold */
+static size_t block_usable(header_t *header) {
+    if (header->s.flags & BLOCK_GUARDED) {
+        mmap_chunk_t *chunk = mmap_chunk(header);
+        char *guard = chunk->base + chunk->len - (size_t) sysconf(_SC_PAGESIZE);
+        return (size_t) (guard - (char *) (header + 1));
+    }
+    return (header->s.size - 1) * sizeof(header_t);
+}
+
+/* whether ptr is a block that sits in quarantine, freed already */
+static int quarantine_lookup(void *ptr) {
+    int found = 0;
+    pthread_mutex_lock(&heap_lock);
+    for (size_t i = 0; i < quarantine_count && !found; i++)
+        found = quarantine[(quarantine_head + i) % QUARANTINE_BLOCKS].user == ptr;
+    pthread_mutex_unlock(&heap_lock);
+
+    return found;
+}
+
+/* makes a freed block inaccessible, header and all, and unmaps the blocks that have been in
+ * quarantine the longest to make room for it; heap_lock must be held */
+static void quarantine_push(mmap_chunk_t *chunk, void *user) {
+    char *base = chunk->base;
+    size_t len = chunk->len;
+    mprotect(base, len, PROT_NONE);
+
+    while (quarantine_count == QUARANTINE_BLOCKS ||
+           (quarantine_count > 0 && quarantine_bytes + len > QUARANTINE_BYTES)) {
+        quarantined_t *oldest = &quarantine[quarantine_head];
+        munmap(oldest->base, oldest->len);
+        quarantine_bytes -= oldest->len;
+        quarantine_head = (quarantine_head + 1) % QUARANTINE_BLOCKS;
+        quarantine_count--;
+    }
+
+    quarantined_t *slot = &quarantine[(quarantine_head + quarantine_count) % QUARANTINE_BLOCKS];
+    slot->user = user;
+    slot->base = base;
+    slot->len = len;
+    quarantine_count++;
+    quarantine_bytes += len;
+}
+
+static void mmap_free(header_t *header) {
+    mmap_chunk_t *chunk = mmap_chunk(header);
+
+    pthread_mutex_lock(&heap_lock);
+    mmap_unhash(chunk);
+    if (chunk->prev)
+        chunk->prev->next = chunk->next;
+    else
+        mmap_chunks = chunk->next;
+    if (chunk->next)
+        chunk->next->prev = chunk->prev;
+    mmap_bytes -= chunk->len;
+    mmap_blocks--;
+
+    if (header->s.flags & BLOCK_GUARDED) {
+        quarantine_push(chunk, header + 1);
+        pthread_mutex_unlock(&heap_lock);
+        return;
+    }
+    pthread_mutex_unlock(&heap_lock);
+
+    munmap(chunk->base, chunk->len);
+}
+
+static void *mmap_resize(header_t *header, size_t n_bytes) {
+    mmap_chunk_t *chunk = mmap_chunk(header);
+    size_t offset = (size_t) ((char *) (header + 1) - chunk->base);
+    size_t len = mmap_length(offset, n_bytes);
+    if (len == 0)
+        return NULL;
+    if (len == chunk->len)
+        return (void *) (header + 1);
+
+    /* the lock keeps lookups from walking through the chunk while it moves */
+    pthread_mutex_lock(&heap_lock);
+    mmap_unhash(chunk);
+    char *base = mremap(chunk->base, chunk->len, len, MREMAP_MAYMOVE);
+    if (base != MAP_FAILED) {
+        header = (header_t *) (base + offset) - 1;
+        header->s.size = (len - offset) / sizeof(header_t) + 1;
+
+        chunk = mmap_chunk(header);
+        mmap_bytes += len - chunk->len;
+        chunk->base = base;
+        chunk->len = len;
+        if (chunk->prev)
+            chunk->prev->next = chunk;
+        else
+            mmap_chunks = chunk;
+        if (chunk->next)
+            chunk->next->prev = chunk;
+    }
+    mmap_hash(chunk);
+    pthread_mutex_unlock(&heap_lock);
+
+    return base == MAP_FAILED ? NULL : (void *) (header + 1);
+}
+
+static size_t slab_class(size_t n_bytes) {
+    if (n_bytes <= 8)
+        return 0;
+    if (n_bytes <= 128)
+        return (n_bytes + 15) / 16;
+    return 8 + (n_bytes - 128 + 31) / 32;
+}
+
+/* the slab holding a pointer into the slab range, or NULL for any other pointer */
+static slab_t *slab_of(void *ptr) {
+    if ((char *) ptr < (char *) slab_start || (char *) ptr >= (char *) slab_top)
+        return NULL;
+    return (slab_t *) ((uintptr_t) ptr & ~(uintptr_t) (SLAB_SIZE - 1));
+}
+
+/* reserves the range slabs are carved from, settling for less address space when the OS will not
+ * hand out that much; heap_lock must be held */
+static int slab_reserve(void) {
+    if (slab_start)
+        return 1;
+    if (slab_reserve_failed)
+        return 0;
+
+    for (size_t len = SLAB_RESERVE; len >= SLAB_MIN_RESERVE; len /= 2) {
+        char *base =
+            mmap(NULL, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base != MAP_FAILED) {
+            slab_committed = base;
+            slab_end = base + len;
+            slab_top = base;
+            slab_start = base;
+            return 1;
+        }
+    }
+
+    slab_reserve_failed = 1;
+    return 0;
+}
+
+/* a slab to be initialised, taken from the empty ones, the released ones or the end of the range;
+ * heap_lock must be held */
+static slab_t *slab_new(void) {
+    if (empty_slabs) {
+        slab_t *slab = empty_slabs;
+        empty_slabs = slab->next;
+        empty_slab_count--;
+        return slab;
+    }
+    if (released_count > 0)
+        return released_slabs[--released_count];
+    if (!slab_reserve() || slab_top == slab_end)
+        return NULL;
+
+    char *top = slab_top;
+    if (top == slab_committed) {
+        if (mprotect(slab_committed, SLAB_COMMIT, PROT_READ | PROT_WRITE) != 0)
+            return NULL;
+        slab_committed += SLAB_COMMIT;
+    }
+    slab_top = top + SLAB_SIZE;
+    return (slab_t *) top;
+}
+
+static void slab_init(slab_t *slab, size_t size_class) {
+    slab->size_class = size_class;
+    slab->slot_size = slab_sizes[size_class];
+    slab->slots = (SLAB_SIZE - SLAB_OBJECTS) / slab->slot_size;
+
+    for (size_t w = 0; w < SLAB_MAP_WORDS; w++) {
+        uint64_t bits = 0;
+        if (slab->slots >= (w + 1) * 64)
+            bits = ~0ULL;
+        else if (slab->slots > w * 64)
+            bits = (1ULL << (slab->slots - w * 64)) - 1;
+        atomic_store_explicit(&slab->free_map[w], bits, memory_order_relaxed);
+    }
+
+    atomic_store(&slab->free_slots, slab->slots);
+    atomic_store(&slab->hint, 0);
+    atomic_store(&slab->state, SLAB_OWNED);
+    slab->magic = MAGIC_SLAB;
+}
+
+/* takes a free slot out of a slab the calling thread owns, preferring the one freed last; returns
+ * NULL when the slab is full */
+static void *slab_take(slab_t *slab) {
+    size_t idx = atomic_load_explicit(&slab->hint, memory_order_relaxed);
+    uint64_t bits = atomic_load_explicit(&slab->free_map[idx / 64], memory_order_relaxed);
+
+    if (!(bits & (1ULL << (idx % 64)))) {
+        for (idx = 0; idx < SLAB_MAP_WORDS * 64; idx += 64) {
+            bits = atomic_load_explicit(&slab->free_map[idx / 64], memory_order_relaxed);
+            if (bits)
+                break;
+        }
+        if (!bits)
+            return NULL;
+        idx += __builtin_ctzll(bits);
+    }
+
+    atomic_fetch_and(&slab->free_map[idx / 64], ~(1ULL << (idx % 64)));
+    atomic_fetch_sub(&slab->free_slots, 1);
+    return (char *) slab + SLAB_OBJECTS + idx * slab->slot_size;
+}
+
+static int released_push(slab_t *slab) {
+    if (released_count == released_capacity) {
+        size_t capacity = released_capacity ? released_capacity * 2 : SLAB_SIZE / sizeof(slab_t *);
+        slab_t **grown = mmap(NULL, capacity * sizeof(slab_t *), PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (grown == MAP_FAILED)
+            return 0;
+
+        if (released_slabs) {
+            memcpy(grown, released_slabs, released_count * sizeof(slab_t *));
+            munmap(released_slabs, released_capacity * sizeof(slab_t *));
+        }
+        released_slabs = grown;
+        released_capacity = capacity;
+    }
+
+    released_slabs[released_count++] = slab;
+    return 1;
+}
+
+/* keeps a slab with no block in use for reuse, or gives its page back to the OS once enough are
+ * kept; heap_lock must be held */
+static void slab_retire(slab_t *slab) {
+    atomic_store(&slab->state, SLAB_EMPTY);
+    if (empty_slab_count >= SLAB_KEEP_EMPTY && released_push(slab)) {
+        madvise(slab, SLAB_SIZE, MADV_DONTNEED);
+        return;
+    }
+
+    slab->next = empty_slabs;
+    empty_slabs = slab;
+    empty_slab_count++;
+}
+
+/* puts a slab nobody owns on the list its free slots call for; heap_lock must be held */
+static void slab_relist(slab_t *slab) {
+    int state = atomic_load(&slab->state);
+    size_t free_slots = atomic_load(&slab->free_slots);
+    slab_t **list = &partial_slabs[slab->size_class];
+
+    if (state == SLAB_FULL && free_slots > 0) {
+        slab->prev = NULL;
+        slab->next = *list;
+        if (*list)
+            (*list)->prev = slab;
+        *list = slab;
+        atomic_store(&slab->state, state = SLAB_PARTIAL);
+    }
+
+    if (state == SLAB_PARTIAL && free_slots == slab->slots) {
+        if (slab->prev)
+            slab->prev->next = slab->next;
+        else
+            *list = slab->next;
+        if (slab->next)
+            slab->next->prev = slab->prev;
+        slab_retire(slab);
+    }
+}
+
+/* a thread gives up a slab when it is full or when the thread exits. a block freed meanwhile
+ * either sees the slab marked full and relists it, or is seen by slab_relist here; heap_lock must
+ * be held */
+static void slab_disown(slab_t *slab) {
+    atomic_store(&slab->state, SLAB_FULL);
+    slab_relist(slab);
+}
+
+/* replaces the slab of a size class a thread allocates from with one that has free slots */
+static slab_t *slab_refill(slab_t **owned, size_t size_class) {
+    pthread_mutex_lock(&heap_lock);
+    if (*owned)
+        slab_disown(*owned);
+
+    slab_t *slab = partial_slabs[size_class];
+    if (slab) {
+        partial_slabs[size_class] = slab->next;
+        if (slab->next)
+            slab->next->prev = NULL;
+        atomic_store(&slab->state, SLAB_OWNED);
+    } else if ((slab = slab_new())) {
+        slab_init(slab, size_class);
+    }
+    *owned = slab;
+    pthread_mutex_unlock(&heap_lock);
+
+    return slab;
+}
+
+static int slab_slot_is_free(slab_t *slab, size_t idx) {
+    return (atomic_load(&slab->free_map[idx / 64]) >> (idx % 64)) & 1;
+}
+
+/* index of the slot ptr points to, or -1 when it is not the start of one */
+static long slab_slot(slab_t *slab, void *ptr) {
+    size_t offset = (size_t) ((char *) ptr - (char *) slab);
+    if (slab->magic != MAGIC_SLAB || offset < SLAB_OBJECTS ||
+        (offset - SLAB_OBJECTS) % slab->slot_size != 0)
+        return -1;
+
+    size_t idx = (offset - SLAB_OBJECTS) / slab->slot_size;
+    return idx < slab->slots ? (long) idx : -1;
+}
+
+static region_t *region_of(void *ptr) {
+    return (region_t *) ((uintptr_t) ptr & ~(uintptr_t) (HEAP_REGION_SIZE - 1));
+}
+
+/* whether ptr lies in the used part of a heap region, past the first block header */
+static int heap_lookup(void *ptr) {
+    uintptr_t idx = (uintptr_t) ptr >> REGION_SHIFT;
+    if (idx >= REGION_MAP_WORDS * 64 ||
+        !((atomic_load_explicit(&region_map[idx / 64], memory_order_relaxed) >> (idx % 64)) & 1))
+        return 0;
+
+    region_t *region = region_of(ptr);
+    return (char *) ptr > (char *) ((header_t *) region + 1) && (char *) ptr < region->brk;
+}
+
+/* maps a region aligned to its size by mapping twice as much and unmapping the excess; heap_lock
+ * must be held */
+static region_t *region_new(void) {
+    char *map = mmap(NULL, 2 * HEAP_REGION_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    char *base = (char *) (((uintptr_t) map + HEAP_REGION_SIZE - 1) &
+                           ~(uintptr_t) (HEAP_REGION_SIZE - 1));
+    if (base > map)
+        munmap(map, (size_t) (base - map));
+    munmap(base + HEAP_REGION_SIZE, HEAP_REGION_SIZE - (size_t) (base - map));
+
+    uintptr_t idx = (uintptr_t) base >> REGION_SHIFT;
+    if (idx >= REGION_MAP_WORDS * 64) {
+        munmap(base, HEAP_REGION_SIZE);
+        return NULL;
+    }
+    if (huge_pages)
+        madvise(base, HEAP_REGION_SIZE, MADV_HUGEPAGE);
+
+    region_t *region = (region_t *) base;
+    region->brk = (char *) ((header_t *) base + 1);
+    region->next = regions;
+    regions = region;
+    atomic_fetch_or(&region_map[idx / 64], 1ULL << (idx % 64));
+    return region;
+}
+
+/* moves a region's break up by at least n_bytes, to a page boundary, or to a huge page boundary
+ * when there is room; returns the old break, or NULL when the region is full. heap_lock must be
+ * held */
+static char *region_grow(region_t *region, size_t n_bytes) {
+    char *brk = region->brk;
+    char *end = (char *) region + HEAP_REGION_SIZE;
+    if (n_bytes > (size_t) (end - brk))
+        return NULL;
+
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    uintptr_t top = (uintptr_t) brk + n_bytes;
+    uintptr_t new_brk = (top + page - 1) & ~(uintptr_t) (page - 1);
+    if (huge_pages) {
+        uintptr_t huge = (top + HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (HUGE_PAGE_SIZE - 1);
+        if (huge <= (uintptr_t) end)
+            new_brk = huge;
+    }
+    if (new_brk > (uintptr_t) end)
+        return NULL;
+
+    region->brk = (char *) new_brk;
+    heap_bytes += new_brk - (uintptr_t) brk;
+    return brk;
+}
 
 static int validate_ptr(void *ptr, const char *funcname) {
     if (!ptr)
         return 0;
 
-    if ((char *) ptr <= (char *) heap_start || (char *) ptr >= (char *) heap_end) {
-        fprintf(stderr, "%s: invalid pointer %p (out of heap bounds)\n", funcname, ptr);
+    slab_t *slab = slab_of(ptr);
+    if (slab) {
+        long idx = slab_slot(slab, ptr);
+        if (idx < 0) {
+            fprintf(stderr, "%s: invalid pointer %p (heap corruption)\n", funcname, ptr);
+            return 0;
+        }
+        if (slab_slot_is_free(slab, idx)) {
+            fprintf(stderr, "%s: double free detected at %p\n", funcname, ptr);
+            return 0;
+        }
+        return 1;
+    }
+
+    /* release builds trust the pointer as far as reading its header */
+    if (ALLOC_HARDENING != ALLOC_RELEASE && !heap_lookup(ptr) && !mmap_lookup(ptr)) {
+        if (ALLOC_HARDENING == ALLOC_DEBUG && quarantine_lookup(ptr))
+            fprintf(stderr, "%s: double free detected at %p\n", funcname, ptr);
+        else
+            fprintf(stderr, "%s: invalid pointer %p (out of heap bounds)\n", funcname, ptr);
         return 0;
     }
 
@@ -52,89 +797,681 @@ static int validate_ptr(void *ptr, const char *funcname) {
     return 1;
 }
 
-void free_mem(void *ptr) {
-    if (!ptr)
-        return;
-    if (!validate_ptr(ptr, "free_mem"))
-        return;
+/* fills memory that no block owns any more, apart from in release builds */
+static void poison(void *mem, size_t n_bytes) {
+    if (ALLOC_HARDENING != ALLOC_RELEASE)
+        memset(mem, POISON_BYTE, n_bytes);
+}
 
-    header_t *ptr_header = (header_t *) ptr - 1;
-    size_t user_data = (ptr_header->s.size - 1) * sizeof(header_t);
-    memset(ptr, POISON_BYTE, user_data);
+static size_t bin_index(size_t n_units) {
+    if (n_units <= SMALL_BIN_UNITS)
+        return n_units - 1;
 
-    ptr_header->s.magic = MAGIC_FREED;
+    size_t log2 = sizeof(unsigned long long) * 8 - 1 - __builtin_clzll(n_units);
+    return SMALL_BIN_UNITS + log2 - SMALL_BIN_SHIFT;
+}
 
-    header_t *curr = freep;
-    for (; !(ptr_header > curr && ptr_header < curr->s.next); curr = curr->s.next) {
-        if (curr >= curr->s.next && (ptr_header > curr || ptr_header < curr->s.next))
-            break;
+static void set_footer(header_t *block) {
+    ((size_t *) (block + block->s.size))[-1] = block->s.size;
+}
+
+static void bin_push(header_t *block) {
+    size_t idx = bin_index(block->s.size);
+    block->s.next = bins[idx];
+    block->s.prev = NULL;
+    if (bins[idx])
+        bins[idx]->s.prev = block;
+    block->s.flags |= BLOCK_BINNED;
+    bins[idx] = block;
+    binmap[idx / 64] |= 1ULL << (idx % 64);
+
+    bin_counts[idx]++;
+    free_blocks++;
+    free_units += block->s.size;
+}
+
+static void bin_unlink(header_t *block) {
+    size_t idx = bin_index(block->s.size);
+    if (block->s.prev)
+        block->s.prev->s.next = block->s.next;
+    else
+        bins[idx] = block->s.next;
+    if (block->s.next)
+        block->s.next->s.prev = block->s.prev;
+
+    block->s.flags &= ~BLOCK_BINNED;
+    if (!bins[idx])
+        binmap[idx / 64] &= ~(1ULL << (idx % 64));
+
+    bin_counts[idx]--;
+    free_blocks--;
+    free_units -= block->s.size;
+}
+
+/* first non-empty bin at or above idx, or NBINS if there is none */
+static size_t next_bin(size_t idx) {
+    for (size_t w = idx / 64; w < BINMAP_WORDS; w++) {
+        uint64_t bits = binmap[w];
+        if (w == idx / 64)
+            bits &= ~0ULL << (idx % 64);
+        if (bits)
+            return w * 64 + __builtin_ctzll(bits);
     }
+    return NBINS;
+}
 
-    if (ptr_header + ptr_header->s.size == curr->s.next) {
-        ptr_header->s.size += curr->s.next->s.size;
-        ptr_header->s.next = curr->s.next->s.next;
-    } else {
-        ptr_header->s.next = curr->s.next;
+/* a header swallowed by a neighbouring free block keeps its freed magic, so a stale pointer to it
+ * is still reported as a double free */
+static void retire_header(header_t *header) {
+    memset(header, POISON_BYTE, offsetof(header_t, s.magic));
+    header->s.magic = MAGIC_FREED;
+    header->s.flags = 0;
+    header->s.prev_free = 0;
+}
+
+/* puts a free block into the bins after merging it with the free blocks on either side of it;
+ * returns the merged block */
+static header_t *coalesce(header_t *block) {
+    header_t *next = block + block->s.size;
+    if (next->s.flags & BLOCK_BINNED) {
+        bin_unlink(next);
+        block->s.size += next->s.size;
+        retire_header(next);
     }
 
-    if (curr + curr->s.size == ptr_header) {
-        curr->s.size += ptr_header->s.size;
-        curr->s.next = ptr_header->s.next;
-    } else {
-        curr->s.next = ptr_header;
+    if (block->s.prev_free) {
+        header_t *prev = block - ((size_t *) block)[-1];
+        bin_unlink(prev);
+        prev->s.size += block->s.size;
+        retire_header(block);
+        block = prev;
+    }
+
+    block->s.flags = 0;
+    set_footer(block);
+    (block + block->s.size)->s.prev_free = 1;
+    bin_push(block);
+    return block;
+}
+
+/* gives the free space at the top of every region beyond pad bytes back to the OS, by moving the
+ * region's break down, and drops the pages of every other large free block; heap_lock must be
+ * held */
+static size_t heap_trim(size_t pad) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t pad_units = bytes_to_units(pad);
+    size_t released = 0;
+
+    released_since_trim = 0;
+
+    for (size_t idx = next_bin(bin_index(pad_units)); idx < NBINS; idx = next_bin(idx + 1)) {
+        header_t *next;
+        for (header_t *block = bins[idx]; block; block = next) {
+            next = block->s.next;
+            if (block->s.size <= pad_units)
+                continue;
+
+            header_t *fence = block + block->s.size;
+            region_t *region = region_of(block);
+            uintptr_t keep = (uintptr_t) (block + pad_units + 1);
+            char *new_brk = (char *) ((keep + page - 1) & ~(uintptr_t) (page - 1));
+            if ((char *) (fence + 1) == region->brk && new_brk < region->brk) {
+                size_t shrink = (size_t) (region->brk - new_brk);
+                bin_unlink(block);
+                block->s.size = (size_t) (new_brk - (char *) block) / sizeof(header_t) - 1;
+                *(block + block->s.size) = *fence;
+                if (last_fence == fence)
+                    last_fence = block + block->s.size;
+
+                madvise(new_brk, shrink, MADV_DONTNEED);
+                region->brk = new_brk;
+                heap_bytes -= shrink;
+                released += shrink;
+
+                set_footer(block);
+                bin_push(block);
+                continue;
+            }
+
+            if (block->s.flags & BLOCK_TRIMMED)
+                continue;
+
+            /* the footer in the block's last word has to survive */
+            uintptr_t from = ((uintptr_t) (block + 1) + page - 1) & ~(page - 1);
+            uintptr_t to = ((uintptr_t) fence - sizeof(size_t)) & ~(page - 1);
+            if (to > from && madvise((void *) from, to - from, MADV_DONTNEED) == 0) {
+                block->s.flags |= BLOCK_TRIMMED;
+                released += to - from;
+            }
+        }
     }
 
-    freep = curr;
+    return released;
+}
+
+/* hands a block that is already poisoned and marked freed back to the shared bins */
+static void heap_release(header_t *block) {
+    released_since_trim += block->s.size * sizeof(header_t);
+    coalesce(block);
+
+    if (released_since_trim >= TRIM_THRESHOLD)
+        heap_trim(TRIM_PAD);
 }
 
+/* every chunk of the heap ends in a fence header that is never freed, so the block after any heap
+ * block is always a valid header. growing the newest region extends the chunk at its break, over
+ * the old fence, and a full region is followed by a new one holding a chunk of its own */
 static void *more_mem(size_t n_units) {
-    if (heap_start == NULL)
-        heap_start = (char *) sbrk(0);
+    n_units++;
     if (n_units < MIN_ALLOC)
         n_units = MIN_ALLOC;
 
-    void *p = sbrk(n_units * sizeof(header_t));
-    if (p == (void *) -1)
+    region_t *region = regions;
+    header_t *new_mem;
+    uint16_t prev_free = 0;
+    char *brk = region ? region_grow(region, n_units * sizeof(header_t)) : NULL;
+    if (brk) {
+        new_mem = (header_t *) brk - 1;
+        prev_free = new_mem->s.prev_free;
+    } else {
+        region = region_new();
+        if (!region)
+            return NULL;
+        new_mem = (header_t *) region_grow(region, n_units * sizeof(header_t));
+        if (last_fence)
+            last_fence->s.next = new_mem;
+        else
+            first_chunk = new_mem;
+    }
+    n_units = (size_t) (region->brk - (char *) new_mem) / sizeof(header_t);
+
+    new_mem->s.size = n_units - 1;
+    new_mem->s.magic = MAGIC_FREED;
+    new_mem->s.prev_free = prev_free;
+    poison(new_mem + 1, (n_units - 2) * sizeof(header_t));
+
+    header_t *fence = new_mem + new_mem->s.size;
+    fence->s.next = NULL;
+    fence->s.prev = NULL;
+    fence->s.size = 1;
+    fence->s.magic = MAGIC_ALLOCATED;
+    fence->s.flags = BLOCK_FENCE;
+    last_fence = fence;
+
+    return coalesce(new_mem);
+}
+
+static header_t *take_block(size_t n_units) {
+    size_t idx = bin_index(n_units);
+
+    /* large bins hold a range of sizes, so the request's own bin needs a first-fit scan */
+    if (n_units > SMALL_BIN_UNITS) {
+        for (header_t *curr = bins[idx]; curr; curr = curr->s.next) {
+            if (curr->s.size >= n_units) {
+                bin_unlink(curr);
+                return curr;
+            }
+        }
+        idx++;
+    }
+
+    idx = next_bin(idx);
+    if (idx == NBINS)
         return NULL;
 
-    heap_end = (char *) sbrk(0);
+    header_t *block = bins[idx];
+    bin_unlink(block);
+    return block;
+}
+
+/* returns a block of exactly n_units taken out of the bins, still marked freed; heap_lock must be
+ * held */
+static header_t *heap_alloc(size_t n_units) {
+    header_t *curr;
+    while (!(curr = take_block(n_units))) {
+        if (more_mem(n_units) == NULL)
+            return NULL;
+    }
+
+    if (curr->s.size - n_units >= MIN_BLOCK_UNITS) {
+        curr->s.size -= n_units;
+        curr->s.flags = 0;
+        set_footer(curr);
+        bin_push(curr);
+        curr += curr->s.size;
+        curr->s.size = n_units;
+        curr->s.magic = MAGIC_FREED;
+        curr->s.prev_free = 1;
+    }
+    curr->s.flags = 0;
+    (curr + curr->s.size)->s.prev_free = 0;
+
+    return curr;
+}
+
+/* adds to a thread's own counters; the sum over all threads is what gets reported */
+static void counter_add(_Atomic size_t *counter, size_t delta) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + delta,
+                          memory_order_relaxed);
+}
+
+/* a block may be one unit bigger than the size its bin stands for, when splitting off the spare
+ * unit would have left a block too small to track */
+static void tcache_push(tcache_t *tc, size_t idx, header_t *block) {
+    block->s.next = tc->bins[idx];
+    tc->bins[idx] = block;
+    tc->counts[idx]++;
+    counter_add(&tc->counters.cached_blocks, 1);
+    counter_add(&tc->counters.cached_units, block->s.size);
+}
+
+static header_t *tcache_pop(tcache_t *tc, size_t idx) {
+    header_t *block = tc->bins[idx];
+    if (block) {
+        tc->bins[idx] = block->s.next;
+        tc->counts[idx]--;
+        counter_add(&tc->counters.cached_blocks, (size_t) -1);
+        counter_add(&tc->counters.cached_units, -block->s.size);
+    }
+    return block;
+}
+
+static void tcache_flush(tcache_t *tc, size_t idx, unsigned count) {
+    pthread_mutex_lock(&heap_lock);
+    header_t *block;
+    while (count-- > 0 && (block = tcache_pop(tc, idx)))
+        heap_release(block);
+    pthread_mutex_unlock(&heap_lock);
+}
+
+static void tcache_destroy(void *arg) {
+    tcache_t *tc = arg;
+    for (size_t i = 0; i < TCACHE_MAX_UNITS; i++)
+        tcache_flush(tc, i, tc->counts[i]);
+
+    pthread_mutex_lock(&heap_lock);
+    if (tc->prev_cache)
+        tc->prev_cache->next_cache = tc->next_cache;
+    else
+        tcaches = tc->next_cache;
+    if (tc->next_cache)
+        tc->next_cache->prev_cache = tc->prev_cache;
+
+    for (size_t i = 0; i < SLAB_CLASSES; i++)
+        if (tc->slabs[i])
+            slab_disown(tc->slabs[i]);
+
+    atomic_fetch_add(&exited_counters.allocations, tc->counters.allocations);
+    atomic_fetch_add(&exited_counters.requested, tc->counters.requested);
+    tc->state = TCACHE_DEAD;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+static void heap_lock_acquire(void) {
+    pthread_mutex_lock(&heap_lock);
+}
+
+static void heap_lock_release(void) {
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/* a child forked while another thread holds the heap lock would find it locked for good; this
+ * runs before other constructors, so the heap lock is taken last when forking */
+__attribute__((constructor(101))) static void register_fork_handlers(void) {
+    pthread_atfork(heap_lock_acquire, heap_lock_release, heap_lock_release);
+}
 
-    header_t *new_mem = (header_t *) p;
-    new_mem->s.size = n_units;
-    new_mem->s.magic = MAGIC_ALLOCATED;
-    free_mem((void *) (new_mem + 1));
-    return freep;
+static void tcache_key_create(void) {
+    pthread_key_create(&tcache_key, tcache_destroy);
 }
 
+/* the calling thread's cache, or NULL once the thread is exiting and its cache was flushed */
+static tcache_t *tcache_get(void) {
+    if (tcache.state == TCACHE_ACTIVE)
+        return &tcache;
+    if (tcache.state == TCACHE_DEAD)
+        return NULL;
+
+    pthread_once(&tcache_once, tcache_key_create);
+    pthread_setspecific(tcache_key, &tcache);
+
+    pthread_mutex_lock(&heap_lock);
+    tcache.prev_cache = NULL;
+    tcache.next_cache = tcaches;
+    if (tcaches)
+        tcaches->prev_cache = &tcache;
+    tcaches = &tcache;
+    tcache.state = TCACHE_ACTIVE;
+    pthread_mutex_unlock(&heap_lock);
+
+    return &tcache;
+}
+
+static void tcache_refill(tcache_t *tc, size_t n_units) {
+    pthread_mutex_lock(&heap_lock);
+    for (int i = 0; i < TCACHE_BATCH; i++) {
+        header_t *block = heap_alloc(n_units);
+        if (!block)
+            break;
+        tcache_push(tc, n_units - 1, block);
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
+
+static void count_allocations(size_t allocations, size_t requested) {
+    tcache_t *tc = tcache_get();
+    if (tc) {
+        counter_add(&tc->counters.allocations, allocations);
+        counter_add(&tc->counters.requested, requested);
+    } else {
+        atomic_fetch_add(&exited_counters.allocations, allocations);
+        atomic_fetch_add(&exited_counters.requested, requested);
+    }
+}
+
+/* accounts for allocations coming and going and for live ones changing their requested size */
+static void count_requested(header_t *header, size_t allocations, size_t requested) {
+    size_t delta = requested - header->s.requested;
+    header->s.requested = requested;
+    count_allocations(allocations, delta);
+}
+
+/* makes roughly one allocation per profiler sampling interval bytes a sample; with the profiler
+ * off, a thread only looks again once in a while */
+static prof_sample_t *sample_alloc(size_t size) {
+    tcache_t *tc = tcache_get();
+    if (!tc)
+        return NULL;
+    if (size < tc->until_sample) {
+        tc->until_sample -= size;
+        return NULL;
+    }
+    return profiler_record(size, &tc->until_sample);
+}
+
+static void sample_free(header_t *header) {
+    if (header->s.sample) {
+        profiler_release(header->s.sample);
+        header->s.sample = NULL;
+    }
+}
+
+/* gives a block back to the OS, the thread's cache or the shared bins, without any checks or
+ * accounting */
+static void block_free(header_t *header) {
+    if (header->s.flags & BLOCK_MMAPPED) {
+        mmap_free(header);
+        return;
+    }
+
+    poison(header + 1, (header->s.size - 1) * sizeof(header_t));
+
+    header->s.magic = MAGIC_FREED;
+
+    tcache_t *tc = header->s.size <= TCACHE_MAX_UNITS ? tcache_get() : NULL;
+    if (tc) {
+        size_t idx = header->s.size - 1;
+        tcache_push(tc, idx, header);
+        if (tc->counts[idx] > TCACHE_COUNT)
+            tcache_flush(tc, idx, TCACHE_BATCH);
+        return;
+    }
+
+    pthread_mutex_lock(&heap_lock);
+    heap_release(header);
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/* small blocks count the size of their slot as requested, as that is all a slab remembers */
+static void *slab_alloc(size_t n_bytes) {
+    tcache_t *tc = tcache_get();
+    if (!tc)
+        return NULL;
+
+    size_t size_class = slab_class(n_bytes);
+    slab_t *slab = tc->slabs[size_class];
+    void *mem;
+    while (!slab || !(mem = slab_take(slab))) {
+        if (!(slab = slab_refill(&tc->slabs[size_class], size_class)))
+            return NULL;
+    }
+
+    count_allocations(1, slab->slot_size);
+    return mem;
+}
+
+static void slab_free(slab_t *slab, void *ptr) {
+    size_t idx = (size_t) slab_slot(slab, ptr);
+    uint64_t bit = 1ULL << (idx % 64);
+    poison(ptr, slab->slot_size);
+
+    /* validate_ptr checked the slot, but two threads may free it at the same time */
+    if (atomic_fetch_or(&slab->free_map[idx / 64], bit) & bit) {
+        fprintf(stderr, "free_mem: double free detected at %p\n", ptr);
+        return;
+    }
+    atomic_store_explicit(&slab->hint, (uint16_t) idx, memory_order_relaxed);
+    count_allocations((size_t) -1, -(size_t) slab->slot_size);
+
+    size_t free_slots = atomic_fetch_add(&slab->free_slots, 1) + 1;
+    int state = atomic_load(&slab->state);
+    if (state == SLAB_FULL || (state == SLAB_PARTIAL && free_slots == slab->slots)) {
+        pthread_mutex_lock(&heap_lock);
+        slab_relist(slab);
+        pthread_mutex_unlock(&heap_lock);
+    }
+}
+
+static header_t *block_alloc(size_t n_bytes) {
+    if (ALLOC_HARDENING == ALLOC_DEBUG)
+        return guarded_alloc(n_bytes, 0);
+    if (n_bytes >= MMAP_THRESHOLD)
+        return mmap_alloc(n_bytes, sizeof(header_t));
+
+    size_t n_units = bytes_to_units(n_bytes);
+
+    header_t *block = NULL;
+    tcache_t *tc = n_units <= TCACHE_MAX_UNITS ? tcache_get() : NULL;
+    if (tc) {
+        size_t idx = n_units - 1;
+        if (!tc->bins[idx])
+            tcache_refill(tc, n_units);
+        block = tcache_pop(tc, idx);
+    } else {
+        pthread_mutex_lock(&heap_lock);
+        block = heap_alloc(n_units);
+        pthread_mutex_unlock(&heap_lock);
+    }
+
+    if (!block)
+        return NULL;
+
+    block->s.magic = MAGIC_ALLOCATED;
+    return block;
+}
+
+void free_mem(void *ptr) {
+    if (!ptr)
+        return;
+    if (!validate_ptr(ptr, "free_mem"))
+        return;
+
+    slab_t *slab = slab_of(ptr);
+    if (slab) {
+        slab_free(slab, ptr);
+        return;
+    }
+
+    header_t *ptr_header = (header_t *) ptr - 1;
+    count_requested(ptr_header, (size_t) -1, 0);
+    sample_free(ptr_header);
+    block_free(ptr_header);
+}
+
+/* a sampled allocation needs a header to keep its sample in, so it never comes from a slab */
 void *alloc_mem(size_t n_bytes) {
-    size_t n_units = (n_bytes + sizeof(header_t) - 1) / sizeof(header_t) + 1;
+    prof_sample_t *sample = sample_alloc(n_bytes);
+    if (ALLOC_HARDENING != ALLOC_DEBUG && n_bytes <= SLAB_MAX_SIZE && !sample) {
+        void *mem = slab_alloc(n_bytes);
+        if (mem)
+            return mem;
+    }
 
-    if (!freep) {
-        base.s.next = freep = &base;
-        base.s.size = 0;
+    header_t *block = block_alloc(n_bytes);
+    if (!block) {
+        if (sample)
+            profiler_release(sample);
+        return NULL;
     }
 
-    header_t *prev = freep;
-    for (header_t *curr = prev->s.next;; prev = curr, curr = curr->s.next) {
-        if (curr->s.size >= n_units) {
-            if (curr->s.size == n_units) {
-                prev->s.next = curr->s.next;
-            } else {
-                curr->s.size -= n_units;
-                curr += curr->s.size;
-                curr->s.size = n_units;
-            }
+    block->s.requested = 0;
+    count_requested(block, 1, n_bytes);
+    block->s.sample = sample;
+    return (void *) (block + 1);
+}
+
+/* shrinks a heap block in place, or grows it over the free block that follows it; returns 0 when
+ * the block has to move instead */
+static int heap_resize(header_t *header, size_t n_units) {
+    if (n_units <= header->s.size) {
+        if (header->s.size - n_units < MIN_BLOCK_UNITS)
+            return 1;
+
+        header_t *rest = header + n_units;
+        rest->s.size = header->s.size - n_units;
+        rest->s.flags = 0;
+        rest->s.prev_free = 0;
+        header->s.size = n_units;
+        block_free(rest);
+        return 1;
+    }
+
+    int grown = 0;
+    pthread_mutex_lock(&heap_lock);
 
-            freep = prev;
-            curr->s.magic = MAGIC_ALLOCATED;
-            return (void *) (curr + 1);
+    header_t *next = header + header->s.size;
+    if ((next->s.flags & BLOCK_BINNED) && header->s.size + next->s.size >= n_units) {
+        bin_unlink(next);
+        size_t total = header->s.size + next->s.size;
+
+        if (total - n_units >= MIN_BLOCK_UNITS) {
+            header_t *rest = header + n_units;
+            rest->s.size = total - n_units;
+            rest->s.magic = MAGIC_FREED;
+            rest->s.flags = 0;
+            rest->s.prev_free = 0;
+            set_footer(rest);
+            bin_push(rest);
+            header->s.size = n_units;
+        } else {
+            header->s.size = total;
+            (header + total)->s.prev_free = 0;
         }
+        grown = 1;
+    }
+
+    pthread_mutex_unlock(&heap_lock);
+    return grown;
+}
+
+int alloc_huge_pages(int enable) {
+    int rc = 0;
+    pthread_mutex_lock(&heap_lock);
+    huge_pages = enable;
+    for (region_t *region = regions; region; region = region->next)
+        if (madvise(region, HEAP_REGION_SIZE, enable ? MADV_HUGEPAGE : MADV_NOHUGEPAGE) != 0)
+            rc = -1;
+    pthread_mutex_unlock(&heap_lock);
+
+    return rc;
+}
+
+size_t trim_mem(size_t pad) {
+    pthread_mutex_lock(&heap_lock);
+    size_t released = heap_trim(pad);
+    pthread_mutex_unlock(&heap_lock);
+
+    return released;
+}
+
+/* heap headers are aligned to their own size, so an aligned heap block is found by over-allocating
+ * by the alignment plus room for a leading free block, and freeing what is left in front of and
+ * behind it */
+void *alloc_aligned_mem(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)))
+        return NULL;
+    /* only slots of at least SLAB_ALIGN bytes are aligned to it */
+    if (alignment <= SLAB_ALIGN)
+        return alloc_mem(size < alignment ? alignment : size);
+
+    header_t *header;
+    size_t slack = alignment + MIN_BLOCK_UNITS * sizeof(header_t);
+    if (ALLOC_HARDENING == ALLOC_DEBUG) {
+        header = guarded_alloc(size, alignment);
+        if (!header)
+            return NULL;
+    } else if (alignment <= sizeof(header_t)) {
+        header = block_alloc(size);
+        if (!header)
+            return NULL;
+    } else if (slack >= MMAP_THRESHOLD || size >= MMAP_THRESHOLD - slack) {
+        header = mmap_alloc(size, alignment);
+        if (!header)
+            return NULL;
+    } else {
+        header = block_alloc(size + slack);
+        if (!header)
+            return NULL;
+
+        size_t lead = 0;
+        while ((uintptr_t) (header + lead + 1) % alignment != 0 || lead == 1)
+            lead++;
 
-        if (curr == freep) {
-            if (more_mem(n_units) == NULL)
-                return NULL;
+        if (lead > 0) {
+            header_t *aligned = header + lead;
+            aligned->s.size = header->s.size - lead;
+            aligned->s.magic = MAGIC_ALLOCATED;
+            aligned->s.flags = 0;
+            aligned->s.prev_free = 0;
+            header->s.size = lead;
+            block_free(header);
+            header = aligned;
         }
+
+        heap_resize(header, bytes_to_units(size));
     }
+
+    header->s.requested = 0;
+    count_requested(header, 1, size);
+    header->s.sample = sample_alloc(size);
+    return (void *) (header + 1);
+}
+
+size_t usable_size_mem(void *ptr) {
+    if (!validate_ptr(ptr, "usable_size_mem"))
+        return 0;
+
+    slab_t *slab = slab_of(ptr);
+    if (slab)
+        return slab->slot_size;
+    return block_usable((header_t *) ptr - 1);
+}
+
+/* only fresh mappings come zeroed */
+static int needs_zeroing(void *mem) {
+    return slab_of(mem) || !(((header_t *) mem - 1)->s.flags & BLOCK_MMAPPED);
+}
+
+void *calloc_aligned_mem(size_t alignment, size_t nmemb, size_t size) {
+    if (nmemb != 0 && size > SIZE_MAX / nmemb)
+        return NULL;
+
+    size_t total = nmemb * size;
+    void *mem = alloc_aligned_mem(alignment, total);
+    if (mem != NULL && needs_zeroing(mem))
+        memset(mem, 0, total);
+
+    return mem;
 }
 
 void *calloc_mem(size_t nmemb, size_t size) {
@@ -143,7 +1480,7 @@ void *calloc_mem(size_t nmemb, size_t size) {
 
     size_t total = nmemb * size;
     void *mem = alloc_mem(total);
-    if (mem != NULL)
+    if (mem != NULL && needs_zeroing(mem))
         memset(mem, 0, total);
 
     return mem;
@@ -151,13 +1488,183 @@ void *calloc_mem(size_t nmemb, size_t size) {
 
 void *realloc_mem(void *ptr, size_t size) {
     if (!ptr)
-        ptr = alloc_mem(size);
+        return alloc_mem(size);
     if (!validate_ptr(ptr, "realloc_mem"))
         return NULL;
 
+    size_t old_size;
+    slab_t *slab = slab_of(ptr);
+    if (slab) {
+        if (size > 0 && size <= SLAB_MAX_SIZE && slab_class(size) == slab->size_class)
+            return ptr;
+        old_size = slab->slot_size;
+    } else {
+        header_t *header = (header_t *) ptr - 1;
+        if (header->s.flags & BLOCK_MMAPPED) {
+            if (size >= MMAP_THRESHOLD && !(header->s.flags & BLOCK_GUARDED)) {
+                /* the profiler sees a resize as a free and a new allocation */
+                sample_free(header);
+                void *mem = mmap_resize(header, size);
+                if (mem) {
+                    count_requested((header_t *) mem - 1, 0, size);
+                    ((header_t *) mem - 1)->s.sample = sample_alloc(size);
+                }
+                return mem;
+            }
+        } else if (size > 0 && size < MMAP_THRESHOLD &&
+                   heap_resize(header, bytes_to_units(size))) {
+            count_requested(header, 0, size);
+            sample_free(header);
+            header->s.sample = sample_alloc(size);
+            return ptr;
+        }
+        old_size = block_usable(header);
+    }
+
     void *new_mem = alloc_mem(size);
-    memcpy(new_mem, ptr, size);
+    if (!new_mem)
+        return NULL;
+
+    memcpy(new_mem, ptr, old_size < size ? old_size : size);
     free_mem(ptr);
 
     return new_mem;
 }
+
+/* the largest free block sits in the highest non-empty bin */
+static size_t largest_free_units(void) {
+    for (size_t w = BINMAP_WORDS; w-- > 0;) {
+        if (!binmap[w])
+            continue;
+
+        size_t idx = w * 64 + 63 - __builtin_clzll(binmap[w]);
+        size_t largest = 0;
+        for (header_t *block = bins[idx]; block; block = block->s.next)
+            if (block->s.size > largest)
+                largest = block->s.size;
+        return largest;
+    }
+    return 0;
+}
+
+static size_t histogram_bucket(size_t n_bytes) {
+    size_t log2 = sizeof(unsigned long long) * 8 - 1 - __builtin_clzll(n_bytes);
+    return log2 < ALLOC_HISTOGRAM_BUCKETS ? log2 : ALLOC_HISTOGRAM_BUCKETS - 1;
+}
+
+void alloc_stats(alloc_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    size_t cached_units = 0;
+
+    pthread_mutex_lock(&heap_lock);
+    stats->live_allocations = atomic_load(&exited_counters.allocations);
+    stats->requested_bytes = atomic_load(&exited_counters.requested);
+    for (tcache_t *tc = tcaches; tc; tc = tc->next_cache) {
+        stats->live_allocations += atomic_load_explicit(&tc->counters.allocations,
+                                                        memory_order_relaxed);
+        stats->requested_bytes += atomic_load_explicit(&tc->counters.requested,
+                                                       memory_order_relaxed);
+        stats->cached_blocks += atomic_load_explicit(&tc->counters.cached_blocks,
+                                                     memory_order_relaxed);
+        cached_units += atomic_load_explicit(&tc->counters.cached_units, memory_order_relaxed);
+    }
+    stats->cached_bytes = cached_units * sizeof(header_t);
+
+    stats->heap_bytes = heap_bytes;
+    stats->mmap_bytes = mmap_bytes;
+    stats->mmap_blocks = mmap_blocks;
+    stats->slab_bytes = (size_t) ((char *) slab_top - (char *) slab_start) -
+                        released_count * SLAB_SIZE;
+    stats->free_blocks = free_blocks;
+    stats->free_bytes = free_units * sizeof(header_t);
+    stats->largest_free_block = largest_free_units() * sizeof(header_t);
+
+    /* large bins hold a power of two each, which is exactly a histogram bucket */
+    for (size_t idx = 0; idx < NBINS; idx++) {
+        size_t n_units = idx + 1;
+        if (idx >= SMALL_BIN_UNITS)
+            n_units = (size_t) 1 << (idx - SMALL_BIN_UNITS + SMALL_BIN_SHIFT);
+        stats->free_histogram[histogram_bucket(n_units * sizeof(header_t))] += bin_counts[idx];
+    }
+    pthread_mutex_unlock(&heap_lock);
+
+    if (stats->free_bytes > 0)
+        stats->fragmentation = 1.0 - (double) stats->largest_free_block / stats->free_bytes;
+}
+
+static void heap_report(header_t *header, const char *problem) {
+    fprintf(stderr, "heap_check: %s at %p\n", problem, (void *) (header + 1));
+}
+
+/* a released slab reads as zeroes */
+static int slab_is_consistent(slab_t *slab) {
+    if (slab->magic == 0)
+        return 1;
+    if (slab->magic != MAGIC_SLAB || slab->size_class >= SLAB_CLASSES ||
+        slab->slot_size != slab_sizes[slab->size_class])
+        return 0;
+
+    size_t free_slots = 0;
+    for (size_t w = 0; w < SLAB_MAP_WORDS; w++)
+        free_slots += __builtin_popcountll(atomic_load(&slab->free_map[w]));
+    return free_slots == atomic_load(&slab->free_slots);
+}
+
+size_t heap_check(void) {
+    size_t problems = 0;
+
+    pthread_mutex_lock(&heap_lock);
+    for (header_t *block = first_chunk; block; block = block->s.next) {
+        uint16_t prev_free = 0;
+        for (; !(block->s.flags & BLOCK_FENCE); block += block->s.size) {
+            if (block->s.magic != MAGIC_ALLOCATED && block->s.magic != MAGIC_FREED) {
+                heap_report(block, "bad magic");
+                problems++;
+            }
+            /* with a bad size there is no way to find the next header */
+            header_t *next = block + block->s.size;
+            if (block->s.size < MIN_BLOCK_UNITS || (char *) (next + 1) > region_of(block)->brk) {
+                heap_report(block, "bad size");
+                pthread_mutex_unlock(&heap_lock);
+                return problems + 1;
+            }
+            if (block->s.prev_free != prev_free) {
+                heap_report(block, "stale free neighbour tag");
+                problems++;
+            }
+
+            prev_free = (block->s.flags & BLOCK_BINNED) != 0;
+            if (prev_free && (block->s.magic != MAGIC_FREED ||
+                              ((size_t *) next)[-1] != block->s.size)) {
+                heap_report(block, "bad free block");
+                problems++;
+            }
+        }
+
+        if (block->s.magic != MAGIC_ALLOCATED || block->s.prev_free != prev_free) {
+            heap_report(block, "bad fence");
+            problems++;
+        }
+    }
+
+    for (mmap_chunk_t *chunk = mmap_chunks; chunk; chunk = chunk->next) {
+        header_t *header = (header_t *) (chunk + 1);
+        if (header->s.magic != MAGIC_ALLOCATED) {
+            heap_report(header, "bad magic");
+            problems++;
+        } else if (!(header->s.flags & BLOCK_MMAPPED)) {
+            heap_report(header, "bad mapped block");
+            problems++;
+        }
+    }
+
+    for (char *page = slab_start; page < (char *) slab_top; page += SLAB_SIZE) {
+        if (!slab_is_consistent((slab_t *) page)) {
+            fprintf(stderr, "heap_check: bad slab at %p\n", (void *) page);
+            problems++;
+        }
+    }
+    pthread_mutex_unlock(&heap_lock);
+
+    return problems;
+}
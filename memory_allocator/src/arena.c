@@ -0,0 +1,153 @@
+#include "arena.h"
+#include "allocator.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define ARENA_DEFAULT_CHUNK (256 * 1024)
+#define ARENA_MIN_CHUNK 64
+#define ARENA_ALIGN 16
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+} arena_chunk_t;
+
+struct arena {
+    arena_chunk_t *chunks;
+    arena_chunk_t *spare;
+    size_t chunk_size;
+};
+
+static char *chunk_data(arena_chunk_t *chunk) {
+    return (char *) (chunk + 1);
+}
+
+static arena_chunk_t *chunk_create(size_t size) {
+    if (size > SIZE_MAX - sizeof(arena_chunk_t))
+        return NULL;
+
+    arena_chunk_t *chunk = alloc_mem(sizeof(arena_chunk_t) + size);
+    if (!chunk)
+        return NULL;
+
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+/* offset of the next ARENA_ALIGN-aligned address in chunk */
+static size_t chunk_offset(arena_chunk_t *chunk) {
+    uintptr_t p = (uintptr_t) (chunk_data(chunk) + chunk->used);
+    return chunk->used + ((ARENA_ALIGN - p % ARENA_ALIGN) % ARENA_ALIGN);
+}
+
+arena_t *arena_create(size_t chunk_size) {
+    arena_t *arena = alloc_mem(sizeof(arena_t));
+    if (!arena)
+        return NULL;
+
+    arena->chunks = NULL;
+    arena->spare = NULL;
+    arena->chunk_size = chunk_size ? chunk_size : ARENA_DEFAULT_CHUNK;
+    if (arena->chunk_size < ARENA_MIN_CHUNK)
+        arena->chunk_size = ARENA_MIN_CHUNK;
+    return arena;
+}
+
+void arena_destroy(arena_t *arena) {
+    if (!arena)
+        return;
+
+    arena_reset(arena);
+    while (arena->spare) {
+        arena_chunk_t *next = arena->spare->next;
+        free_mem(arena->spare);
+        arena->spare = next;
+    }
+
+    free_mem(arena);
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+    if (!arena)
+        return NULL;
+
+    arena_chunk_t *chunk = arena->chunks;
+    if (chunk) {
+        size_t offset = chunk_offset(chunk);
+        if (offset <= chunk->size && size <= chunk->size - offset) {
+            chunk->used = offset + size;
+            return chunk_data(chunk) + offset;
+        }
+    }
+
+    /* oversized requests go behind the current chunk so its free space stays usable */
+    if (size > arena->chunk_size / 2) {
+        if (size > SIZE_MAX - ARENA_ALIGN)
+            return NULL;
+
+        arena_chunk_t *big = chunk_create(size + ARENA_ALIGN);
+        if (!big)
+            return NULL;
+
+        if (chunk) {
+            big->next = chunk->next;
+            chunk->next = big;
+        } else {
+            arena->chunks = big;
+        }
+
+        big->used = chunk_offset(big) + size;
+        return chunk_data(big) + big->used - size;
+    }
+
+    if (arena->spare) {
+        chunk = arena->spare;
+        arena->spare = chunk->next;
+    } else {
+        chunk = chunk_create(arena->chunk_size);
+        if (!chunk)
+            return NULL;
+    }
+
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+
+    size_t offset = chunk_offset(chunk);
+    chunk->used = offset + size;
+    return chunk_data(chunk) + offset;
+}
+
+void *arena_dup(arena_t *arena, const void *src, size_t size) {
+    if (!src)
+        return NULL;
+
+    void *dest = arena_alloc(arena, size);
+    if (!dest)
+        return NULL;
+
+    memcpy(dest, src, size);
+    return dest;
+}
+
+void arena_reset(arena_t *arena) {
+    if (!arena)
+        return;
+
+    while (arena->chunks) {
+        arena_chunk_t *chunk = arena->chunks;
+        arena->chunks = chunk->next;
+
+        if (chunk->size != arena->chunk_size) {
+            free_mem(chunk);
+            continue;
+        }
+
+        chunk->used = 0;
+        chunk->next = arena->spare;
+        arena->spare = chunk;
+    }
+}
@@ -0,0 +1,209 @@
+#include "pool.h"
+#include "allocator.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define POOL_DEFAULT_SLAB (64 * 1024)
+#define POOL_ALIGN sizeof(void *)
+
+typedef struct free_obj {
+    struct free_obj *next;
+} free_obj_t;
+
+typedef struct pool_slab {
+    struct pool_slab *next;
+} pool_slab_t;
+
+struct pool {
+    free_obj_t *free_list;
+    char *bump;
+    char *bump_end;
+    pool_slab_t *slabs;
+    size_t object_size;
+    size_t objects_per_slab;
+    size_t slab_count;
+    size_t in_use;
+};
+
+typedef struct {
+    pool_slab_t *slab;
+    size_t free;
+} slab_usage_t;
+
+static char *slab_objects(pool_slab_t *slab) {
+    return (char *) (slab + 1);
+}
+
+pool_t *pool_create(size_t object_size, size_t objects_per_slab) {
+    if (object_size < sizeof(free_obj_t))
+        object_size = sizeof(free_obj_t);
+    if (object_size > SIZE_MAX - POOL_ALIGN)
+        return NULL;
+    object_size = (object_size + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1);
+
+    if (objects_per_slab == 0)
+        objects_per_slab = POOL_DEFAULT_SLAB / object_size;
+    if (objects_per_slab == 0)
+        objects_per_slab = 1;
+    if (objects_per_slab > (SIZE_MAX - sizeof(pool_slab_t)) / object_size)
+        return NULL;
+
+    pool_t *pool = calloc_mem(1, sizeof(pool_t));
+    if (!pool)
+        return NULL;
+
+    pool->object_size = object_size;
+    pool->objects_per_slab = objects_per_slab;
+    return pool;
+}
+
+static void release_all(pool_t *pool) {
+    while (pool->slabs) {
+        pool_slab_t *next = pool->slabs->next;
+        free_mem(pool->slabs);
+        pool->slabs = next;
+    }
+
+    pool->free_list = NULL;
+    pool->bump = pool->bump_end = NULL;
+    pool->slab_count = 0;
+}
+
+void pool_destroy(pool_t *pool) {
+    if (!pool)
+        return;
+
+    release_all(pool);
+    free_mem(pool);
+}
+
+/* new slabs are handed out by bumping a pointer, so their objects are only touched when used */
+static int pool_grow(pool_t *pool) {
+    size_t bytes = pool->objects_per_slab * pool->object_size;
+    pool_slab_t *slab = alloc_mem(sizeof(pool_slab_t) + bytes);
+    if (!slab)
+        return 0;
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->slab_count++;
+
+    pool->bump = slab_objects(slab);
+    pool->bump_end = pool->bump + bytes;
+    return 1;
+}
+
+void *pool_alloc(pool_t *pool) {
+    free_obj_t *obj = pool->free_list;
+    if (obj) {
+        pool->free_list = obj->next;
+        pool->in_use++;
+        return obj;
+    }
+
+    if (pool->bump == pool->bump_end && !pool_grow(pool))
+        return NULL;
+
+    void *ptr = pool->bump;
+    pool->bump += pool->object_size;
+    pool->in_use++;
+    return ptr;
+}
+
+void pool_free(pool_t *pool, void *ptr) {
+    if (!ptr)
+        return;
+
+    free_obj_t *obj = ptr;
+    obj->next = pool->free_list;
+    pool->free_list = obj;
+    pool->in_use--;
+}
+
+void pool_stats(const pool_t *pool, pool_stats_t *stats) {
+    if (!pool || !stats)
+        return;
+
+    stats->object_size = pool->object_size;
+    stats->objects_per_slab = pool->objects_per_slab;
+    stats->slabs = pool->slab_count;
+    stats->objects_in_use = pool->in_use;
+}
+
+static int compare_slabs(const void *a, const void *b) {
+    uintptr_t sa = (uintptr_t) ((const slab_usage_t *) a)->slab;
+    uintptr_t sb = (uintptr_t) ((const slab_usage_t *) b)->slab;
+    return (sa > sb) - (sa < sb);
+}
+
+static slab_usage_t *find_slab(slab_usage_t *usage, size_t count, const void *ptr) {
+    size_t lo = 0, hi = count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((const void *) usage[mid].slab <= ptr)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return &usage[lo];
+}
+
+/* free objects are only threaded through one intrusive list, so per-slab occupancy is worked out
+ * here instead of being kept up to date on every pool_alloc/pool_free */
+size_t pool_release_empty(pool_t *pool) {
+    if (!pool || pool->slab_count == 0)
+        return 0;
+
+    size_t count = pool->slab_count;
+    if (pool->in_use == 0) {
+        release_all(pool);
+        return count;
+    }
+
+    slab_usage_t *usage = alloc_mem(count * sizeof(slab_usage_t));
+    if (!usage)
+        return 0;
+
+    size_t i = 0;
+    for (pool_slab_t *slab = pool->slabs; slab; slab = slab->next, i++) {
+        usage[i].slab = slab;
+        usage[i].free = 0;
+    }
+    qsort(usage, count, sizeof(slab_usage_t), compare_slabs);
+
+    for (free_obj_t *obj = pool->free_list; obj; obj = obj->next)
+        find_slab(usage, count, obj)->free++;
+    if (pool->bump != pool->bump_end)
+        find_slab(usage, count, pool->bump)->free +=
+            (size_t) (pool->bump_end - pool->bump) / pool->object_size;
+
+    free_obj_t **link = &pool->free_list;
+    while (*link) {
+        if (find_slab(usage, count, *link)->free == pool->objects_per_slab)
+            *link = (*link)->next;
+        else
+            link = &(*link)->next;
+    }
+
+    size_t released = 0;
+    pool_slab_t **slab_link = &pool->slabs;
+    while (*slab_link) {
+        pool_slab_t *slab = *slab_link;
+        if (find_slab(usage, count, slab)->free != pool->objects_per_slab) {
+            slab_link = &slab->next;
+            continue;
+        }
+
+        if (pool->bump_end == slab_objects(slab) + pool->objects_per_slab * pool->object_size)
+            pool->bump = pool->bump_end = NULL;
+
+        *slab_link = slab->next;
+        free_mem(slab);
+        released++;
+    }
+
+    pool->slab_count -= released;
+    free_mem(usage);
+    return released;
+}
@@ -0,0 +1,309 @@
+#define _GNU_SOURCE
+#include "profiler.h"
+#include "allocator.h"
+#include "pool.h"
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROF_DEFAULT_INTERVAL (512 * 1024)
+#define PROF_MAX_DEPTH 32
+
+/* while the profiler is off, threads look again after allocating this many bytes */
+#define PROF_IDLE_INTERVAL (1024 * 1024)
+
+struct prof_sample {
+    struct prof_sample *next;
+    struct prof_sample *prev;
+    size_t size;
+    int depth;
+    void *stack[PROF_MAX_DEPTH];
+};
+
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic size_t sample_interval = 0;
+static _Atomic size_t last_interval = PROF_DEFAULT_INTERVAL;
+
+/* protected by prof_lock */
+static pool_t *sample_pool = NULL;
+static prof_sample_t *samples = NULL;
+static size_t sample_count = 0;
+static char *dump_path = NULL;
+static int dump_thread_started = 0;
+
+static sem_t dump_requests;
+
+/* set while the profiler itself allocates, so that it never samples its own blocks */
+static _Thread_local int busy = 0;
+static _Thread_local int armed = 0;
+static _Thread_local uint64_t rng = 0;
+
+/* the gaps between samples are exponentially distributed, which gives every allocated byte the
+ * same chance of being sampled */
+static size_t next_interval(size_t interval) {
+    if (rng == 0)
+        rng = ((uint64_t) (uintptr_t) &rng ^ ((uint64_t) time(NULL) << 32)) | 1;
+
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    double u = (double) ((rng * 0x2545F4914F6CDD1DULL) >> 11) / (double) (1ULL << 53);
+
+    return (size_t) (-log(1.0 - u) * (double) interval) + 1;
+}
+
+prof_sample_t *profiler_record(size_t size, size_t *next) {
+    size_t interval = atomic_load_explicit(&sample_interval, memory_order_relaxed);
+    if (interval == 0) {
+        armed = 0;
+        *next = PROF_IDLE_INTERVAL;
+        return NULL;
+    }
+
+    *next = next_interval(interval);
+
+    /* a thread that was only polling starts with a fresh countdown instead of sampling at once */
+    if (!armed || busy) {
+        armed = 1;
+        return NULL;
+    }
+
+    busy = 1;
+    void *stack[PROF_MAX_DEPTH + 1];
+    int depth = backtrace(stack, PROF_MAX_DEPTH + 1);
+
+    pthread_mutex_lock(&prof_lock);
+    prof_sample_t *sample = sample_pool ? pool_alloc(sample_pool) : NULL;
+    if (sample) {
+        /* the innermost frame is this function */
+        sample->depth = depth > 1 ? depth - 1 : 0;
+        memcpy(sample->stack, stack + 1, sample->depth * sizeof(void *));
+        sample->size = size;
+
+        sample->prev = NULL;
+        sample->next = samples;
+        if (samples)
+            samples->prev = sample;
+        samples = sample;
+        sample_count++;
+    }
+    pthread_mutex_unlock(&prof_lock);
+    busy = 0;
+
+    return sample;
+}
+
+void profiler_release(prof_sample_t *sample) {
+    pthread_mutex_lock(&prof_lock);
+    if (sample->prev)
+        sample->prev->next = sample->next;
+    else
+        samples = sample->next;
+    if (sample->next)
+        sample->next->prev = sample->prev;
+    sample_count--;
+    pool_free(sample_pool, sample);
+    pthread_mutex_unlock(&prof_lock);
+}
+
+static void prof_lock_acquire(void) {
+    pthread_mutex_lock(&prof_lock);
+}
+
+static void prof_lock_release(void) {
+    pthread_mutex_unlock(&prof_lock);
+}
+
+/* the profiler allocates while holding its lock, so forking takes it before the heap lock, whose
+ * handlers were registered first */
+__attribute__((constructor)) static void register_fork_handlers(void) {
+    pthread_atfork(prof_lock_acquire, prof_lock_release, prof_lock_release);
+}
+
+int profiler_start(size_t interval) {
+    if (interval == 0)
+        interval = PROF_DEFAULT_INTERVAL;
+
+    /* the first backtrace loads the unwinder, which allocates */
+    void *frame;
+    backtrace(&frame, 1);
+
+    busy = 1;
+    pthread_mutex_lock(&prof_lock);
+    if (!sample_pool)
+        sample_pool = pool_create(sizeof(prof_sample_t), 0);
+    int ok = sample_pool != NULL;
+    pthread_mutex_unlock(&prof_lock);
+    busy = 0;
+
+    if (!ok) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    atomic_store(&last_interval, interval);
+    atomic_store(&sample_interval, interval);
+    return 0;
+}
+
+void profiler_stop(void) {
+    atomic_store(&sample_interval, 0);
+}
+
+static int compare_stacks(const void *a, const void *b) {
+    const prof_sample_t *x = a, *y = b;
+    if (x->depth != y->depth)
+        return x->depth < y->depth ? -1 : 1;
+
+    return memcmp(x->stack, y->stack, x->depth * sizeof(void *));
+}
+
+static int write_maps(int fd) {
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps < 0)
+        return -1;
+
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(maps, buf, sizeof(buf))) > 0) {
+        if (write(fd, buf, (size_t) n) != n) {
+            n = -1;
+            break;
+        }
+    }
+
+    int saved = errno;
+    close(maps);
+    errno = saved;
+    return n < 0 ? -1 : 0;
+}
+
+/* takes a copy of the samples so that the locks are not held while writing */
+static prof_sample_t *snapshot(size_t *count) {
+    pthread_mutex_lock(&prof_lock);
+    prof_sample_t *copy = alloc_mem((sample_count ? sample_count : 1) * sizeof(prof_sample_t));
+    *count = 0;
+    for (prof_sample_t *s = samples; copy && s; s = s->next)
+        copy[(*count)++] = *s;
+    pthread_mutex_unlock(&prof_lock);
+
+    return copy;
+}
+
+int profiler_dump(int fd) {
+    busy = 1;
+    size_t count;
+    prof_sample_t *copy = snapshot(&count);
+    if (!copy) {
+        busy = 0;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    qsort(copy, count, sizeof(prof_sample_t), compare_stacks);
+
+    size_t total_bytes = 0;
+    for (size_t i = 0; i < count; i++)
+        total_bytes += copy[i].size;
+
+    int rc = dprintf(fd, "heap profile: %zu: %zu [0: 0] @ heap_v2/%zu\n", count, total_bytes,
+                     atomic_load(&last_interval));
+
+    for (size_t i = 0, next; rc >= 0 && i < count; i = next) {
+        size_t bytes = 0;
+        for (next = i; next < count && compare_stacks(&copy[i], &copy[next]) == 0; next++)
+            bytes += copy[next].size;
+
+        rc = dprintf(fd, "%6zu: %8zu [0: 0] @", next - i, bytes);
+        for (int f = 0; rc >= 0 && f < copy[i].depth; f++)
+            rc = dprintf(fd, " %p", copy[i].stack[f]);
+        if (rc >= 0)
+            rc = dprintf(fd, "\n");
+    }
+
+    if (rc >= 0)
+        rc = dprintf(fd, "\nMAPPED_LIBRARIES:\n");
+    if (rc >= 0)
+        rc = write_maps(fd);
+
+    free_mem(copy);
+    busy = 0;
+    return rc < 0 ? -1 : 0;
+}
+
+static void dump_signal_handler(int signo) {
+    (void) signo;
+    int saved = errno;
+    sem_post(&dump_requests);
+    errno = saved;
+}
+
+/* dumping takes locks and allocates, which a signal handler must not do, so the handler only
+ * wakes this thread up */
+static void *dump_loop(void *arg) {
+    (void) arg;
+    for (;;) {
+        while (sem_wait(&dump_requests) != 0)
+            ;
+
+        pthread_mutex_lock(&prof_lock);
+        int fd = open(dump_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        pthread_mutex_unlock(&prof_lock);
+
+        if (fd >= 0) {
+            profiler_dump(fd);
+            close(fd);
+        }
+    }
+    return NULL;
+}
+
+int profiler_dump_on_signal(int signo, const char *path) {
+    size_t len = strlen(path) + 1;
+    char *copy = alloc_mem(len);
+    if (!copy) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(copy, path, len);
+
+    pthread_mutex_lock(&prof_lock);
+    char *old = dump_path;
+    dump_path = copy;
+
+    int err = 0;
+    if (!dump_thread_started) {
+        pthread_t thread;
+        sem_init(&dump_requests, 0, 0);
+        err = pthread_create(&thread, NULL, dump_loop, NULL);
+        if (err == 0) {
+            pthread_detach(thread);
+            dump_thread_started = 1;
+        }
+    }
+    pthread_mutex_unlock(&prof_lock);
+
+    free_mem(old);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = dump_signal_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    return sigaction(signo, &sa, NULL);
+}
@@ -1,7 +1,12 @@
 #include "allocator.h"
 #include "test.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 TEST(alloc_mem_returns_non_null) {
@@ -56,6 +61,7 @@ TEST(free_mem_success) {
     free(out);
 }
 
+#if ALLOC_HARDENING >= ALLOC_HARDENED
 TEST(free_stack_address_logs_error) {
     int s, r;
     capture_stderr_start(&s, &r);
@@ -68,6 +74,9 @@ TEST(free_stack_address_logs_error) {
     free(out);
 }
 
+#endif
+
+#if ALLOC_HARDENING < ALLOC_DEBUG
 TEST(free_mem_offset_pointer_logs_error) {
     int s, r;
     capture_stderr_start(&s, &r);
@@ -86,18 +95,18 @@ TEST(free_mem_unallocated_heap_logs_error) {
     int s, r;
     capture_stderr_start(&s, &r);
 
-    char *p = alloc_mem(32);
+    char *p = alloc_mem(1000);
     ASSERT_NOT_NULL("p should not be null", p);
+    free_mem(p);
 
-    char *pp = (char *) sbrk(0);
-
-    free_mem(pp - 10);
+    free_mem(p + 500);
 
     char *out = capture_stderr_end(s, r);
     ASSERT_STR_MATCH("free_mem for unallocated heap address should log error", out,
                      "heap corruption");
     free(out);
 }
+#endif
 
 TEST(double_free_logs_error) {
     char *p = alloc_mem(32);
@@ -114,6 +123,7 @@ TEST(double_free_logs_error) {
     free(out);
 }
 
+#if ALLOC_HARDENING == ALLOC_HARDENED
 TEST(use_after_free) {
     char *p = alloc_mem(10);
     ASSERT_NOT_NULL("p should not be null", p);
@@ -125,6 +135,7 @@ TEST(use_after_free) {
 
     ASSERT_MEM_EQUAL("memory should be filled with poison for UAF", expected, p, 10);
 }
+#endif
 
 TEST(calloc_mem_success) {
     int *p = calloc_mem(10, sizeof(int));
@@ -143,6 +154,7 @@ TEST(realloc_mem_success) {
     ASSERT_STR_EQUAL("p2 should have the same content from p1", "ABCDEFGHIJ\0", p2, 11);
 }
 
+#if ALLOC_HARDENING == ALLOC_HARDENED
 TEST(realloc_zero_size) {
     char *p = alloc_mem(32);
     ASSERT_NOT_NULL("p should not be null", p);
@@ -155,7 +167,9 @@ TEST(realloc_zero_size) {
 
     ASSERT_MEM_EQUAL("pointer passed to realloc_mem should have posion memory", expected, p, 32);
 }
+#endif
 
+#if ALLOC_HARDENING >= ALLOC_HARDENED
 TEST(realloc_mem_stack_address_logs_error) {
     int s, r;
     capture_stderr_start(&s, &r);
@@ -168,6 +182,9 @@ TEST(realloc_mem_stack_address_logs_error) {
     free(out);
 }
 
+#endif
+
+#if ALLOC_HARDENING < ALLOC_DEBUG
 TEST(realloc_mem_offset_pointer_logs_error) {
     int s, r;
     capture_stderr_start(&s, &r);
@@ -186,18 +203,18 @@ TEST(realloc_mem_unallocated_heap_logs_error) {
     int s, r;
     capture_stderr_start(&s, &r);
 
-    char *p = alloc_mem(32);
+    char *p = alloc_mem(1000);
     ASSERT_NOT_NULL("p should not be null", p);
+    free_mem(p);
 
-    char *pp = (char *) sbrk(0);
-
-    realloc_mem(pp - 10, 40);
+    realloc_mem(p + 500, 40);
 
     char *out = capture_stderr_end(s, r);
     ASSERT_STR_MATCH("realloc_mem for unallocated heap address should log error", out,
                      "heap corruption");
     free(out);
 }
+#endif
 
 TEST(realloc_mem_freed_pointer_logs_error) {
     char *p = alloc_mem(32);
@@ -213,3 +230,657 @@ TEST(realloc_mem_freed_pointer_logs_error) {
     ASSERT_STR_MATCH("realloc_mem for freed pointer should log error", out, "double free");
     free(out);
 }
+
+#if ALLOC_HARDENING < ALLOC_DEBUG
+TEST(free_mem_small_block_is_reused) {
+    char *p = alloc_mem(40);
+    ASSERT_NOT_NULL("p should not be null", p);
+    free_mem(p);
+
+    char *q = alloc_mem(40);
+    ASSERT_PTR_EQUAL("same size class should reuse the freed block", p, q);
+    free_mem(q);
+}
+
+TEST(free_mem_small_blocks_do_not_mix_classes) {
+    char *p = alloc_mem(40);
+    ASSERT_NOT_NULL("p should not be null", p);
+    free_mem(p);
+
+    char *q = alloc_mem(200);
+    ASSERT_NOT_NULL("q should not be null", q);
+    ASSERT_PTR_NOT_EQUAL("bigger size class should not take the small block", p, q);
+
+    char *r = alloc_mem(40);
+    ASSERT_PTR_EQUAL("small block should still be available", p, r);
+    free_mem(q);
+    free_mem(r);
+}
+
+TEST(free_mem_coalesces_small_blocks) {
+    char *blocks[64];
+    for (int i = 0; i < 64; i++) {
+        blocks[i] = alloc_mem(1100);
+        ASSERT_NOT_NULL("block should not be null", blocks[i]);
+    }
+    for (int i = 0; i < 64; i++)
+        free_mem(blocks[i]);
+
+    alloc_stats_t before, after;
+    alloc_stats(&before);
+    char *big = alloc_mem(32 * 1100);
+    ASSERT_NOT_NULL("big should not be null", big);
+    alloc_stats(&after);
+    ASSERT_ULONG_EQUAL("merged fragments should satisfy a large request", before.heap_bytes,
+                       after.heap_bytes);
+    free_mem(big);
+}
+#endif
+
+TEST(alloc_mem_large_sizes_round_trip) {
+    size_t sizes[] = {1500, 3000, 10000, 70000, 3000, 1500};
+    char *ptrs[6];
+
+    for (int i = 0; i < 6; i++) {
+        ptrs[i] = alloc_mem(sizes[i]);
+        ASSERT_NOT_NULL("large block should not be null", ptrs[i]);
+        memset(ptrs[i], i, sizes[i]);
+    }
+    for (int i = 0; i < 6; i++) {
+        char expected[1500];
+        memset(expected, i, sizeof(expected));
+        ASSERT_MEM_EQUAL("large block should keep its contents", expected, ptrs[i], 1500);
+    }
+    for (int i = 0; i < 6; i++)
+        free_mem(ptrs[i]);
+}
+
+#define THREAD_COUNT 4
+#define THREAD_ROUNDS 2000
+
+static void *alloc_free_worker(void *arg) {
+    unsigned seed = (unsigned) (uintptr_t) arg;
+    unsigned char *live[32] = {0};
+    size_t sizes[32] = {0};
+
+    for (int round = 0; round < THREAD_ROUNDS; round++) {
+        int slot = rand_r(&seed) % 32;
+        if (live[slot]) {
+            for (size_t i = 0; i < sizes[slot]; i++) {
+                if (live[slot][i] != (unsigned char) slot) return (void *) 1;
+            }
+            free_mem(live[slot]);
+        }
+
+        sizes[slot] = 1 + rand_r(&seed) % 2000;
+        live[slot] = alloc_mem(sizes[slot]);
+        if (!live[slot]) return (void *) 1;
+        memset(live[slot], slot, sizes[slot]);
+    }
+
+    for (int slot = 0; slot < 32; slot++)
+        free_mem(live[slot]);
+
+    return NULL;
+}
+
+TEST(alloc_mem_concurrent_threads) {
+    pthread_t threads[THREAD_COUNT];
+    for (int i = 0; i < THREAD_COUNT; i++)
+        pthread_create(&threads[i], NULL, alloc_free_worker, (void *) (uintptr_t) (i + 1));
+
+    int corrupted = 0;
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        void *ret;
+        pthread_join(threads[i], &ret);
+        if (ret) corrupted++;
+    }
+
+    ASSERT_INT_EQUAL("no thread should see corrupted blocks", 0, corrupted);
+}
+
+static void *free_blocks_worker(void *arg) {
+    char **blocks = arg;
+    for (int i = 0; i < 256; i++)
+        free_mem(blocks[i]);
+    return NULL;
+}
+
+TEST(free_mem_from_another_thread) {
+    char *blocks[256];
+    for (int i = 0; i < 256; i++) {
+        blocks[i] = alloc_mem(16 + i % 64);
+        ASSERT_NOT_NULL("block should not be null", blocks[i]);
+    }
+
+    int s, r;
+    capture_stderr_start(&s, &r);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, free_blocks_worker, blocks);
+    pthread_join(thread, NULL);
+
+    char *out = capture_stderr_end(s, r);
+    ASSERT_TRUE("freeing from another thread should not log errors", strlen(out) == 0);
+    free(out);
+
+    capture_stderr_start(&s, &r);
+    free_mem(blocks[0]);
+    out = capture_stderr_end(s, r);
+    ASSERT_STR_MATCH("block freed by another thread should be detected as freed", out,
+                     "double free");
+    free(out);
+}
+
+#if ALLOC_HARDENING < ALLOC_DEBUG
+static void *page_of(void *ptr) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    return (void *) ((uintptr_t) ptr & ~(page - 1));
+}
+
+static int page_is_resident(void *ptr) {
+    unsigned char vec;
+    if (mincore(page_of(ptr), 1, &vec) != 0) return 0;
+    return vec & 1;
+}
+
+TEST(alloc_mem_large_block_is_unmapped_on_free) {
+    size_t size = 1024 * 1024;
+    char *p = alloc_mem(size);
+    ASSERT_NOT_NULL("p should not be null", p);
+    memset(p, 'x', size);
+
+    void *page = page_of(p + size / 2);
+    ASSERT_INT_EQUAL("large block should be mapped", 0,
+                     msync(page, (size_t) sysconf(_SC_PAGESIZE), MS_ASYNC));
+
+    free_mem(p);
+
+    int ret = msync(page, (size_t) sysconf(_SC_PAGESIZE), MS_ASYNC);
+    ASSERT_TRUE("large block should be unmapped after free", ret == -1 && errno == ENOMEM);
+}
+#endif
+
+TEST(calloc_mem_large_block_is_zeroed) {
+    size_t count = 64 * 1024;
+    int *p = calloc_mem(count, sizeof(int));
+    ASSERT_NOT_NULL("p should not be null", p);
+
+    int zero = 1;
+    for (size_t i = 0; i < count; i++) {
+        if (p[i] != 0) zero = 0;
+    }
+    ASSERT_TRUE("large calloc_mem block should be zeroed", zero);
+    free_mem(p);
+}
+
+TEST(realloc_mem_large_block_keeps_contents) {
+    size_t size = 256 * 1024;
+    char *p = alloc_mem(size);
+    ASSERT_NOT_NULL("p should not be null", p);
+    memset(p, 'y', size);
+
+    char *q = realloc_mem(p, 4 * size);
+    ASSERT_NOT_NULL("q should not be null", q);
+
+    char expected[4096];
+    memset(expected, 'y', sizeof(expected));
+    ASSERT_MEM_EQUAL("grown block should keep its contents", expected, q + size - 4096, 4096);
+    free_mem(q);
+}
+
+#if ALLOC_HARDENING < ALLOC_DEBUG
+TEST(trim_mem_releases_freed_heap_pages) {
+    char *blocks[64];
+    for (int i = 0; i < 64; i++) {
+        blocks[i] = alloc_mem(64 * 1024);
+        ASSERT_NOT_NULL("block should not be null", blocks[i]);
+        memset(blocks[i], 'z', 64 * 1024);
+    }
+
+    char *probe = blocks[32] + 32 * 1024;
+    ASSERT_TRUE("page should be resident while in use", page_is_resident(probe));
+
+    for (int i = 0; i < 64; i++)
+        free_mem(blocks[i]);
+    trim_mem(0);
+
+    ASSERT_FALSE("freed heap page should not stay resident", page_is_resident(probe));
+}
+
+TEST(realloc_mem_shrinks_in_place) {
+    char *p = alloc_mem(4000);
+    ASSERT_NOT_NULL("p should not be null", p);
+    memset(p, 'a', 4000);
+
+    char *q = realloc_mem(p, 1000);
+    ASSERT_PTR_EQUAL("shrinking should keep the block in place", p, q);
+
+    char expected[1000];
+    memset(expected, 'a', sizeof(expected));
+    ASSERT_MEM_EQUAL("shrunk block should keep its contents", expected, q, 1000);
+    free_mem(q);
+}
+
+TEST(realloc_mem_grows_into_next_free_block) {
+    char *p = alloc_mem(6000);
+    ASSERT_NOT_NULL("p should not be null", p);
+
+    p = realloc_mem(p, 2000);
+    ASSERT_NOT_NULL("p should not be null", p);
+    memset(p, 'b', 2000);
+
+    char *q = realloc_mem(p, 5000);
+    ASSERT_PTR_EQUAL("growing should absorb the freed tail in place", p, q);
+
+    char expected[2000];
+    memset(expected, 'b', sizeof(expected));
+    ASSERT_MEM_EQUAL("grown block should keep its contents", expected, q, 2000);
+    free_mem(q);
+}
+#endif
+
+TEST(realloc_mem_moves_when_next_block_is_used) {
+    char *p = alloc_mem(2000);
+    char *neighbour = alloc_mem(2000);
+    ASSERT_NOT_NULL("p should not be null", p);
+    ASSERT_NOT_NULL("neighbour should not be null", neighbour);
+    memset(p, 'c', 2000);
+    memset(neighbour, 'd', 2000);
+
+    char *q = realloc_mem(neighbour, 8000);
+    ASSERT_NOT_NULL("q should not be null", q);
+
+    char expected_p[2000], expected_q[2000];
+    memset(expected_p, 'c', sizeof(expected_p));
+    memset(expected_q, 'd', sizeof(expected_q));
+    ASSERT_MEM_EQUAL("moving should not touch the block next to it", expected_p, p, 2000);
+    ASSERT_MEM_EQUAL("moved block should keep its contents", expected_q, q, 2000);
+    free_mem(p);
+    free_mem(q);
+}
+
+TEST(realloc_mem_null_allocates) {
+    char *p = realloc_mem(NULL, 64);
+    ASSERT_NOT_NULL("realloc_mem(NULL) should allocate", p);
+    memset(p, 'e', 64);
+    free_mem(p);
+}
+
+TEST(alloc_aligned_mem_respects_alignment) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    for (size_t alignment = 8; alignment <= page; alignment *= 2) {
+        for (size_t size = 1; size < 5000; size = size * 3 + 1) {
+            char *p = alloc_aligned_mem(alignment, size);
+            ASSERT_NOT_NULL("aligned block should not be null", p);
+            ASSERT_UINTPTR_EQUAL("block should honour the alignment", 0,
+                                 (uintptr_t) p % alignment);
+            memset(p, 'x', size);
+            free_mem(p);
+        }
+    }
+}
+
+TEST(alloc_aligned_mem_large_block) {
+    char *p = alloc_aligned_mem(4096, 512 * 1024);
+    ASSERT_NOT_NULL("p should not be null", p);
+    ASSERT_UINTPTR_EQUAL("mapped block should honour the alignment", 0, (uintptr_t) p % 4096);
+    memset(p, 'x', 512 * 1024);
+
+    char *q = realloc_mem(p, 1024 * 1024);
+    ASSERT_NOT_NULL("q should not be null", q);
+    ASSERT_UINTPTR_EQUAL("remapped block should keep the alignment", 0, (uintptr_t) q % 4096);
+    free_mem(q);
+}
+
+TEST(alloc_aligned_mem_rejects_bad_alignment) {
+    ASSERT_NULL("non power of two alignment should fail", alloc_aligned_mem(24, 100));
+    ASSERT_NULL("zero alignment should fail", alloc_aligned_mem(0, 100));
+}
+
+TEST(alloc_aligned_mem_beyond_page_size) {
+    size_t alignments[] = {64 * 1024, 1024 * 1024, 2 * 1024 * 1024};
+    size_t sizes[] = {100, 100, 3 * 1024 * 1024};
+
+    for (int i = 0; i < 3; i++) {
+        char *p = alloc_aligned_mem(alignments[i], sizes[i]);
+        ASSERT_NOT_NULL("p should not be null", p);
+        ASSERT_UINTPTR_EQUAL("p should honour the alignment", 0, (uintptr_t) p % alignments[i]);
+        memset(p, 'x', sizes[i]);
+        free_mem(p);
+    }
+}
+
+TEST(alloc_aligned_mem_double_free_logs_error) {
+    char *p = alloc_aligned_mem(64, 100);
+    ASSERT_NOT_NULL("p should not be null", p);
+
+    int s, r;
+    capture_stderr_start(&s, &r);
+
+    free_mem(p);
+    free_mem(p);
+
+    char *out = capture_stderr_end(s, r);
+    ASSERT_STR_MATCH("double free of aligned block should log error", out, "double free");
+    free(out);
+}
+
+TEST(calloc_aligned_mem_success) {
+    long *p = calloc_aligned_mem(64, 100, sizeof(long));
+    ASSERT_NOT_NULL("p should not be null", p);
+    ASSERT_UINTPTR_EQUAL("p should be cache-line aligned", 0, (uintptr_t) p % 64);
+
+    long expected[100] = {0};
+    ASSERT_MEM_EQUAL("p values should be set to zero", expected, p, sizeof(expected));
+    free_mem(p);
+}
+
+#if ALLOC_HARDENING < ALLOC_DEBUG
+TEST(free_mem_coalesces_with_both_neighbours) {
+    char *block = alloc_mem(9000);
+    ASSERT_NOT_NULL("block should not be null", block);
+
+    char *head = realloc_mem(block, 3000);
+    ASSERT_PTR_EQUAL("shrinking should keep the block in place", block, head);
+
+    char *lower = alloc_mem(3000);
+    char *upper = alloc_mem(3000);
+    ASSERT_NOT_NULL("lower should not be null", lower);
+    ASSERT_NOT_NULL("upper should not be null", upper);
+
+    free_mem(upper);
+    free_mem(lower);
+
+    char *grown = realloc_mem(head, 9000);
+    ASSERT_PTR_EQUAL("freed neighbours should merge so the block can grow in place", head, grown);
+    free_mem(grown);
+}
+
+TEST(alloc_stats_tracks_live_allocations) {
+    alloc_stats_t before, during, after;
+    alloc_stats(&before);
+
+    char *small = alloc_mem(1000);
+    char *large = alloc_mem(200 * 1024);
+    ASSERT_NOT_NULL("small should not be null", small);
+    ASSERT_NOT_NULL("large should not be null", large);
+
+    alloc_stats(&during);
+    ASSERT_ULONG_EQUAL("both allocations should be live", before.live_allocations + 2,
+                       during.live_allocations);
+    ASSERT_ULONG_EQUAL("requested bytes should add up", before.requested_bytes + 1000 + 200 * 1024,
+                       during.requested_bytes);
+    ASSERT_ULONG_EQUAL("large block should be mapped", before.mmap_blocks + 1, during.mmap_blocks);
+    ASSERT_TRUE("mapping should cover the large block", during.mmap_bytes >= 200 * 1024);
+
+    small = realloc_mem(small, 1500);
+    alloc_stats(&during);
+    ASSERT_ULONG_EQUAL("realloc should update requested bytes",
+                       before.requested_bytes + 1500 + 200 * 1024, during.requested_bytes);
+
+    free_mem(small);
+    free_mem(large);
+
+    alloc_stats(&after);
+    ASSERT_ULONG_EQUAL("freed allocations should not be live", before.live_allocations,
+                       after.live_allocations);
+    ASSERT_ULONG_EQUAL("freed allocations should not count", before.requested_bytes,
+                       after.requested_bytes);
+    ASSERT_ULONG_EQUAL("mapping should be gone", before.mmap_blocks, after.mmap_blocks);
+}
+
+TEST(alloc_stats_describes_free_lists) {
+    char *blocks[8];
+    for (int i = 0; i < 8; i++)
+        blocks[i] = alloc_mem(5000);
+    for (int i = 0; i < 8; i += 2)
+        free_mem(blocks[i]);
+
+    alloc_stats_t stats;
+    alloc_stats(&stats);
+
+    size_t counted = 0;
+    for (int i = 0; i < ALLOC_HISTOGRAM_BUCKETS; i++)
+        counted += stats.free_histogram[i];
+    ASSERT_ULONG_EQUAL("histogram should count every free block", stats.free_blocks, counted);
+    ASSERT_TRUE("heap should hold free blocks", stats.free_blocks >= 4);
+    ASSERT_TRUE("largest free block should fit in the free bytes",
+                stats.largest_free_block >= 5000 && stats.largest_free_block <= stats.free_bytes);
+    ASSERT_TRUE("heap should cover the free bytes", stats.heap_bytes >= stats.free_bytes);
+    ASSERT_TRUE("fragmentation should be a ratio",
+                stats.fragmentation >= 0.0 && stats.fragmentation < 1.0);
+
+    for (int i = 1; i < 8; i += 2)
+        free_mem(blocks[i]);
+}
+#endif
+
+TEST(heap_check_passes_on_consistent_heap) {
+    char *blocks[32];
+    for (int i = 0; i < 32; i++)
+        blocks[i] = alloc_mem((size_t) (i * 97) % 6000);
+    for (int i = 0; i < 32; i += 3)
+        free_mem(blocks[i]);
+
+    int s, r;
+    capture_stderr_start(&s, &r);
+    size_t problems = heap_check();
+    char *out = capture_stderr_end(s, r);
+
+    ASSERT_ULONG_EQUAL("heap_check should find no problems", 0UL, problems);
+    ASSERT_TRUE("heap_check should not log anything", strlen(out) == 0);
+    free(out);
+
+    for (int i = 0; i < 32; i++)
+        if (i % 3 != 0)
+            free_mem(blocks[i]);
+}
+
+TEST(heap_check_reports_corrupted_header) {
+    char *p = alloc_mem(1000);
+    ASSERT_NOT_NULL("p should not be null", p);
+
+    /* the header's magic sits in the word right below the user pointer */
+    char saved[4];
+    memcpy(saved, p - 8, sizeof(saved));
+    memset(p - 8, 0, sizeof(saved));
+
+    int s, r;
+    capture_stderr_start(&s, &r);
+    size_t problems = heap_check();
+    char *out = capture_stderr_end(s, r);
+
+    ASSERT_TRUE("heap_check should find the corrupted header", problems >= 1);
+    ASSERT_STR_MATCH("heap_check should report the bad magic", out, "bad magic");
+    free(out);
+
+    memcpy(p - 8, saved, sizeof(saved));
+    ASSERT_ULONG_EQUAL("restored header should pass", 0UL, heap_check());
+    free_mem(p);
+}
+
+TEST(usable_size_mem_covers_request) {
+    size_t sizes[] = {0, 1, 100, 5000, 300 * 1024};
+    for (int i = 0; i < 5; i++) {
+        char *p = alloc_mem(sizes[i]);
+        ASSERT_NOT_NULL("p should not be null", p);
+
+        size_t usable = usable_size_mem(p);
+        ASSERT_TRUE("usable size should cover the request", usable >= sizes[i]);
+        memset(p, 'x', usable);
+        free_mem(p);
+    }
+
+    ASSERT_ULONG_EQUAL("null pointer should have no usable size", 0UL, usable_size_mem(NULL));
+}
+
+#if ALLOC_HARDENING < ALLOC_DEBUG
+TEST(alloc_mem_small_blocks_have_no_header) {
+    alloc_stats_t before, during;
+    alloc_stats(&before);
+
+    char *p = alloc_mem(5);
+    ASSERT_NOT_NULL("p should not be null", p);
+    ASSERT_ULONG_EQUAL("a 5-byte block should take an 8-byte slot", 8UL, usable_size_mem(p));
+
+    alloc_stats(&during);
+    ASSERT_TRUE("small block should come from a slab", during.slab_bytes > 0);
+    ASSERT_ULONG_EQUAL("small block should be live", before.live_allocations + 1,
+                       during.live_allocations);
+
+    ASSERT_PTR_EQUAL("realloc within the slot should stay in place", p, realloc_mem(p, 7));
+    char *q = realloc_mem(p, 40);
+    ASSERT_NOT_NULL("q should not be null", q);
+    ASSERT_TRUE("growing past the slot should move the block", q != p);
+    ASSERT_ULONG_EQUAL("moved block should have a bigger slot", 48UL, usable_size_mem(q));
+    free_mem(q);
+
+    alloc_stats(&during);
+    ASSERT_ULONG_EQUAL("freed small blocks should not be live", before.live_allocations,
+                       during.live_allocations);
+    ASSERT_ULONG_EQUAL("freed small blocks should not count", before.requested_bytes,
+                       during.requested_bytes);
+}
+
+TEST(free_mem_slab_pointer_checks) {
+    char *p = alloc_mem(24);
+    ASSERT_NOT_NULL("p should not be null", p);
+
+    int s, r;
+    capture_stderr_start(&s, &r);
+
+    /* slabs are page aligned and start with their metadata */
+    free_mem((void *) ((uintptr_t) p & ~(uintptr_t) 4095));
+    free_mem(p + 8);
+    free_mem(p);
+    free_mem(p);
+
+    char *out = capture_stderr_end(s, r);
+    ASSERT_STR_MATCH("pointer into slab metadata should log error", out, "heap corruption");
+    ASSERT_STR_MATCH("double free of a small block should log error", out, "double free");
+    ASSERT_ULONG_EQUAL("slabs should stay consistent", 0UL, heap_check());
+    free(out);
+}
+#endif
+
+static void *free_small_blocks(void *arg) {
+    char **blocks = arg;
+    for (int i = 0; i < 1000; i++)
+        free_mem(blocks[i]);
+    return NULL;
+}
+
+TEST(free_mem_small_blocks_from_another_thread) {
+    char *blocks[1000];
+    for (int i = 0; i < 1000; i++) {
+        blocks[i] = alloc_mem(16);
+        ASSERT_NOT_NULL("block should not be null", blocks[i]);
+        memset(blocks[i], i, 16);
+    }
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, free_small_blocks, blocks);
+    pthread_join(thread, NULL);
+
+    char *again[1000];
+    for (int i = 0; i < 1000; i++)
+        again[i] = alloc_mem(16);
+    ASSERT_ULONG_EQUAL("slabs should stay consistent", 0UL, heap_check());
+    for (int i = 0; i < 1000; i++)
+        free_mem(again[i]);
+}
+
+#if ALLOC_HARDENING < ALLOC_DEBUG
+TEST(heap_spans_several_regions) {
+    enum { BLOCKS = 800 };
+    char **blocks = malloc(BLOCKS * sizeof(char *));
+    ASSERT_NOT_NULL("blocks should not be null", blocks);
+
+    /* 80 MiB of heap blocks cannot fit in one 64 MiB region */
+    for (int i = 0; i < BLOCKS; i++) {
+        blocks[i] = alloc_mem(100 * 1024);
+        ASSERT_NOT_NULL("block should not be null", blocks[i]);
+        blocks[i][0] = (char) i;
+    }
+    ASSERT_ULONG_EQUAL("heap should stay consistent across regions", 0UL, heap_check());
+
+    int s, r;
+    capture_stderr_start(&s, &r);
+    char *last = blocks[BLOCKS - 1];
+    free_mem(last);
+    free_mem(last);
+    free_mem(last + 40);
+    char *out = capture_stderr_end(s, r);
+    ASSERT_STR_MATCH("double free in a later region should log error", out, "double free");
+    ASSERT_STR_MATCH("offset pointer in a later region should log error", out, "heap corruption");
+    free(out);
+
+    for (int i = 0; i < BLOCKS - 1; i++)
+        free_mem(blocks[i]);
+    free(blocks);
+    trim_mem(0);
+}
+#endif
+
+TEST(alloc_huge_pages_keeps_heap_usable) {
+    if (alloc_huge_pages(1) != 0) {
+        ASSERT_TRUE("failure should come from missing kernel support", errno == EINVAL);
+        return;
+    }
+
+    char *p = alloc_mem(5000);
+    ASSERT_NOT_NULL("p should not be null", p);
+    memset(p, 'h', 5000);
+    ASSERT_ULONG_EQUAL("heap should stay consistent", 0UL, heap_check());
+    free_mem(p);
+
+    ASSERT_INT_EQUAL("huge pages should be turned off again", 0, alloc_huge_pages(0));
+}
+
+#if ALLOC_HARDENING == ALLOC_DEBUG
+/* runs touch on a fresh 100-byte block in a child process and returns the signal that ended it,
+ * or 0 if it exited normally */
+static int child_signal(void (*touch)(char *)) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        touch(alloc_mem(100));
+        _exit(0);
+    }
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+}
+
+static void write_past_end(char *p) {
+    p[usable_size_mem(p)] = 'x';
+}
+
+static void read_after_free(char *p) {
+    free_mem(p);
+    *(volatile char *) p;
+}
+
+TEST(guarded_block_overflow_faults) {
+    ASSERT_INT_EQUAL("writing past the block should hit the guard page", SIGSEGV,
+                     child_signal(write_past_end));
+}
+
+TEST(quarantined_block_access_faults) {
+    ASSERT_INT_EQUAL("reading a freed block should fault", SIGSEGV,
+                     child_signal(read_after_free));
+}
+
+TEST(guarded_block_sits_against_guard_page) {
+    size_t sizes[] = {1, 8, 100, 5000};
+    for (int i = 0; i < 4; i++) {
+        char *p = alloc_mem(sizes[i]);
+        ASSERT_NOT_NULL("p should not be null", p);
+        ASSERT_TRUE("block should end within its alignment of the guard page",
+                    usable_size_mem(p) - sizes[i] < 16);
+        memset(p, 'g', usable_size_mem(p));
+        free_mem(p);
+    }
+}
+#endif
@@ -0,0 +1,92 @@
+#include "arena.h"
+#include "test.h"
+#include <stdint.h>
+#include <string.h>
+
+TEST(arena_alloc_returns_aligned_memory) {
+    arena_t *arena = arena_create(0);
+    ASSERT_NOT_NULL("arena should not be null", arena);
+
+    for (size_t size = 1; size < 100; size += 7) {
+        void *p = arena_alloc(arena, size);
+        ASSERT_NOT_NULL("p should not be null", p);
+        ASSERT_UINTPTR_EQUAL("p should be 16-byte aligned", 0, (uintptr_t) p % 16);
+    }
+
+    arena_destroy(arena);
+}
+
+TEST(arena_alloc_does_not_overlap) {
+    arena_t *arena = arena_create(256);
+    ASSERT_NOT_NULL("arena should not be null", arena);
+
+    char *ptrs[64];
+    for (int i = 0; i < 64; i++) {
+        ptrs[i] = arena_alloc(arena, 40);
+        ASSERT_NOT_NULL("p should not be null", ptrs[i]);
+        memset(ptrs[i], i, 40);
+    }
+
+    for (int i = 0; i < 64; i++) {
+        char expected[40];
+        memset(expected, i, sizeof(expected));
+        ASSERT_MEM_EQUAL("allocation should keep its contents", expected, ptrs[i], 40);
+    }
+
+    arena_destroy(arena);
+}
+
+TEST(arena_alloc_oversized_request) {
+    arena_t *arena = arena_create(1024);
+    ASSERT_NOT_NULL("arena should not be null", arena);
+
+    char *small = arena_alloc(arena, 16);
+    char *big = arena_alloc(arena, 100000);
+    char *after = arena_alloc(arena, 16);
+    ASSERT_NOT_NULL("big should not be null", big);
+    memset(big, 'x', 100000);
+
+    ASSERT_TRUE("small allocations should keep using the current chunk",
+                after > small && after < small + 1024);
+
+    arena_destroy(arena);
+}
+
+TEST(arena_alloc_refuses_overflowing_size) {
+    arena_t *arena = arena_create(1024);
+    ASSERT_NOT_NULL("arena should not be null", arena);
+
+    ASSERT_NULL("a size that wraps with the alignment padding should fail",
+                arena_alloc(arena, SIZE_MAX - 1));
+    ASSERT_NULL("SIZE_MAX should fail", arena_alloc(arena, SIZE_MAX));
+
+    arena_destroy(arena);
+}
+
+TEST(arena_reset_reuses_chunks) {
+    arena_t *arena = arena_create(4096);
+    ASSERT_NOT_NULL("arena should not be null", arena);
+
+    char *first = arena_alloc(arena, 100);
+    for (int i = 0; i < 100; i++)
+        arena_alloc(arena, 100);
+
+    arena_reset(arena);
+
+    char *again = arena_alloc(arena, 100);
+    ASSERT_PTR_EQUAL("reset should start over at the first chunk", first, again);
+
+    arena_destroy(arena);
+}
+
+TEST(arena_dup_copies_bytes) {
+    arena_t *arena = arena_create(0);
+    ASSERT_NOT_NULL("arena should not be null", arena);
+
+    char *copy = arena_dup(arena, "hello", 6);
+    ASSERT_NOT_NULL("copy should not be null", copy);
+    ASSERT_STR_EQUAL("copy should match the source", "hello", copy, 6);
+    ASSERT_NULL("dup of NULL should be NULL", arena_dup(arena, NULL, 4));
+
+    arena_destroy(arena);
+}
@@ -0,0 +1,97 @@
+#include "pool.h"
+#include "test.h"
+#include <stdint.h>
+#include <string.h>
+
+typedef struct {
+    uint64_t hash;
+    void *key;
+    size_t key_len;
+    void *val;
+    size_t val_len;
+} record_t;
+
+TEST(pool_alloc_returns_distinct_objects) {
+    pool_t *pool = pool_create(sizeof(record_t), 16);
+    ASSERT_NOT_NULL("pool should not be null", pool);
+
+    record_t *objs[100];
+    for (int i = 0; i < 100; i++) {
+        objs[i] = pool_alloc(pool);
+        ASSERT_NOT_NULL("object should not be null", objs[i]);
+        memset(objs[i], i, sizeof(record_t));
+    }
+
+    for (int i = 0; i < 100; i++) {
+        record_t expected;
+        memset(&expected, i, sizeof(expected));
+        ASSERT_MEM_EQUAL("object should keep its contents", &expected, objs[i], sizeof(record_t));
+        ASSERT_UINTPTR_EQUAL("object should be pointer aligned", 0,
+                             (uintptr_t) objs[i] % sizeof(void *));
+    }
+
+    pool_destroy(pool);
+}
+
+TEST(pool_free_reuses_object) {
+    pool_t *pool = pool_create(sizeof(record_t), 0);
+    ASSERT_NOT_NULL("pool should not be null", pool);
+
+    void *a = pool_alloc(pool);
+    pool_free(pool, a);
+    void *b = pool_alloc(pool);
+    ASSERT_PTR_EQUAL("freed object should be handed out again", a, b);
+
+    pool_destroy(pool);
+}
+
+TEST(pool_stats_track_usage) {
+    pool_t *pool = pool_create(40, 8);
+    ASSERT_NOT_NULL("pool should not be null", pool);
+
+    void *objs[20];
+    for (int i = 0; i < 20; i++)
+        objs[i] = pool_alloc(pool);
+    for (int i = 0; i < 5; i++)
+        pool_free(pool, objs[i]);
+
+    pool_stats_t stats;
+    pool_stats(pool, &stats);
+    ASSERT_ULONG_EQUAL("object size should be kept", 40UL, stats.object_size);
+    ASSERT_ULONG_EQUAL("slab count should cover all objects", 3UL, stats.slabs);
+    ASSERT_ULONG_EQUAL("objects in use should be tracked", 15UL, stats.objects_in_use);
+
+    pool_destroy(pool);
+}
+
+TEST(pool_release_empty_frees_unused_slabs) {
+    pool_t *pool = pool_create(sizeof(record_t), 8);
+    ASSERT_NOT_NULL("pool should not be null", pool);
+
+    record_t *objs[32];
+    for (int i = 0; i < 32; i++)
+        objs[i] = pool_alloc(pool);
+
+    for (int i = 0; i < 32; i++) {
+        if (i != 3 && i != 20) pool_free(pool, objs[i]);
+    }
+
+    ASSERT_ULONG_EQUAL("two empty slabs should be released", 2UL, pool_release_empty(pool));
+
+    pool_stats_t stats;
+    pool_stats(pool, &stats);
+    ASSERT_ULONG_EQUAL("two slabs should remain", 2UL, stats.slabs);
+    ASSERT_ULONG_EQUAL("two objects should be in use", 2UL, stats.objects_in_use);
+
+    for (int i = 0; i < 14; i++) {
+        record_t *obj = pool_alloc(pool);
+        ASSERT_NOT_NULL("object should not be null", obj);
+        memset(obj, 0xFF, sizeof(record_t));
+    }
+    pool_stats(pool, &stats);
+    ASSERT_ULONG_EQUAL("remaining free objects should be reused first", 2UL, stats.slabs);
+
+    pool_free(pool, objs[3]);
+    pool_free(pool, objs[20]);
+    pool_destroy(pool);
+}
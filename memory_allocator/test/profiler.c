@@ -0,0 +1,116 @@
+#define _GNU_SOURCE
+#include "profiler.h"
+#include "allocator.h"
+#include "test.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROFILED_BLOCKS 64
+
+static char *dump_profile(void) {
+    FILE *file = tmpfile();
+    if (!file)
+        return NULL;
+
+    char *out = NULL;
+    if (profiler_dump(fileno(file)) == 0) {
+        long len = lseek(fileno(file), 0, SEEK_END);
+        out = calloc(1, (size_t) len + 1);
+        if (out && pread(fileno(file), out, (size_t) len, 0) != len) {
+            free(out);
+            out = NULL;
+        }
+    }
+
+    fclose(file);
+    return out;
+}
+
+static size_t sampled_objects(const char *profile) {
+    size_t objects = 0;
+    sscanf(profile, "heap profile: %zu:", &objects);
+    return objects;
+}
+
+/* the first countdown after the profiler starts only arms the sampling */
+static void start_sampling_everything(void) {
+    profiler_start(1);
+    free_mem(alloc_mem(2 * 1024 * 1024));
+}
+
+TEST(profiler_dump_attributes_live_samples) {
+    start_sampling_everything();
+
+    char *blocks[PROFILED_BLOCKS];
+    for (int i = 0; i < PROFILED_BLOCKS; i++)
+        blocks[i] = alloc_mem(1000);
+
+    char *out = dump_profile();
+    ASSERT_NOT_NULL("profile should be written", out);
+    ASSERT_STR_MATCH("profile should use the heap_v2 format", out, "@ heap_v2/1\n");
+    ASSERT_STR_MATCH("allocations from one call site should be aggregated", out,
+                     "    64:    64000 [0: 0] @ 0x");
+    ASSERT_STR_MATCH("profile should list the mappings", out, "\nMAPPED_LIBRARIES:\n");
+    size_t live = sampled_objects(out);
+    free(out);
+
+    for (int i = 0; i < PROFILED_BLOCKS; i++)
+        free_mem(blocks[i]);
+
+    out = dump_profile();
+    ASSERT_NOT_NULL("profile should be written", out);
+    ASSERT_ULONG_EQUAL("freed blocks should leave the profile", live - PROFILED_BLOCKS,
+                       sampled_objects(out));
+    free(out);
+
+    profiler_stop();
+}
+
+TEST(profiler_stop_takes_no_more_samples) {
+    start_sampling_everything();
+    profiler_stop();
+
+    char *before = dump_profile();
+    char *block = alloc_mem(1000);
+    char *after = dump_profile();
+
+    ASSERT_NOT_NULL("profile should be written", before);
+    ASSERT_NOT_NULL("profile should be written", after);
+    ASSERT_ULONG_EQUAL("no sample should be taken after stopping", sampled_objects(before),
+                       sampled_objects(after));
+
+    free(before);
+    free(after);
+    free_mem(block);
+}
+
+TEST(profiler_dump_on_signal_writes_file) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/profiler_test_%d.heap", (int) getpid());
+    unlink(path);
+
+    ASSERT_INT_EQUAL("handler should be installed", 0, profiler_dump_on_signal(SIGUSR2, path));
+    raise(SIGUSR2);
+
+    /* the dump is written by a background thread */
+    char buf[32] = {0};
+    struct timespec pause = {0, 10 * 1000 * 1000};
+    for (int tries = 0; tries < 200 && strlen(buf) == 0; tries++) {
+        nanosleep(&pause, NULL);
+        int fd = open(path, O_RDONLY);
+        if (fd >= 0) {
+            ssize_t n = read(fd, buf, sizeof(buf) - 1);
+            buf[n > 0 ? n : 0] = '\0';
+            close(fd);
+        }
+    }
+
+    ASSERT_STR_MATCH("signal should dump the profile", buf, "heap profile:");
+    signal(SIGUSR2, SIG_DFL);
+    unlink(path);
+}